@@ -2,67 +2,253 @@
 // Designed and developed by Kobi Chambers - Griffith University
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
-// Define globals
-#define MAX_TEST_SIZE 10
+#include "multiset.h"
+#include "query_server.h"
 
-int *number_array = NULL;
-int *counts_array = NULL;
-int range, len;
-int r1;
+// Define globals
+// Text input is streamed through a fixed buffer rather than read whole
+#define INPUT_CHUNK_BYTES (1 << 20)
+#define INPUT_INITIAL_CAPACITY (1 << 16)
+
+// The clustered distribution draws from CLUSTER_COUNT hot spots, each
+// covering 1 / CLUSTER_SPREAD of the range
+#define CLUSTER_COUNT 16
+#define CLUSTER_SPREAD 1024
+#define DEFAULT_ZIPF_THETA 0.99
+
+// Latencies are counted in nanoseconds with 2^LATENCY_SUB_BITS buckets per
+// power of two, so each bucket is within ~3% of the values it holds
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// Distribution the numbers and operation values are drawn from
+typedef enum {
+  UNIFORM_DIST,
+  ZIPF_DIST,
+  SEQUENTIAL_DIST,
+  CLUSTERED_DIST
+} distribution;
+
+// xoshiro256** generator. sequence is the next offset the sequential
+// distribution hands out from this stream
+typedef struct {
+  uint64_t state[4];
+  long sequence;
+} random_stream;
+
+// Log-bucketed latencies of one operation type, in the style of an HDR
+// histogram. Values below LATENCY_SUB_BUCKETS are exact, and every power of
+// two above splits into LATENCY_SUB_BUCKETS equal buckets
+typedef struct {
+  uint64_t buckets[LATENCY_BUCKETS];
+  uint64_t count, total, max;
+} latency_histogram;
+
+// State of one thread running the benchmark operation mix
+typedef struct {
+  pthread_t thread;
+  random_stream random;
+  long num_operations;
+  latency_histogram latencies[7];
+} worker;
+
+// The set being benchmarked, split into num_shards shards
+multiset *set;
+int num_shards;
+int num_threads = 1;
+int batch_size;  // Finds, adds and deletes are applied in batches when set
+int time_every = 1;  // Operations timed together by one pair of clock reads
+double startup_time;
+
+// Numbers are read from input_path instead of generated when it is set. A
+// binary file is mapped in place, text is parsed into an owned array. Wide
+// input holds int64_t numbers, otherwise they are int32_t
+const char *input_path;
+bool input_binary, input_wide;
+const void *input_numbers;
+bool input_mapped;
+size_t input_bytes;
+double input_time;
+
+// Shards are saved to save_path once loaded, or mapped from restore_path
+// instead of being loaded at all
+const char *save_path, *restore_path;
+size_t saved_bytes;
+double save_time;
+
+// Once loaded, the set is served at serve_path by num_workers threads instead
+// of being benchmarked
+const char *serve_path;
+int num_workers;
+
+// Large arrays are interleaved over NUMA nodes for numa_policy interleave,
+// or by default when several threads share them
+const char *numa_policy;
+
+// Every random stream is derived from random_seed. Generated numbers and
+// operation values follow workload, with the zipf_ constants precomputed for
+// rejection-inversion sampling
+int random_seed = 1;
+distribution workload = UNIFORM_DIST;
+double zipf_theta = DEFAULT_ZIPF_THETA;
+double zipf_h_first, zipf_h_last, zipf_cutoff;
+value_t cluster_centres[CLUSTER_COUNT];
+value_t cluster_width;
+
+// Benchmark settings. Operations are drawn with operation_weights, in find,
+// add, delete, succ, pred, min, max order, and the results are appended to
+// report_path when it is set
+int operation_weights[7] = {1, 1, 1, 1, 1, 1, 1};
+int operation_cumulative[7];
+long bench_operations, warmup_operations;
+int num_repeats = 1;
+const char *report_path;
+bool report_json;
+const char *report_label = "";
+
+const char *operation_names[] = {"find", "add",  "delete", "succ",
+                                 "pred", "min", "max"};
+const char *distribution_names[] = {"uniform", "zipf", "sequential",
+                                    "clustered"};
+const char *memory_names[] = {"counters", "overflow", "bitmap",
+                              "blocks",   "runs",     "leaves",
+                              "internals", "shards", "scratch"};
+
+value_t range;
+value_t r1;
 
 // Function prototypes
-bool process_arguments(int argc, char *argv[], int *n, int *r2);
-
-void generate_array(int n);
-void store_counts(int n);
-void store_numbers();
-
-void drive(int *n, int *r2);
+bool process_arguments(int argc, char *argv[], long *n, value_t *r2);
+bool process_option(const char *name, const char *value);
+bool parse_mix(const char *value);
+
+void generate_array(long n);
+void fill_numbers(void *context, int thread, long first, long count,
+                  value_t *values);
+void save_snapshot();
+void restore_snapshot(long *n, value_t *r2);
+
+void read_input(long *n);
+const void *map_binary_input(int fd, long *count);
+int64_t *parse_text_input(int fd, long *count);
+void free_input();
+
+void init_workload();
+void stream_init(random_stream *r, uint64_t stream);
+uint64_t stream_next(random_stream *r);
+uint32_t stream_bounded(random_stream *r, uint32_t bound);
+uint64_t stream_bounded64(random_stream *r, uint64_t bound);
+double stream_double(random_stream *r);
+value_t draw_offset(random_stream *r);
+int draw_operation(random_stream *r);
+value_t zipf_rank(random_stream *r);
+double zipf_h(double x);
+double zipf_h_integral(double x);
+double zipf_h_integral_inverse(double x);
+double log1p_ratio(double x);
+double expm1_ratio(double x);
+
+void drive(long *n, value_t *r2);
+double print_summary(long n, value_t r2);
+void serve(long n, value_t r2);
+double drive_threads(long num_operations, int run,
+                     latency_histogram *latencies);
+void *run_worker(void *arg);
+void apply_operation(int operation, value_t value);
+void flush_batch(batch_op *ops, int num_ops, latency_histogram *latencies);
+void flush_timed(const int *types, int num_ops, uint64_t start,
+                 latency_histogram *latencies);
+void print_latencies(latency_histogram *latencies);
+void write_report(long n, value_t r2, long num_operations, double memory,
+                  const latency_histogram *latencies, const double *rates);
+void rate_statistics(const double *rates, double *mean, double *stddev);
+
+void latency_record(latency_histogram *h, uint64_t nanos, uint64_t count);
+void latency_merge(latency_histogram *into, const latency_histogram *from);
+uint64_t latency_percentile(const latency_histogram *h, double quantile);
+int latency_bucket(uint64_t nanos);
+uint64_t latency_bucket_value(int bucket);
+void print_migrations();
+void print_memory(const multiset_stats *stats);
 
 void functionality_test();
-void print_array_state(int minimum, int maximum);
-void run_tests(int index, int *counter);
-void run_final_tests(int value);
-
-int find(int value);
-int add(int value);
-int delete(int value);
-int pred(int value);
-int succ(int value);
-int min();
-int max();
-
+void print_array_state(value_t minimum, value_t maximum);
+void run_tests(value_t value);
+void run_final_tests(value_t value);
+void run_range_tests(value_t minimum, value_t maximum);
+void print_range_entry(value_t value, long count, void *context);
+
+int add_number(value_t value);
+void exit_with_set_error();
 bool is_valid_int(const char *str);
-int rand_in_range();
-int compare(const void *a, const void *b);
-int binary_search(int value, int *count);
-int find_nearest_space(int index);
-int shift_array(int index, int insertion);
-void free_memory();
+bool is_valid_number(const char *str);
+value_t rand_in_range(random_stream *r);
+double now_seconds();
+uint64_t now_nanos();
+void read_rss(double *current, double *peak);
+double read_huge_pages();
 
 ////////////////////////////////
 // MAIN AND UTILITY FUNCTIONS //
 ////////////////////////////////
 
 int main(int argc, char *argv[]) {
-  int n, r2;
-  // srand(time(NULL)); // UNCOMMENT TO GET RANDOM SEED
+  long n;
+  value_t r2;
 
   if (process_arguments(argc, argv, &n, &r2)) {
-    range = (int)(r2 - r1 + 1);
+    double start = now_seconds();
 
-    generate_array(abs(n));
+    if (restore_path) {
+      restore_snapshot(&n, &r2);
+      init_workload();
+    } else {
+      range = r2 - r1 + 1;
+      init_workload();
+      set = multiset_create(r1, r2, num_shards);
 
-    drive(&n, &r2);
+      if (!set) {
+        exit_with_set_error();
+      }
 
-    free_memory();
+      if (input_path) {
+        read_input(&n);
+      }
+
+      generate_array(labs(n));
+      free_input();
+    }
+
+    startup_time = now_seconds() - start;
+
+    if (save_path) {
+      save_snapshot();
+    }
+
+    if (serve_path) {
+      serve(labs(n), r2);
+    } else {
+      drive(&n, &r2);
+    }
+
+    multiset_destroy(set);
 
     return 0;
   } else {
@@ -71,34 +257,45 @@ int main(int argc, char *argv[]) {
 }
 
 // Function to process user input arguments and perform error checking
-bool process_arguments(int argc, char *argv[], int *n, int *r2) {
-  if (argc != 4) {
-    printf("Format as: ./analyse_nums <n> <r1> <r2>\n");
+bool process_arguments(int argc, char *argv[], long *n, value_t *r2) {
+  if (argc < 4 || argc % 2 != 0) {
+    printf(
+        "Format as: ./analyse_nums <n> <r1> <r2> [--threads <t>] "
+        "[--shards <s>] [--batch <b>] [--input <file>] "
+        "[--format <text|binary|binary64>] [--save <file>] "
+        "[--restore <file>] "
+        "[--seed <s>] [--distribution <uniform|zipf|sequential|clustered>] "
+        "[--theta <t>] [--time-every <k>] [--mix <preset|weights>] "
+        "[--ops <k>] [--warmup <k>] [--repeat <r>] [--report <file>] "
+        "[--report-format <csv|json>] [--label <name>] "
+        "[--simd <scalar|sse4.2|avx2>] [--serve <socket>] "
+        "[--workers <w>] [--pages <base|thp|huge>] "
+        "[--numa <local|interleave>]\n");
     return false;
   }
 
-  if (!is_valid_int(argv[1])) {
+  if (!is_valid_number(argv[1])) {
     printf(
         "Error for input (n): argv[1] should be a non-zero integer value.\n");
     return false;
   }
 
-  if (!is_valid_int(argv[2])) {
+  if (!is_valid_number(argv[2])) {
     printf(
         "Error for input (r1): argv[2] should be a positive integer value.\n");
     return false;
   }
 
-  if (!is_valid_int(argv[3])) {
+  if (!is_valid_number(argv[3])) {
     printf(
         "Error for input (r2): argv[3] should be a positive integer value.\n");
     return false;
   }
 
   // Set pointer values
-  *n = (int)strtol(argv[1], NULL, 10);
-  r1 = (int)strtol(argv[2], NULL, 10);
-  *r2 = (int)strtol(argv[3], NULL, 10);
+  *n = strtol(argv[1], NULL, 10);
+  r1 = strtoll(argv[2], NULL, 10);
+  *r2 = strtoll(argv[3], NULL, 10);
 
   if (r1 >= *r2) {
     printf("Error: r2 should be greater than r1.\n");
@@ -110,612 +307,1516 @@ bool process_arguments(int argc, char *argv[], int *n, int *r2) {
     return false;
   }
 
+  // One past r2 must still be representable
+  if (*r2 == INT64_MAX) {
+    printf("Error: r2 should be below %" PRId64 ".\n", (value_t)INT64_MAX);
+    return false;
+  }
+
+  // Optional settings follow the positional arguments as name value pairs
+  for (int i = 4; i < argc; i += 2) {
+    if (!process_option(argv[i], argv[i + 1])) {
+      return false;
+    }
+  }
+
+  if (input_path && restore_path) {
+    printf("Error: --input and --restore can't be used together.\n");
+    return false;
+  }
+
+  if (num_workers == 0) {
+    num_workers = num_threads;
+  }
+
+  multiset_interleave_pages(numa_policy ? strcmp(numa_policy, "interleave") == 0
+                                        : num_threads > 1);
+
+  // Give each thread several shards so they rarely meet on the same lock
+  if (num_shards == 0) {
+    num_shards = num_threads > 1 ? 4 * num_threads : 1;
+  }
+
   return true;
 }
 
-// Utility function to generate a memory efficient array, and set global
-// variable for array length
-void generate_array(int n) {
-  if (range < n) {
-    len = range - 1;
-    store_counts(n);
+// Function to check and apply a single --name value option
+bool process_option(const char *name, const char *value) {
+  int *setting;
+
+  if (strcmp(name, "--input") == 0) {
+    input_path = value;
+    return true;
+  }
+
+  if (strcmp(name, "--save") == 0) {
+    save_path = value;
+    return true;
+  }
+
+  if (strcmp(name, "--restore") == 0) {
+    restore_path = value;
+    return true;
+  }
+
+  if (strcmp(name, "--serve") == 0) {
+    serve_path = value;
+    return true;
+  }
+
+  if (strcmp(name, "--format") == 0) {
+    if (strcmp(value, "binary") != 0 && strcmp(value, "binary64") != 0 &&
+        strcmp(value, "text") != 0) {
+      printf(
+          "Error for option --format: should be text, binary or "
+          "binary64.\n");
+      return false;
+    }
+
+    input_binary = strcmp(value, "text") != 0;
+    input_wide = strcmp(value, "binary64") == 0;
+    return true;
+  }
+
+  // Caps the search kernels, so vector and scalar searches can be compared
+  if (strcmp(name, "--simd") == 0) {
+    if (!multiset_limit_search(value)) {
+      printf("Error for option --simd: should be scalar, sse4.2 or avx2.\n");
+      return false;
+    }
+    return true;
+  }
+
+  // Picks the pages behind large arrays, so TLB misses on base pages can be
+  // compared with huge pages
+  if (strcmp(name, "--pages") == 0) {
+    if (!multiset_use_pages(value)) {
+      printf("Error for option --pages: should be base, thp or huge.\n");
+      return false;
+    }
+    return true;
+  }
+
+  if (strcmp(name, "--numa") == 0) {
+    if (strcmp(value, "local") != 0 && strcmp(value, "interleave") != 0) {
+      printf("Error for option --numa: should be local or interleave.\n");
+      return false;
+    }
+
+    numa_policy = value;
+    return true;
+  }
+
+  if (strcmp(name, "--distribution") == 0) {
+    for (int i = UNIFORM_DIST; i <= CLUSTERED_DIST; ++i) {
+      if (strcmp(value, distribution_names[i]) == 0) {
+        workload = (distribution)i;
+        return true;
+      }
+    }
+
+    printf(
+        "Error for option --distribution: should be uniform, zipf, "
+        "sequential or clustered.\n");
+    return false;
+  }
+
+  if (strcmp(name, "--mix") == 0) {
+    if (!parse_mix(value)) {
+      printf(
+          "Error for option --mix: should be balanced, read-heavy, "
+          "write-heavy or 7 comma separated weights.\n");
+      return false;
+    }
+    return true;
+  }
+
+  if (strcmp(name, "--report") == 0) {
+    report_path = value;
+    return true;
+  }
+
+  if (strcmp(name, "--report-format") == 0) {
+    if (strcmp(value, "csv") != 0 && strcmp(value, "json") != 0) {
+      printf("Error for option --report-format: should be csv or json.\n");
+      return false;
+    }
+
+    report_json = strcmp(value, "json") == 0;
+    return true;
+  }
+
+  // Labels are written unquoted into CSV, so keep them to plain characters
+  if (strcmp(name, "--label") == 0) {
+    for (const char *c = value; *c; ++c) {
+      if (!isalnum((unsigned char)*c) && !strchr("-_.", *c)) {
+        printf(
+            "Error for option --label: should only use letters, digits, "
+            "'-', '_' and '.'.\n");
+        return false;
+      }
+    }
+
+    report_label = value;
+    return true;
+  }
+
+  if (strcmp(name, "--theta") == 0) {
+    char *endptr;
+    zipf_theta = strtod(value, &endptr);
+
+    if (*endptr != '\0' || !(zipf_theta > 0.0)) {
+      printf("Error for option --theta: should be a positive number.\n");
+      return false;
+    }
+    return true;
+  }
+
+  // Operation counts are long, so a run can go well past 2^31 operations
+  if (strcmp(name, "--ops") == 0 || strcmp(name, "--warmup") == 0) {
+    char *endptr;
+    errno = 0;
+    long operations = strtol(value, &endptr, 10);
+
+    if (*value == '\0' || *endptr != '\0' || errno == ERANGE ||
+        operations < 1) {
+      printf("Error for option %s: should be a positive integer value.\n",
+             name);
+      return false;
+    }
+
+    if (strcmp(name, "--ops") == 0) {
+      bench_operations = operations;
+    } else {
+      warmup_operations = operations;
+    }
+    return true;
+  }
+
+  if (strcmp(name, "--threads") == 0) {
+    setting = &num_threads;
+  } else if (strcmp(name, "--shards") == 0) {
+    setting = &num_shards;
+  } else if (strcmp(name, "--batch") == 0) {
+    setting = &batch_size;
+  } else if (strcmp(name, "--seed") == 0) {
+    setting = &random_seed;
+  } else if (strcmp(name, "--time-every") == 0) {
+    setting = &time_every;
+  } else if (strcmp(name, "--repeat") == 0) {
+    setting = &num_repeats;
+  } else if (strcmp(name, "--workers") == 0) {
+    setting = &num_workers;
   } else {
-    len = (int)ceil(n * 1.1);
-    store_numbers(r1);
+    printf("Error: unknown option %s.\n", name);
+    return false;
+  }
+
+  if (!is_valid_int(value) || strtol(value, NULL, 10) < 1) {
+    printf("Error for option %s: should be a positive integer value.\n",
+           name);
+    return false;
   }
+
+  *setting = (int)strtol(value, NULL, 10);
+  return true;
 }
 
-// Generate and store random number counts in an array
-void store_counts(int n) {
-  counts_array = (int *)calloc(range, sizeof(int));
+// Utility function to set operation_weights from a preset name or seven comma
+// separated weights, at least one of them above zero
+bool parse_mix(const char *value) {
+  const char *presets[] = {"balanced", "read-heavy", "write-heavy"};
+  const int preset_weights[][7] = {{1, 1, 1, 1, 1, 1, 1},
+                                   {80, 5, 5, 4, 4, 1, 1},
+                                   {10, 40, 40, 4, 4, 1, 1}};
+
+  for (int i = 0; i < 3; ++i) {
+    if (strcmp(value, presets[i]) == 0) {
+      memcpy(operation_weights, preset_weights[i], sizeof(operation_weights));
+      return true;
+    }
+  }
+
+  int weights[7];
+  int total = 0;
+  const char *c = value;
 
-  if (!counts_array) {
-    printf("Memory allocation failed.\n");
-    exit(1);
+  for (int i = 0; i < 7; ++i) {
+    char *endptr;
+    long weight = strtol(c, &endptr, 10);
+
+    if (endptr == c || !isdigit((unsigned char)*c) || weight > 1000000 ||
+        *endptr != (i < 6 ? ',' : '\0')) {
+      return false;
+    }
+
+    weights[i] = (int)weight;
+    total += weights[i];
+    c = endptr + 1;
   }
 
-  for (int i = 0; i < n; ++i) {
-    int number = rand_in_range();
-    ++counts_array[number - r1];
+  if (total == 0) {
+    return false;
   }
+
+  memcpy(operation_weights, weights, sizeof(operation_weights));
+  return true;
 }
 
-// Generate and store random numbers in an array
-void store_numbers() {
-  // Allow 10% additional memory
-  number_array = (int *)malloc(len * sizeof(int));
+// Utility function to fill the set with n numbers, taken from the input when
+// there is one and drawn from the workload otherwise. Each load thread draws
+// from a stream of its own
+void generate_array(long n) {
+  multiset_source source = {input_numbers, input_wide, fill_numbers, NULL};
+  random_stream *streams =
+      (random_stream *)malloc(num_threads * sizeof(random_stream));
 
-  if (!number_array) {
-    printf("Failed to allocate memory for number_array.\n");
+  if (!streams) {
+    printf("Failed to allocate memory for number generation.\n");
     exit(1);
   }
 
-  for (int i = 0; i < len; ++i) {
-    number_array[i] = rand_in_range();
+  for (int i = 0; i < num_threads; ++i) {
+    stream_init(&streams[i], i);
+  }
+
+  source.context = streams;
+
+  if (!multiset_load(set, &source, n, num_threads)) {
+    exit_with_set_error();
+  }
+
+  free(streams);
+}
+
+// Draw a load thread's next count numbers. The sequential distribution
+// carries on from the position of the first
+void fill_numbers(void *context, int thread, long first, long count,
+                  value_t *values) {
+  random_stream *r = &((random_stream *)context)[thread];
+
+  r->sequence = first;
+  for (long i = 0; i < count; ++i) {
+    values[i] = rand_in_range(r);
   }
+}
+
+// Utility function to save the loaded set to save_path, timing the save
+void save_snapshot() {
+  double start = now_seconds();
 
-  qsort(number_array, len, sizeof(int), compare);
+  if (!multiset_save(set, save_path, &saved_bytes)) {
+    exit_with_set_error();
+  }
 
-  // Remove 10% of numbers stored
-  if (len < 11) {
-    delete (number_array[len / 2]);
+  save_time = now_seconds() - start;
+}
+
+// Utility function to restore the set from restore_path, replacing r1, r2 and
+// the magnitude of n with the snapshot's
+void restore_snapshot(long *n, value_t *r2) {
+  multiset_stats stats;
+
+  set = multiset_restore(restore_path, num_threads);
+
+  if (!set) {
+    exit_with_set_error();
+  }
+
+  multiset_bounds(set, &r1, r2);
+  multiset_get_stats(set, &stats);
+
+  range = *r2 - r1 + 1;
+  *n = *n < 0 ? -stats.num_stored : stats.num_stored;
+}
+
+/////////////////////
+// INPUT FUNCTIONS //
+/////////////////////
+
+// Function to read the numbers to load from input_path, replacing the
+// magnitude of n with how many were read. The set checks they lie in [r1, r2]
+// as it loads them
+void read_input(long *n) {
+  double start = now_seconds();
+  int fd = open(input_path, O_RDONLY);
+  long count;
+
+  if (fd < 0) {
+    printf("Error: could not open input file %s.\n", input_path);
+    exit(1);
+  }
+
+  if (input_binary) {
+    input_numbers = map_binary_input(fd, &count);
+    input_mapped = true;
   } else {
-    for (int i = 9; i < len; i += 10) {
-      delete (number_array[i]);
-    }
+    input_numbers = parse_text_input(fd, &count);
+    input_wide = true;
   }
+
+  close(fd);
+
+  if (count == 0) {
+    printf("Error: input file %s holds no numbers.\n", input_path);
+    exit(1);
+  }
+
+  *n = *n < 0 ? -count : count;
+  input_time = now_seconds() - start;
 }
 
-//////////////////////
-// DRIVER FUNCTIONS //
-//////////////////////
+// Map a file of raw little endian int32 or int64 numbers read only, so they
+// are used where they lie without being copied
+const void *map_binary_input(int fd, long *count) {
+  struct stat info;
+  size_t width = input_wide ? sizeof(int64_t) : sizeof(int32_t);
 
-void drive(int *n, int *r2) {
-  size_t int_size, storage_size;
-  double memoryUsed;
+  if (fstat(fd, &info) < 0) {
+    printf("Error: could not read input file %s.\n", input_path);
+    exit(1);
+  }
 
-  bool testingFlag = false;
+  if (info.st_size % width != 0) {
+    printf("Error: input file %s is not a whole number of int%zu values.\n",
+           input_path, 8 * width);
+    exit(1);
+  }
 
-  if (*n < 0) {
-    testingFlag = true;
-    *n = abs(*n);
+  input_bytes = info.st_size;
+  *count = (long)(info.st_size / width);
+
+  if (*count == 0) {
+    return NULL;
   }
 
-  // Calculate approximate memory usage
-  int_size = sizeof(int);
+  void *data = mmap(NULL, input_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
 
-  storage_size = len * int_size;
-  memoryUsed = (double)storage_size / (1024 * 1024);
+  if (data == MAP_FAILED) {
+    printf("Error: could not map input file %s.\n", input_path);
+    exit(1);
+  }
 
-  printf("n = %d, r1 = %d, r2 = %d, Memory used = %.6f Mbytes\n", *n, r1, *r2,
-         memoryUsed);
+  madvise(data, input_bytes, MADV_SEQUENTIAL);
 
-  // User entered -n value, run functionality tests
-  if (testingFlag) {
-    functionality_test();
+  return data;
+}
+
+// Parse whitespace separated decimal numbers, streaming the file through a
+// fixed buffer. A number may straddle two chunks, so its digits accumulate
+// across reads
+int64_t *parse_text_input(int fd, long *count) {
+  char *chunk = (char *)malloc(INPUT_CHUNK_BYTES);
+  size_t capacity = INPUT_INITIAL_CAPACITY;
+  int64_t *numbers = (int64_t *)malloc(capacity * sizeof(int64_t));
+
+  if (!chunk || !numbers) {
+    printf("Failed to allocate memory for input.\n");
+    exit(1);
   }
 
-  // Initialise 7 counters and timers for the 7 operations
-  int operation_counts[7] = {0};
-  double total_time[7] = {0.0};
-  int num_operations = 7 * (*n / 10);  // 10% for each operation
+  size_t num = 0;
+  value_t value = 0;
+  bool digits = false;
+  ssize_t bytes;
+
+  do {
+    bytes = read(fd, chunk, INPUT_CHUNK_BYTES);
+
+    if (bytes < 0) {
+      printf("Error: could not read input file %s.\n", input_path);
+      exit(1);
+    }
+
+    input_bytes += bytes;
 
-  for (int i = 0; i < num_operations; ++i) {
-    int operation = rand() % 7;
-    clock_t start_t = clock();
+    // At the end of the file a single space completes any number left
+    // without a trailing newline
+    ssize_t end = bytes > 0 ? bytes : 1;
 
-    switch (operation) {
-      case 0:
-        find(rand_in_range());
-        break;
+    for (ssize_t i = 0; i < end; ++i) {
+      unsigned char c = bytes > 0 ? chunk[i] : ' ';
 
-      case 1:
-        add(rand_in_range());
-        break;
+      if (c >= '0' && c <= '9') {
+        if (value > (INT64_MAX - (c - '0')) / 10) {
+          printf("Error: input number too large near byte %zu.\n",
+                 input_bytes - bytes + i);
+          exit(1);
+        }
 
-      case 2:
-        delete (rand_in_range());
-        break;
+        value = value * 10 + (c - '0');
+        digits = true;
+        continue;
+      }
+
+      if (!isspace(c)) {
+        printf("Error: unexpected character '%c' in input near byte %zu.\n",
+               c, input_bytes - bytes + i);
+        exit(1);
+      }
 
-      case 3:
-        succ(rand_in_range());
-        break;
+      if (!digits) {
+        continue;
+      }
 
-      case 4:
-        pred(rand_in_range());
-        break;
+      if (num == capacity) {
+        capacity *= 2;
+        numbers = (int64_t *)realloc(numbers, capacity * sizeof(int64_t));
 
-      case 5:
-        min();
-        break;
+        if (!numbers) {
+          printf("Failed to allocate memory for input.\n");
+          exit(1);
+        }
+      }
 
-      case 6:
-        max();
-        break;
+      numbers[num++] = value;
+      value = 0;
+      digits = false;
     }
+  } while (bytes > 0);
 
-    clock_t end_t = clock();
-    total_time[operation] += ((double)(end_t - start_t)) / CLOCKS_PER_SEC;
+  free(chunk);
 
-    ++operation_counts[operation];
+  *count = (long)num;
+  return numbers;
+}
+
+// Function to release the input numbers once they have been loaded
+void free_input() {
+  if (input_mapped) {
+    munmap((void *)input_numbers, input_bytes);
+  } else {
+    free((void *)input_numbers);
   }
 
-  // Calculate and display outputs
+  input_numbers = NULL;
+}
 
-  printf("         Op counts    Total time    Avg. Time\n");
-  char *operation_names[] = {"find", "add", "delete", "succ",
-                             "pred", "min", "max"};
+//////////////////////
+// RANDOM FUNCTIONS //
+//////////////////////
+
+// Function to set up the chosen distribution over the range. Must run once
+// the range is known and before any numbers are drawn
+void init_workload() {
+  int total = 0;
 
   for (int i = 0; i < 7; ++i) {
-    printf("%-8s %-12d %-13f %-18e\n", operation_names[i], operation_counts[i],
-           total_time[i], total_time[i] / operation_counts[i]);
+    total += operation_weights[i];
+    operation_cumulative[i] = total;
+  }
+
+  if (workload == ZIPF_DIST) {
+    zipf_h_first = zipf_h_integral(1.5) - 1.0;
+    zipf_h_last = zipf_h_integral(range + 0.5);
+    zipf_cutoff =
+        2.0 - zipf_h_integral_inverse(zipf_h_integral(2.5) - zipf_h(2.0));
+  }
+
+  // Cluster centres come from a stream of their own, so they only depend on
+  // the seed
+  if (workload == CLUSTERED_DIST) {
+    random_stream centres;
+    stream_init(&centres, UINT32_MAX);
+
+    cluster_width = range / CLUSTER_SPREAD > 0 ? range / CLUSTER_SPREAD : 1;
+    for (int i = 0; i < CLUSTER_COUNT; ++i) {
+      cluster_centres[i] = stream_bounded64(&centres, range);
+    }
   }
 }
 
-// Function for testing program operational capacity
-void functionality_test() {
-  // Initialise test_counters array
-  int *test_counters = calloc(MAX_TEST_SIZE, sizeof(int));
-  for (int i = 0; i < len; ++i) {
-    ++test_counters[number_array[i]];
+// Seed stream number stream of random_seed with splitmix64, so every stream
+// starts from well mixed, distinct state
+void stream_init(random_stream *r, uint64_t stream) {
+  uint64_t x = (uint64_t)random_seed * 0x9e3779b97f4a7c15ULL + stream;
+
+  for (int i = 0; i < 4; ++i) {
+    x += 0x9e3779b97f4a7c15ULL;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    r->state[i] = z ^ (z >> 31);
   }
 
-  // Test operations
-  for (int i = 0; i < len; ++i) {
-    run_tests(i, test_counters);
+  r->sequence = 0;
+}
+
+// Utility function to advance xoshiro256** and return its next 64 bits
+uint64_t stream_next(random_stream *r) {
+  uint64_t *s = r->state;
+  uint64_t product = s[1] * 5;
+  uint64_t result = ((product << 7) | (product >> 57)) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+
+  return result;
+}
+
+// Utility function to draw uniformly from [0, bound) without modulo bias.
+// The top 32 bits are scaled by bound, and only the few draws landing in the
+// uneven remainder are rejected (Lemire's method)
+uint32_t stream_bounded(random_stream *r, uint32_t bound) {
+  uint64_t m = (stream_next(r) >> 32) * bound;
+  uint32_t low = (uint32_t)m;
+
+  if (low < bound) {
+    uint32_t threshold = -bound % bound;
+
+    while (low < threshold) {
+      m = (stream_next(r) >> 32) * bound;
+      low = (uint32_t)m;
+    }
   }
 
-  // Initial state
-  print_array_state(min(), max());
+  return (uint32_t)(m >> 32);
+}
+
+// Utility function to draw uniformly from [0, bound) for bounds past 32 bits,
+// the same way on the full 64 bits with a 128-bit product. Bounds that fit in
+// 32 bits take the cheaper narrow path
+uint64_t stream_bounded64(random_stream *r, uint64_t bound) {
+  if (bound <= UINT32_MAX) {
+    return stream_bounded(r, (uint32_t)bound);
+  }
 
-  // Remaining operations
-  for (int i = 0; i < MAX_TEST_SIZE; ++i) {
-    if (test_counters[i] > 1) {
-      run_final_tests(number_array[i]);
+  unsigned __int128 m = (unsigned __int128)stream_next(r) * bound;
+  uint64_t low = (uint64_t)m;
+
+  if (low < bound) {
+    uint64_t threshold = -bound % bound;
+
+    while (low < threshold) {
+      m = (unsigned __int128)stream_next(r) * bound;
+      low = (uint64_t)m;
     }
   }
 
-  // Final state
-  print_array_state(min(), max());
+  return (uint64_t)(m >> 64);
+}
 
-  free(test_counters);
+// Utility function to draw uniformly from [0, 1) with 53 bits of precision
+double stream_double(random_stream *r) {
+  return (stream_next(r) >> 11) * 0x1.0p-53;
 }
 
-void print_array_state(int minimum, int maximum) {
-  printf("\nNumbers : ");
-  for (int i = 0; i < len; ++i) {
-    printf("%d ", number_array[i]);
-  }
+// Function to draw an offset from r1 following the workload distribution
+value_t draw_offset(random_stream *r) {
+  switch (workload) {
+    case ZIPF_DIST:
+      return zipf_rank(r) - 1;
+
+    case SEQUENTIAL_DIST:
+      return r->sequence++ % range;
 
-  printf(": min %d : max %d\n", minimum, maximum);
+    case CLUSTERED_DIST: {
+      uint64_t offset = cluster_centres[stream_bounded(r, CLUSTER_COUNT)] +
+                        stream_bounded64(r, cluster_width);
+      return offset >= (uint64_t)range ? offset - range : offset;
+    }
+
+    default:
+      return stream_bounded64(r, range);
+  }
 }
 
-void run_tests(int index, int *counter) {
-  int value = number_array[index];
+// Function to draw an operation type following the operation mix weights
+int draw_operation(random_stream *r) {
+  int draw = stream_bounded(r, operation_cumulative[6]);
+  int operation = 0;
 
-  printf("find %d %d : ", value, find(value));
-  printf("delete %d %d : ", value, delete (value));
-  printf("find %d %d : ", value, find(value));
-  printf("delete %d %d : ", value, delete (value));
-  printf("add %d %d : ", value, add(value));
-  printf("find %d %d : ", value, find(value));
-  printf("succ %d %d : ", value, succ(value));
-  printf("pred %d %d\n", value, pred(value));
+  while (draw >= operation_cumulative[operation]) {
+    ++operation;
+  }
+
+  return operation;
+}
 
-  ++counter[value];
+// Draw a rank in [1, range] where rank k has weight k^-theta, by
+// rejection-inversion (Hormann and Derflinger). Setup is constant time and
+// few draws are rejected, so it suits ranges far too wide for a table
+value_t zipf_rank(random_stream *r) {
+  while (true) {
+    double u = zipf_h_last + stream_double(r) * (zipf_h_first - zipf_h_last);
+    double x = zipf_h_integral_inverse(u);
+    double k = floor(x + 0.5);
+
+    if (k < 1.0) {
+      k = 1.0;
+    } else if (k > range) {
+      k = range;
+    }
+
+    if (k - x <= zipf_cutoff || u >= zipf_h_integral(k + 0.5) - zipf_h(k)) {
+      return (value_t)k;
+    }
+  }
 }
 
-void run_final_tests(int value) {
-  printf("add %d %d : ", value, add(value));
-  printf("find %d %d\n", value, find(value));
+// Utility function for the Zipf weight x^-theta
+double zipf_h(double x) { return exp(-zipf_theta * log(x)); }
+
+// Utility function for the integral of zipf_h, continuous in theta at 1
+double zipf_h_integral(double x) {
+  double log_x = log(x);
+  return expm1_ratio((1.0 - zipf_theta) * log_x) * log_x;
 }
 
-/////////////////////////
-// OPERATIVE FUNCTIONS //
-/////////////////////////
+// Utility function for the inverse of zipf_h_integral
+double zipf_h_integral_inverse(double x) {
+  double t = x * (1.0 - zipf_theta);
 
-// Function to return number of times the value occurs in stored numbers
-int find(int value) {
-  if (counts_array) {
-    return counts_array[value - r1];
+  if (t < -1.0) {
+    t = -1.0;  // Only reached through rounding
   }
 
-  // number_array functionality
-  int count;
-  if (binary_search(value, &count) < 0) {
-    return 0;
-  } else {
-    return count;
+  return exp(log1p_ratio(t) * x);
+}
+
+// Utility function for log1p(x) / x, taking its limit near 0
+double log1p_ratio(double x) {
+  if (fabs(x) > 1e-8) {
+    return log1p(x) / x;
   }
+
+  return 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
 }
 
-// Function to add the value to stored numbers
-int add(int value) {
-  if (counts_array) {
-    ++counts_array[value - r1];
-    return 1;
+// Utility function for expm1(x) / x, taking its limit near 0
+double expm1_ratio(double x) {
+  if (fabs(x) > 1e-8) {
+    return expm1(x) / x;
+  }
+
+  return 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x));
+}
+
+//////////////////////
+// DRIVER FUNCTIONS //
+//////////////////////
+
+void drive(long *n, value_t *r2) {
+  double memoryUsed;
+  multiset_stats stats;
+
+  bool testingFlag = false;
+
+  if (*n < 0) {
+    testingFlag = true;
+    *n = labs(*n);
   }
 
-  // number_array functionality
-  int nearest_space;
-  int index = binary_search(value, NULL);
+  memoryUsed = print_summary(*n, *r2);
+  multiset_get_stats(set, &stats);
 
-  int insertion = index >= 0 ? index : -index;
-  if (insertion == len + 1) {
-    insertion = 0;  // Out-of-bounds index indicates value < min number in array
+  // User entered -n value, run functionality tests
+  if (testingFlag) {
+    functionality_test();
   }
 
-  if (number_array[insertion] == -1) {
-    number_array[insertion] = value;
-    return 1;
+  // 10% of n for each operation unless a count is given
+  long num_operations = bench_operations ? bench_operations : 7 * (*n / 10);
+  latency_histogram *latencies =
+      (latency_histogram *)calloc(7, sizeof(latency_histogram));
+  double *rates = (double *)malloc(num_repeats * sizeof(double));
+
+  if (!latencies || !rates) {
+    printf("Failed to allocate memory for latency histograms.\n");
+    exit(1);
   }
 
-  nearest_space = find_nearest_space(insertion);
-  if (nearest_space >= 0) {
-    int direction = shift_array(insertion, nearest_space);
-    if (direction < 0) {
-      number_array[insertion - 1] = value;
-    } else if (direction > 0) {
-      number_array[insertion] = value;
+  // Warm-up operations are run first and their latencies thrown away
+  if (warmup_operations > 0) {
+    latency_histogram *discarded =
+        (latency_histogram *)calloc(7, sizeof(latency_histogram));
+
+    if (!discarded) {
+      printf("Failed to allocate memory for latency histograms.\n");
+      exit(1);
     }
+
+    drive_threads(warmup_operations, 0, discarded);
+    free(discarded);
   }
 
-  return 0;
-}
+  // Each run draws different operations, and latencies build up over all
+  // of them
+  double wall_time = 0.0;
 
-// Function to delete a single value from stored numbers
-int delete(int value) {
-  if (counts_array) {
-    if (counts_array[value - r1] > 0) {
-      --counts_array[value - r1];
-      return 1;
-    }
-    return 0;
+  for (int run = 1; run <= num_repeats; ++run) {
+    wall_time = drive_threads(num_operations, run, latencies);
+    rates[run - 1] = num_operations / wall_time;
   }
 
-  // number_array functionality
-  int index = binary_search(value, NULL);
+  // Calculate and display outputs
+  print_latencies(latencies);
 
-  if (index >= 0) {
-    number_array[index] = -1;
-    return 1;
-  } else {
-    return 0;
+  if (num_repeats > 1) {
+    double mean, stddev;
+    rate_statistics(rates, &mean, &stddev);
+
+    printf(
+        "\n%d runs of %ld ops over %d threads: %.0f ops/sec mean, %.0f stddev "
+        "(%.1f%%)\n",
+        num_repeats, num_operations, num_threads, mean, stddev,
+        100.0 * stddev / mean);
+  } else if (num_threads > 1) {
+    printf("\n%d threads over %d shards: %ld ops in %f s, %.0f ops/sec\n",
+           num_threads, stats.num_shards, num_operations, wall_time,
+           num_operations / wall_time);
   }
+
+  print_migrations();
+
+  if (report_path) {
+    write_report(*n, *r2, num_operations, memoryUsed, latencies, rates);
+  }
+
+  free(latencies);
+  free(rates);
 }
 
-// Function to return the number before the value appears in stored numbers
-int pred(int value) {
-  if (counts_array) {
-    // Initialise loop at value - 2 for predecessor
-    for (int i = value - 2; i >= 0; --i) {
-      if (counts_array[i] > 0) {
-        return i + r1;
-      }
-    }
-    return -1;
+// Function to print the set's size and heap, and how it was loaded.
+// Returns the approximate memory used in Mbytes
+double print_summary(long n, value_t r2) {
+  multiset_stats stats;
+
+  // Memory used is the heap the set holds, as the allocator counts it
+  multiset_get_stats(set, &stats);
+  double memoryUsed = (double)stats.heap_total / (1024 * 1024);
+
+  printf("n = %ld, r1 = %" PRId64 ", r2 = %" PRId64
+         ", Memory used = %.6f Mbytes\n",
+         n, r1, r2, memoryUsed);
+  printf("Startup time = %f s (%d load threads, %s search, %s pages)\n",
+         startup_time, num_threads, multiset_search_name(),
+         multiset_pages_name());
+
+  if (restore_path) {
+    printf("Restored from %s, %.1f Mbytes mapped\n", restore_path,
+           (double)stats.mapped_bytes / (1024 * 1024));
   }
 
-  // number_array functionality
-  int index = binary_search(value, NULL);
-  if (index == 0 || index == -len - 1) {
-    return -1;  // Exit cases where we are already at beginning of array
-  } else if (index < 0) {
-    // Negative index == index value would be found at -index
-    return number_array[-index - 1];
+  if (save_path) {
+    printf("Snapshot = %s, %.1f Mbytes saved in %f s\n", save_path,
+           (double)saved_bytes / (1024 * 1024), save_time);
   }
 
-  int left = binary_search(number_array[index] - 1, NULL);
-  if (left >= 0) {
-    // The array value at index left is the predecessor to value
-    return number_array[left];
-  } else if (left == -len - 1) {
-    // Value would go at start of array
-    return -1;
-  } else if (left < 0) {
-    // bsearch finds leftmost index for where value would go, so left - 1 is
-    // predecessor
-    return number_array[-left - 1];
+  if (input_path) {
+    double megabytes = (double)input_bytes / (1024 * 1024);
+    printf("Input = %s, %.1f Mbytes read at %.1f MB/s, loaded at %.1f MB/s\n",
+           input_path, megabytes, megabytes / input_time,
+           megabytes / startup_time);
   }
 
-  return -1;
+  return memoryUsed;
 }
 
-// Function to return the number after the value appears in stored numbers
-int succ(int value) {
-  if (counts_array) {
-    // Initialise loop at value for successor
-    for (int i = value; i < range; ++i) {
-      if (counts_array[i] > 0) {
-        return i + r1;
-      }
-    }
-    return -1;
+// Function to serve the loaded set over a Unix socket until a client stops
+// the server, then print what it served
+void serve(long n, value_t r2) {
+  query_stats stats;
+
+  print_summary(n, r2);
+  printf("Serving on %s with %d workers\n", serve_path, num_workers);
+  fflush(stdout);
+
+  if (!query_serve(set, serve_path, num_workers, &stats)) {
+    exit(1);
   }
 
-  // number_array functionality
-  int count;
-  int index = binary_search(value, &count);
-  if (index == len - 1) {
-    return -1;  // Exit case, already at end of array
-  } else if (index >= 0) {
-    int next = index + count;
-    while (next < len && number_array[next] == -1) {
-      ++next;
-    }
+  printf("\nServed %ld ops in %ld packets over %ld connections in %f s, "
+         "%.0f ops/sec\n",
+         stats.operations, stats.packets, stats.connections, stats.seconds,
+         stats.operations / stats.seconds);
+
+  print_migrations();
+}
+
+// Split the operation mix across worker threads, each with its own random
+// sequence, and return the wall clock time taken for all of them to finish.
+// Latencies are merged over the threads. A single worker runs on the calling
+// thread. Every run numbers its streams apart from the other runs'
+double drive_threads(long num_operations, int run,
+                     latency_histogram *latencies) {
+  worker *workers = (worker *)calloc(num_threads, sizeof(worker));
+
+  if (!workers) {
+    printf("Failed to allocate memory for worker threads.\n");
+    exit(1);
+  }
+
+  double start = now_seconds();
 
-    if (next < len) {
-      return number_array[next];
+  for (int i = 0; i < num_threads; ++i) {
+    stream_init(&workers[i].random, (uint64_t)num_threads * (run + 1) + i);
+    workers[i].random.sequence = range / num_threads * i;
+    workers[i].num_operations =
+        num_operations / num_threads + (i < num_operations % num_threads);
+
+    if (num_threads == 1) {
+      run_worker(&workers[i]);
+    } else if (pthread_create(&workers[i].thread, NULL, run_worker,
+                              &workers[i])) {
+      printf("Failed to start worker thread.\n");
+      exit(1);
     }
-  } else {
-    int i = -index + 1;  // -index, iterate right to find next non -1 value
-    while (i < len && number_array[i] == -1) {
-      ++i;
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    if (num_threads > 1) {
+      pthread_join(workers[i].thread, NULL);
     }
 
-    if (i < len) {
-      return number_array[i];
+    for (int j = 0; j < 7; ++j) {
+      latency_merge(&latencies[j], &workers[i].latencies[j]);
     }
   }
 
-  return -1;
+  double wall_time = now_seconds() - start;
+
+  free(workers);
+  return wall_time;
 }
 
-// Function to find minimum number in the array
-int min() {
-  // This is probably computationally faster for number_array
-  // than my implementation.. maybe except for very very large arrays
-  if (counts_array) {
-    for (int i = 0; i < range; ++i) {
-      if (counts_array[i] > 0) {
-        return i + r1;
+// Function run by each benchmark thread. Operations outside a batch are timed
+// time_every at a time, so the cost of reading the clock can be spread over
+// several of them
+void *run_worker(void *arg) {
+  worker *w = (worker *)arg;
+  batch_op *pending = (batch_op *)malloc((batch_size + 1) * sizeof(batch_op));
+  int *timed = (int *)malloc(time_every * sizeof(int));
+  int num_pending = 0, num_timed = 0;
+  uint64_t timed_start = 0;
+
+  if (!pending || !timed) {
+    printf("Failed to allocate memory for operation batch.\n");
+    exit(1);
+  }
+
+  for (long i = 0; i < w->num_operations; ++i) {
+    int operation = draw_operation(&w->random);
+    value_t value = operation < 5 ? rand_in_range(&w->random) : 0;
+
+    // Queue finds, adds and deletes until a full batch is ready
+    if (batch_size > 0 && operation < 3) {
+      pending[num_pending].type = operation;
+      pending[num_pending].value = value;
+
+      // Close any open timed group first, so its clock doesn't run over the
+      // batch and count the batch's time twice
+      if (++num_pending == batch_size) {
+        flush_timed(timed, num_timed, timed_start, w->latencies);
+        num_timed = 0;
+        flush_batch(pending, num_pending, w->latencies);
+        num_pending = 0;
       }
+      continue;
     }
-    return -1;
-  }
-
-  // number_array functionality
-  int predecessor = 0;
-  int left = 0, mid, right = len - 1;
-  while (left <= right) {
-    mid = left + (right - left) / 2;
-
-    if (number_array[mid] != -1 && (mid == 0 || number_array[mid - 1] == -1)) {
-      predecessor = pred(number_array[mid]);
-
-      if (predecessor == -1) {
-        return number_array[mid];
-      } else {
-        if (predecessor == number_array[0]) {
-          return predecessor;  // next value is min
-        } else if (succ(number_array[mid]) == -1) {
-          // Only number in array if both pred and succ == -1
-          return number_array[mid];
-        } else {
-          right = binary_search(predecessor, NULL);
-          left = 0;
-        }
-      }
-    } else if (number_array[mid] == -1) {
-      left = mid + 1;
-    } else {
-      right = mid - 1;
+
+    if (num_timed == 0) {
+      timed_start = now_nanos();
     }
-  }
 
-  // Will return either the last valid number found, or -1 if failed
-  return number_array[right];
-}
+    apply_operation(operation, value);
+    timed[num_timed] = operation;
 
-// Function to find maximum number in the array
-int max() {
-  // This is probably computationally faster for number_array
-  // than my implementation.. maybe except for very very large arrays
-  if (counts_array) {
-    for (int i = range - 1; i >= 0; --i) {
-      if (counts_array[i] > 0) {
-        return i + r1;
-      }
+    if (++num_timed == time_every) {
+      flush_timed(timed, num_timed, timed_start, w->latencies);
+      num_timed = 0;
     }
-    return -1;
   }
 
-  // number_array functionality
-  int successor = 0;
-  int left = 0, mid, right = len - 1;
+  flush_timed(timed, num_timed, timed_start, w->latencies);
+  flush_batch(pending, num_pending, w->latencies);
+  free(pending);
+  free(timed);
 
-  while (left <= right) {
-    mid = left + (right - left) / 2;
+  return NULL;
+}
 
-    if (number_array[mid] != -1 &&
-        (mid == len - 1 || number_array[mid + 1] == -1)) {
-      successor = succ(number_array[mid]);
+void apply_operation(int operation, value_t value) {
+  switch (operation) {
+    case 0:
+      multiset_find(set, value);
+      break;
 
-      if (successor == -1) {
-        return number_array[mid];
-      } else {
-        if (successor == number_array[len - 1]) {
-          return successor;  // next value is max
-        } else if (pred(number_array[mid]) == -1) {
-          // Only number in array if both pred and succ == -1
-          return number_array[mid];
-        } else {
-          left = binary_search(successor, NULL);
-          right = len - 1;
-        }
-      }
-    } else if (number_array[mid] == -1) {
-      right = mid - 1;
-    } else {
-      left = mid + 1;
-    }
+    case 1:
+      add_number(value);
+      break;
+
+    case 2:
+      multiset_delete(set, value);
+      break;
+
+    case 3:
+      multiset_succ(set, value);
+      break;
+
+    case 4:
+      multiset_pred(set, value);
+      break;
+
+    case 5:
+      multiset_min(set);
+      break;
+
+    case 6:
+      multiset_max(set);
+      break;
   }
+}
 
-  // Will return either the last valid number found, or -1 if failed
-  return number_array[left];
+// Apply a batch and share its time evenly between the operations in it
+void flush_batch(batch_op *ops, int num_ops, latency_histogram *latencies) {
+  if (num_ops == 0) {
+    return;
+  }
+
+  uint64_t start = now_nanos();
+  if (!multiset_apply_batch(set, ops, num_ops)) {
+    exit_with_set_error();
+  }
+  uint64_t share = (now_nanos() - start) / num_ops;
+
+  for (int i = 0; i < num_ops; ++i) {
+    latency_record(&latencies[ops[i].type], share, 1);
+  }
 }
 
-///////////////////////
-// UTILITY FUNCTIONS //
-///////////////////////
+// Share the time since start evenly between a group of timed operations
+void flush_timed(const int *types, int num_ops, uint64_t start,
+                 latency_histogram *latencies) {
+  if (num_ops == 0) {
+    return;
+  }
 
-// Utility function to check user input valid integers
-bool is_valid_int(const char *str) {
-  char *endptr;
-  int value = (int)strtol(str, &endptr, 10);
+  uint64_t share = (now_nanos() - start) / num_ops;
 
-  return (*endptr == '\0' && value != 0 && value >= INT_MIN &&
-          value <= INT_MAX);
+  for (int i = 0; i < num_ops; ++i) {
+    latency_record(&latencies[types[i]], share, 1);
+  }
 }
 
-// Utility function to generate a random number in defined range
-int rand_in_range() { return rand() % range + r1; }
+// Function to print each operation's count, total and average time, and its
+// latency percentiles in nanoseconds
+void print_latencies(latency_histogram *latencies) {
+  printf(
+      "         Op counts    Total time    Avg. Time          p50 ns   "
+      "p99 ns   p999 ns  max ns\n");
 
-// Utility function to provide comparison for qsort
-int compare(const void *a, const void *b) {
-  int val1 = *(const int *)a;
-  int val2 = *(const int *)b;
+  for (int i = 0; i < 7; ++i) {
+    latency_histogram *h = &latencies[i];
+    double total = h->total / 1e9;
+
+    printf("%-8s %-12lu %-13f %-18e %-8lu %-8lu %-8lu %lu\n",
+           operation_names[i], (unsigned long)h->count, total,
+           h->count ? total / h->count : 0.0,
+           (unsigned long)latency_percentile(h, 0.5),
+           (unsigned long)latency_percentile(h, 0.99),
+           (unsigned long)latency_percentile(h, 0.999),
+           (unsigned long)h->max);
+  }
 
-  return (val1 > val2) - (val1 < val2);
+  if (time_every > 1) {
+    printf("(latencies averaged over groups of %d operations)\n", time_every);
+  }
 }
 
-// Utility function to find first occurance of value in numbers array
-int binary_search(int value, int *count) {
-  int left = 0, mid, right = len - 1;
+// Function to append the run's settings, throughput and per operation
+// latencies to report_path. CSV gets one row per operation and a header when
+// the file is new, JSON one object per line, so runs from different builds or
+// storage modes can be collected in a single file
+void write_report(long n, value_t r2, long num_operations, double memory,
+                  const latency_histogram *latencies, const double *rates) {
+  FILE *file = fopen(report_path, "a");
 
-  while (left <= right) {
-    mid = (left + right) / 2;
+  if (!file) {
+    printf("Error: could not open report %s.\n", report_path);
+    exit(1);
+  }
 
-    if (number_array[mid] == -1) {
-      // Consider both directions from -1
-      int mid_left = mid - 1, mid_right = mid + 1;
+  multiset_stats stats;
+  int *mode_counts = stats.mode_counts;
 
-      while (mid_left >= left && number_array[mid_left] == -1) {
-        --mid_left;
-      }
+  multiset_get_stats(set, &stats);
 
-      while (mid_right <= right && number_array[mid_right] == -1) {
-        ++mid_right;
-      }
+  double mean, stddev;
+  rate_statistics(rates, &mean, &stddev);
 
-      if (mid_left >= left && number_array[mid_left] == value) {
-        mid = mid_left;
-      } else if (mid_right <= right && number_array[mid_right] == value) {
-        mid = mid_right;
-      } else {
-        // Adjust bounds if value not found
-        if (mid_left >= left && number_array[mid_left] > value) {
-          right = mid_left - 1;
-        } else if (mid_right <= right && number_array[mid_right] < value) {
-          left = mid_right + 1;
-        } else {
-          // Check if unfound value would insert between two values with a -1
-          // between then
-          if (mid_left >= left && mid_right <= right &&
-              number_array[mid_left] < value &&
-              number_array[mid_right] > value) {
-            left = mid_left + 1;  // Adjust to correct insertion point
-          }
-
-          break;  // Value not found - correct insertion point found
-        }
+  double rss, peak_rss;
+  double peak_heap = (double)stats.heap_peak / (1024 * 1024);
+  double bytes_per_number =
+      stats.num_stored ? (double)stats.heap_total / stats.num_stored : 0.0;
+  double slack = stats.bytes ? (double)stats.slack_bytes / stats.bytes : 0.0;
 
-        continue;
-      }
+  read_rss(&rss, &peak_rss);
+
+  if (report_json) {
+    fprintf(file,
+            "{\"label\": \"%s\", \"n\": %ld, \"r1\": %" PRId64
+            ", \"r2\": %" PRId64 ", "
+            "\"threads\": %d, \"shards\": %d, \"batch\": %d, "
+            "\"distribution\": \"%s\", \"seed\": %d, \"mix\": [",
+            report_label, n, r1, r2, num_threads, stats.num_shards, batch_size,
+            distribution_names[workload], random_seed);
+
+    for (int i = 0; i < 7; ++i) {
+      fprintf(file, "%s%d", i ? ", " : "", operation_weights[i]);
     }
 
-    if (number_array[mid] == value) {
-      if (mid == left || number_array[mid - 1] != value) {
-        // Count occurances of value if count pointer was parsed in call
-        if (count != NULL) {
-          int first_occ = mid, last_occ = mid;
-          while (first_occ > 0 && number_array[first_occ - 1] == value) {
-            --first_occ;
-          }
+    fprintf(file,
+            "], \"num_operations\": %ld, \"warmup\": %ld, \"repeats\": %d, "
+            "\"modes\": {\"dense\": %d, \"runs\": %d, \"tree\": %d}, "
+            "\"memory_mb\": %f, \"peak_heap_mb\": %f, \"peak_rss_mb\": %f, "
+            "\"bytes_per_number\": %f, \"slack\": %f, \"startup_s\": %f, "
+            "\"ops_per_sec\": %.0f, \"ops_per_sec_stddev\": %.0f, "
+            "\"operations\": {",
+            num_operations, warmup_operations, num_repeats,
+            mode_counts[DENSE_MODE], mode_counts[RUNS_MODE],
+            mode_counts[TREE_MODE], memory, peak_heap, peak_rss,
+            bytes_per_number, slack, startup_time, mean, stddev);
+
+    for (int i = 0; i < 7; ++i) {
+      const latency_histogram *h = &latencies[i];
+
+      fprintf(file,
+              "%s\"%s\": {\"count\": %lu, \"mean_ns\": %.1f, "
+              "\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, "
+              "\"max_ns\": %lu}",
+              i ? ", " : "", operation_names[i], (unsigned long)h->count,
+              h->count ? (double)h->total / h->count : 0.0,
+              (unsigned long)latency_percentile(h, 0.5),
+              (unsigned long)latency_percentile(h, 0.99),
+              (unsigned long)latency_percentile(h, 0.999),
+              (unsigned long)h->max);
+    }
 
-          while (last_occ < len - 1 && number_array[last_occ + 1] == value) {
-            ++last_occ;
-          }
+    fprintf(file, "}}\n");
+  } else {
+    fseek(file, 0, SEEK_END);
+
+    if (ftell(file) == 0) {
+      fprintf(file,
+              "label,n,r1,r2,threads,shards,batch,distribution,seed,mix,"
+              "num_operations,warmup,repeats,dense,runs,tree,memory_mb,"
+              "peak_heap_mb,peak_rss_mb,bytes_per_number,slack,"
+              "startup_s,ops_per_sec,ops_per_sec_stddev,operation,count,"
+              "mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    }
 
-          *count = last_occ - first_occ + 1;
-        }
-        return mid;  // Value found and is first occ
-      } else {
-        right = mid - 1;  // Keep searching for first occ
+    for (int i = 0; i < 7; ++i) {
+      const latency_histogram *h = &latencies[i];
+
+      fprintf(file, "%s,%ld,%" PRId64 ",%" PRId64 ",%d,%d,%d,%s,%d,",
+              report_label, n, r1, r2,
+              num_threads, stats.num_shards, batch_size,
+              distribution_names[workload], random_seed);
+
+      for (int j = 0; j < 7; ++j) {
+        fprintf(file, "%s%d", j ? ":" : "", operation_weights[j]);
       }
-    }
 
-    if (number_array[mid] < value)  // Search left or right half
-    {
-      left = mid + 1;
-    } else {
-      right = mid - 1;
+      fprintf(file,
+              ",%ld,%ld,%d,%d,%d,%d,%f,%f,%f,%f,%f,%f,%.0f,%.0f,%s,%lu,%.1f,"
+              "%lu,%lu,%lu,%lu\n",
+              num_operations, warmup_operations, num_repeats,
+              mode_counts[DENSE_MODE], mode_counts[RUNS_MODE],
+              mode_counts[TREE_MODE], memory, peak_heap, peak_rss,
+              bytes_per_number, slack, startup_time, mean, stddev,
+              operation_names[i], (unsigned long)h->count,
+              h->count ? (double)h->total / h->count : 0.0,
+              (unsigned long)latency_percentile(h, 0.5),
+              (unsigned long)latency_percentile(h, 0.99),
+              (unsigned long)latency_percentile(h, 0.999),
+              (unsigned long)h->max);
     }
   }
 
-  if (left == 0) {
-    return -len - 1;  // Return unreachable value if not found but index == 0
-  } else {
-    return -left;  // Return -index where val would be
+  if (fclose(file) != 0) {
+    printf("Error: could not write report %s.\n", report_path);
+    exit(1);
   }
 }
 
-// Utility function to find the closest -1 or 'deleted' value to insertion index
-int find_nearest_space(int start) {
-  int count;
-  int left = start - 1, right = start;
+// Utility function to find the mean and sample standard deviation of the
+// throughput over every run
+void rate_statistics(const double *rates, double *mean, double *stddev) {
+  double sum = 0.0, squares = 0.0;
 
-  while (left >= 0 || right <= len - 1) {
-    if (right <= len - 1) {
-      count = 0;
-      if (binary_search(number_array[right], &count) < 0) {
-        return right;
-      }
-      right += count;
+  for (int i = 0; i < num_repeats; ++i) {
+    sum += rates[i];
+  }
+
+  *mean = sum / num_repeats;
+
+  for (int i = 0; i < num_repeats; ++i) {
+    squares += (rates[i] - *mean) * (rates[i] - *mean);
+  }
+
+  *stddev = num_repeats > 1 ? sqrt(squares / (num_repeats - 1)) : 0.0;
+}
+
+// Function to report the final layouts, every migration made on the way and
+// where the memory went
+void print_migrations() {
+  char *mode_names[] = {"dense", "runs", "tree"};
+  multiset_stats stats;
+  const migration_record *migrations;
+
+  multiset_get_stats(set, &stats);
+  int num_records = multiset_migrations(set, &migrations);
+
+  printf("\nShards: %d (dense %d, runs %d, tree %d), ", stats.num_shards,
+         stats.mode_counts[DENSE_MODE], stats.mode_counts[RUNS_MODE],
+         stats.mode_counts[TREE_MODE]);
+  printf("Memory used = %.6f Mbytes, %d migrations\n",
+         (double)stats.heap_total / (1024 * 1024), stats.num_migrations);
+
+  if (stats.run_slots > 0 || stats.compaction_passes > 0) {
+    printf(
+        "Run lists: %ld slots, %.1f%% gaps, %ld compaction passes (%ld "
+        "steps, %f s)\n",
+        stats.run_slots,
+        stats.run_slots > 0 ? 100.0 * stats.run_gaps / stats.run_slots : 0.0,
+        stats.compaction_passes, stats.compaction_steps,
+        (double)stats.compaction_nanos / 1e9);
+  }
+
+  for (int i = 0; i < num_records; ++i) {
+    const migration_record *m = &migrations[i];
+    printf(
+        "  shard %-3d %-5s -> %-5s after %ld updates (n = %ld, distinct = "
+        "%ld) in %f s\n",
+        m->shard, mode_names[m->from], mode_names[m->to], m->op, m->stored,
+        m->distinct, m->seconds);
+  }
+
+  print_memory(&stats);
+}
+
+// Function to break the set's heap down by what it holds, with the bytes
+// each number costs, the share of the layouts holding no numbers and the
+// process's resident memory
+void print_memory(const multiset_stats *stats) {
+  double rss, peak_rss;
+  read_rss(&rss, &peak_rss);
+
+  printf(
+      "Heap: %.3f Mbytes (peak %.3f), layouts %.3f Mbytes with %.1f%% "
+      "slack, %.2f bytes per number, %.2f per distinct value\n",
+      (double)stats->heap_total / (1024 * 1024),
+      (double)stats->heap_peak / (1024 * 1024),
+      (double)stats->bytes / (1024 * 1024),
+      stats->bytes ? 100.0 * stats->slack_bytes / stats->bytes : 0.0,
+      stats->num_stored ? (double)stats->heap_total / stats->num_stored : 0.0,
+      stats->num_distinct ? (double)stats->heap_total / stats->num_distinct
+                          : 0.0);
+
+  for (int i = 0; i < NUM_MEMORY_KINDS; ++i) {
+    if (stats->heap_blocks[i] > 0) {
+      printf("  %-10s %10ld blocks %10.3f Mbytes\n", memory_names[i],
+             stats->heap_blocks[i],
+             (double)stats->heap_bytes[i] / (1024 * 1024));
     }
+  }
 
-    if (left >= 0) {
-      count = 0;
-      if (binary_search(number_array[left], &count) < 0) {
-        return left;
-      }
-      left -= count;
+  printf("Process RSS = %.1f Mbytes (peak %.1f)\n", rss, peak_rss);
+  printf(
+      "Large arrays: %.1f Mbytes on base pages, %.1f on transparent huge "
+      "pages (%.1f backed), %.1f on huge pages, %d NUMA nodes\n",
+      (double)stats->page_bytes[BASE_PAGES] / (1024 * 1024),
+      (double)stats->page_bytes[TRANSPARENT_PAGES] / (1024 * 1024),
+      read_huge_pages(), (double)stats->page_bytes[HUGE_PAGES] / (1024 * 1024),
+      multiset_numa_nodes());
+}
+
+// Function for testing program operational capacity
+void functionality_test() {
+  // Snapshot the distinct values and their counts before they are modified
+  long distinct = 0;
+  for (value_t value = multiset_min(set); value != -1;
+       value = multiset_succ(set, value)) {
+    ++distinct;
+  }
+
+  value_t *values = (value_t *)malloc((distinct + 1) * sizeof(value_t));
+  long *counts = (long *)malloc((distinct + 1) * sizeof(long));
+
+  if (!values || !counts) {
+    printf("Failed to allocate memory for functionality test.\n");
+    exit(1);
+  }
+
+  distinct = 0;
+  for (value_t value = multiset_min(set); value != -1;
+       value = multiset_succ(set, value)) {
+    values[distinct] = value;
+    counts[distinct] = multiset_find(set, value);
+    ++distinct;
+  }
+
+  // Initial state
+  print_array_state(multiset_min(set), multiset_max(set));
+
+  // Test operations
+  for (long i = 0; i < distinct; ++i) {
+    run_tests(values[i]);
+  }
+
+  print_array_state(multiset_min(set), multiset_max(set));
+
+  // Restore duplicates removed by the tests
+  for (long i = 0; i < distinct; ++i) {
+    if (counts[i] > 1) {
+      run_final_tests(values[i]);
     }
   }
 
-  return -1;
+  // Final state
+  print_array_state(multiset_min(set), multiset_max(set));
+  run_range_tests(multiset_min(set), multiset_max(set));
+
+  printf("\nFormat is: <op name> <op input> <op result>\n\n");
+
+  free(values);
+  free(counts);
 }
 
-// Utility function to shift section of array in specified direction
-int shift_array(int insertion, int nearest_space) {
-  // Shift right
-  if (nearest_space - insertion > 0) {
-    for (int i = nearest_space; i > insertion; --i) {
-      number_array[i] = number_array[i - 1];
+void print_array_state(value_t minimum, value_t maximum) {
+  printf("\nNumbers : ");
+  for (value_t value = minimum; value != -1;
+       value = multiset_succ(set, value)) {
+    for (long i = multiset_find(set, value); i > 0; --i) {
+      printf("%" PRId64 " ", value);
     }
+  }
 
-    return 1;  // Positive indicates right shift
-  } else {
-    // Shift left
-    for (int i = nearest_space; i < insertion - 1; ++i) {
-      number_array[i] = number_array[i + 1];
+  printf(": min %" PRId64 " : max %" PRId64 "\n", minimum, maximum);
+}
+
+void run_tests(value_t value) {
+  printf("find %" PRId64 " %ld : ", value, multiset_find(set, value));
+  printf("delete %" PRId64 " %d : ", value, multiset_delete(set, value));
+  printf("find %" PRId64 " %ld : ", value, multiset_find(set, value));
+  printf("delete %" PRId64 " %d : ", value, multiset_delete(set, value));
+  printf("add %" PRId64 " %d : ", value, add_number(value));
+  printf("find %" PRId64 " %ld : ", value, multiset_find(set, value));
+  printf("succ %" PRId64 " %" PRId64 " : ", value, multiset_succ(set, value));
+  printf("pred %" PRId64 " %" PRId64 "\n", value, multiset_pred(set, value));
+}
+
+void run_final_tests(value_t value) {
+  printf("add %" PRId64 " %d : ", value, add_number(value));
+  printf("find %" PRId64 " %ld\n", value, multiset_find(set, value));
+}
+
+// Run the range queries over the lower half of the stored numbers
+void run_range_tests(value_t minimum, value_t maximum) {
+  long half = multiset_count_range(set, minimum, maximum) / 2;
+  value_t middle = multiset_select(set, half);
+
+  printf("\ncount_range %" PRId64 " %" PRId64 " %ld : ", minimum, maximum,
+         multiset_count_range(set, minimum, maximum));
+  printf("rank %" PRId64 " %ld : ", middle, multiset_rank(set, middle));
+  printf("select %ld %" PRId64 "\n", half, middle);
+
+  printf("iterate_range %" PRId64 " %" PRId64 " :", minimum, middle);
+  multiset_iterate_range(set, minimum, middle, print_range_entry, NULL);
+  printf("\n");
+}
+
+// Utility function to print a value and its count for iterate_range
+void print_range_entry(value_t value, long count, void *context) {
+  (void)context;
+  printf(" %" PRId64 "x%ld", value, count);
+}
+
+///////////////////////
+// LATENCY FUNCTIONS //
+///////////////////////
+
+// Add count operations that each took nanos to the histogram
+void latency_record(latency_histogram *h, uint64_t nanos, uint64_t count) {
+  h->buckets[latency_bucket(nanos)] += count;
+  h->count += count;
+  h->total += nanos * count;
+
+  if (nanos > h->max) {
+    h->max = nanos;
+  }
+}
+
+void latency_merge(latency_histogram *into, const latency_histogram *from) {
+  for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+    into->buckets[i] += from->buckets[i];
+  }
+
+  into->count += from->count;
+  into->total += from->total;
+
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+// Function to find the latency at or below which the quantile of operations
+// finished, reported as the top of its bucket and never above the maximum
+uint64_t latency_percentile(const latency_histogram *h, double quantile) {
+  uint64_t target = (uint64_t)ceil(quantile * h->count);
+  uint64_t seen = 0;
+
+  if (target == 0) {
+    target = 1;
+  }
+
+  for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+    seen += h->buckets[i];
+
+    if (seen >= target) {
+      uint64_t value = latency_bucket_value(i);
+      return value < h->max ? value : h->max;
     }
+  }
+
+  return h->max;
+}
+
+// Utility function to find the bucket holding nanos. Above the exact values,
+// the power of two picks a group of buckets and the next LATENCY_SUB_BITS
+// bits pick the bucket within it
+int latency_bucket(uint64_t nanos) {
+  if (nanos < 2 * LATENCY_SUB_BUCKETS) {
+    return (int)nanos;
+  }
+
+  int shift = 63 - __builtin_clzll(nanos) - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB_BUCKETS +
+         (int)(nanos >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+// Utility function to find the largest value a bucket holds
+uint64_t latency_bucket_value(int bucket) {
+  if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+
+  int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t top = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+
+  return ((top + 1) << shift) - 1;
+}
+
+///////////////////////
+// UTILITY FUNCTIONS //
+///////////////////////
+
+// Utility function to add value to the set, stopping if memory ran out
+int add_number(value_t value) {
+  int added = multiset_add(set, value);
+
+  if (added < 0) {
+    exit_with_set_error();
+  }
+
+  return added;
+}
 
-    return -1;  // Negative indicates left shift
+// Utility function to report why the last set call failed and stop
+void exit_with_set_error() {
+  printf("%s\n", multiset_error());
+  exit(1);
+}
+
+// Utility function to check user input valid integers
+bool is_valid_int(const char *str) {
+  char *endptr;
+  errno = 0;
+  long value = strtol(str, &endptr, 10);
+
+  return (*str != '\0' && *endptr == '\0' && errno != ERANGE && value != 0 &&
+          value >= INT_MIN && value <= INT_MAX);
+}
+
+// Utility function to check user input valid 64-bit integers, rejecting
+// any that overflow
+bool is_valid_number(const char *str) {
+  char *endptr;
+  errno = 0;
+  long long value = strtoll(str, &endptr, 10);
+
+  return (*str != '\0' && *endptr == '\0' && errno != ERANGE && value != 0);
+}
+
+// Utility function to draw a random number in [r1, r2] from the workload
+value_t rand_in_range(random_stream *r) { return draw_offset(r) + r1; }
+
+// Utility function to read a monotonic wall clock in seconds, which unlike
+// clock() stays meaningful while several threads are running
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Utility function to read the same clock in whole nanoseconds, for timing
+// single operations without floating point rounding
+uint64_t now_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Utility function to read the process's resident memory and its peak in
+// Mbytes from /proc/self/status, leaving 0 where they can't be read
+void read_rss(double *current, double *peak) {
+  FILE *file = fopen("/proc/self/status", "r");
+  char line[256];
+  long kbytes;
+
+  *current = *peak = 0.0;
+
+  if (!file) {
+    return;
   }
 
-  return 0;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "VmRSS: %ld kB", &kbytes) == 1) {
+      *current = kbytes / 1024.0;
+    } else if (sscanf(line, "VmHWM: %ld kB", &kbytes) == 1) {
+      *peak = kbytes / 1024.0;
+    }
+  }
+
+  fclose(file);
 }
 
-// Utility function to free allocated memory after use
-void free_memory() {
-  if (number_array) {
-    free(number_array);
-    number_array = NULL;
+// Utility function to read how many Mbytes of the process the kernel has
+// actually backed with transparent huge pages, 0 if it can't be read
+double read_huge_pages() {
+  FILE *file = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  long kbytes;
+  double mbytes = 0.0;
+
+  if (!file) {
+    return mbytes;
   }
 
-  if (counts_array) {
-    free(counts_array);
-    counts_array = NULL;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kbytes) == 1) {
+      mbytes = kbytes / 1024.0;
+    }
   }
-}
\ No newline at end of file
+
+  fclose(file);
+  return mbytes;
+}
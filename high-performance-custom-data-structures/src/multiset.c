@@ -0,0 +1,6074 @@
+// Programming Fundamentals - High Performant Custom Data Structures
+// Designed and developed by Kobi Chambers - Griffith University
+
+#include "multiset.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Vector search kernels are compiled for x86 and picked at runtime, other
+// targets only have the scalar ones
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86
+#endif
+
+// Define globals
+#define CACHE_LINE_SIZE 64
+#define MAX_TREE_HEIGHT 32
+#define MAX_BITMAP_LEVELS 6
+
+// Primary counters start at a single byte, saturated counters live in the
+// overflow table instead. A table entry costs at least 32 bytes at the table's
+// load factor, so once more than one bucket in COUNTER_WIDEN_RATIO has spilled
+// the buckets are cheaper widened to 16 or 32 bits
+#define OVERFLOW_INITIAL_CAPACITY 16
+#define COUNTER_WIDEN_RATIO 32
+
+// Narrow ranges that aren't dense keep one slot per distinct value
+#define MAX_RUNS_RANGE 65536
+#define RUNS_INITIAL_CAPACITY 64
+#define RUNS_GAP_SEARCH 64
+
+// Run list counts are int, so a list never holds more numbers than an int can
+// count. Lists are never wider than that either, so a shard with more numbers
+// belongs in dense counters anyway
+#define RUNS_MAX_STORED INT_MAX
+
+// Run lists are compacted once more than 1 / RUNS_COMPACT_RATIO of their slots
+// are gaps. Each add or delete moves the pass on by RUNS_COMPACT_CHUNK slots,
+// leaving one gap behind per RUNS_GAP_SPACING values and carrying the rest to
+// the end of the list, where they are cut off
+#define RUNS_COMPACT_RATIO 4
+#define RUNS_COMPACT_CHUNK 256
+#define RUNS_GAP_SPACING 8
+
+// Storage is re-evaluated every MIGRATION_CHECK_INTERVAL operations. Dense
+// storage is left once there are DENSE_EXIT_RATIO buckets per stored number,
+// and run lists move to the B+-tree once adds shift or searches skip more than
+// RUNS_MAX_WORK slots per operation
+#define MIGRATION_CHECK_INTERVAL 4096
+#define MAX_MIGRATION_RECORDS 32
+#define DENSE_EXIT_RATIO 4
+#define RUNS_MAX_WORK 64
+
+// Node capacities are chosen so leaves fill exactly four cache lines, and
+// internal nodes four plus two more for their subtree counts
+#define LEAF_BYTES 220
+#define INTERNAL_CAPACITY 15
+#define LEAF_MIN_BYTES (LEAF_BYTES / 4)
+#define INTERNAL_MIN (INTERNAL_CAPACITY / 2)
+
+// Bulk loaded nodes are left partially empty so early adds don't split
+#define LEAF_FILL_BYTES (LEAF_BYTES * 3 / 4)
+#define INTERNAL_FILL 11
+
+// Every encoded entry takes at least one byte, bounding entries per leaf
+#define MAX_LEAF_ENTRIES LEAF_BYTES
+
+// Entries take at most ten bytes for the delta and ten for the count, so every
+// bulk loaded leaf but the last holds at least MIN_BUILD_ENTRIES of them
+#define MAX_ENTRY_BYTES 20
+#define MIN_BUILD_ENTRIES \
+  ((LEAF_FILL_BYTES - MAX_ENTRY_BYTES) / MAX_ENTRY_BYTES + 1)
+
+// Sorted key searches halve the range until SEARCH_WINDOW keys are left, then
+// compare them all at once
+#define SEARCH_WINDOW 16
+
+// Dense shards keep a Fenwick tree of counts over blocks of RANK_BLOCK
+// buckets, eight occupancy bitmap words each
+#define RANK_BLOCK 512
+
+// Bulk loads sort a byte of each key per radix sort pass
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+
+// Snapshots start with a versioned header and a directory of shards. Each
+// shard's payload starts on its own page so it can be mapped directly
+#define SNAPSHOT_MAGIC "ANUMSNAP"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_ALIGNMENT 4096
+
+// Bulk loads take numbers from a fill callback LOAD_CHUNK at a time
+#define LOAD_CHUNK 1024
+
+// Heap blocks are charged their usable size plus the size field the
+// allocator keeps in front of each one
+#define MALLOC_HEADER_BYTES sizeof(size_t)
+
+// Arrays of LARGE_ARRAY_BYTES and up are mapped on their own, in whole
+// HUGE_PAGE_BYTES pages unless base pages were asked for. NUMA nodes past
+// MAX_NUMA_NODES are left out of interleaving
+#define LARGE_ARRAY_BYTES (2 << 20)
+#define HUGE_PAGE_BYTES (2 << 20)
+#define MAX_NUMA_NODES 64
+#define MPOL_INTERLEAVE 3
+
+// Heap held by one set, per memory_kind and in total. Layout allocations go
+// through the account_ functions, which charge what the allocator actually
+// handed out rather than what was asked for
+typedef struct {
+  atomic_long bytes[NUM_MEMORY_KINDS];
+  atomic_long blocks[NUM_MEMORY_KINDS];
+  atomic_long total, peak;
+  atomic_long page_bytes[3];  // Large arrays mapped with each page_policy
+} memory_account;
+
+// Header in front of every array from page_alloc, a cache line long so the
+// array after it stays aligned
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) size_t length;  // Bytes mapped, 0 if on the heap
+  page_policy pages;
+} page_header;
+
+// B+-tree leaf holding a compressed block of sorted (value, count) pairs,
+// linked to its neighbours for pred/succ and ordered iteration. Each entry is
+// a varint of (delta from the previous value << 1 | count > 1), followed by a
+// varint of count - 1 when that low bit is set. The first entry's delta is
+// taken from first_key, so a block decodes independently of its neighbours
+typedef struct bpt_leaf {
+  _Alignas(CACHE_LINE_SIZE) value_t first_key, last_key;
+  struct bpt_leaf *prev, *next;
+  uint16_t num_keys, num_bytes;
+  uint8_t data[LEAF_BYTES];
+} bpt_leaf;
+
+// B+-tree internal node, keys[i] is the smallest value in children[i + 1]
+// and counts[i] the numbers stored under children[i]. Descents only read the
+// keys and children, the counts come after them
+typedef struct bpt_internal {
+  _Alignas(CACHE_LINE_SIZE) value_t keys[INTERNAL_CAPACITY];
+  void *children[INTERNAL_CAPACITY + 1];
+  long counts[INTERNAL_CAPACITY + 1];
+  int num_keys;
+} bpt_internal;
+
+// Where a value falls within a leaf's block: the first entry with key >= value
+// and the key of the entry before it
+typedef struct {
+  int pos, offset, size;  // Entry index, byte offset and encoded length
+  value_t key;            // Valid when pos < num_keys
+  long count;
+  value_t prev_key;       // Valid when pos > 0
+} leaf_position;
+
+typedef struct {
+  void *root;
+  bpt_leaf *head, *tail;  // Leftmost and rightmost leaves
+  int height;             // Internal levels above the leaves, 0 if root is leaf
+  size_t num_leaves, num_internals;
+  memory_account *memory;
+} bptree;
+
+// Entry in the open addressing table holding counts of saturated buckets
+typedef struct {
+  int index;  // -1 marks an empty slot
+  long count;
+} overflow_entry;
+
+// Compressed counts for the dense mode, 8, 16 or 32 bits per bucket with the
+// rare hot buckets spilling into a hash table. Buckets are updated atomically,
+// the table is guarded by its own lock. The buckets only ever widen, and only
+// while the counters are held exclusively
+typedef struct {
+  void *primary;
+  int size, width;     // Buckets and bytes per bucket
+  uint32_t saturated;  // Bucket value marking a count held in the table
+  overflow_entry *overflow;
+  int overflow_size, overflow_capacity;
+  pthread_mutex_t overflow_lock;
+  bool mapped;  // primary lies in a snapshot mapping rather than the heap
+  memory_account *memory;
+} counter_array;
+
+// Occupancy bitmap over counts_array, bit i of level l + 1 is set when word i
+// of level l is non-zero so empty stretches are skipped 64 words at a time
+typedef struct {
+  _Atomic uint64_t *levels[MAX_BITMAP_LEVELS];
+  size_t num_words[MAX_BITMAP_LEVELS];
+  int num_levels;
+  bool mapped;  // Levels lie in a snapshot mapping rather than the heap
+  memory_account *memory;
+} occupancy_bitmap;
+
+// Fenwick tree over blocks of RANK_BLOCK dense buckets or run list slots, so
+// the numbers before a block and the block holding the k-th number are found in
+// O(log blocks). sums[i] covers blocks i - (i & -i) to i - 1
+typedef struct {
+  atomic_long *sums;  // 1-based, num_blocks + 1 entries
+  int num_blocks;
+  bool mapped;  // sums lie in a snapshot mapping rather than the heap
+  memory_account *memory;
+} block_index;
+
+// Run-length storage, one (value, count) slot per distinct value in strictly
+// increasing order. Slots whose count drops to zero stay behind as gaps that
+// later adds can revive or overwrite without shifting. A gap holds either its
+// old value or the value of the slot before it, so gaps never break the order.
+// Values are held as offsets from the shard's first value
+typedef struct {
+  int *values;
+  int *counts;
+  int size, capacity;  // Slots in use, including gaps, and slots allocated
+  int gaps;            // Slots holding a zero count
+  int compact_at;      // Next slot of the compaction pass, -1 when idle
+  int compact_gaps;    // Gaps carried along by the pass, starting at compact_at
+  int compact_spacing; // Values moved since the pass last left a gap behind
+  atomic_long work;    // Slots shifted or skipped since the last check
+  block_index blocks;  // Numbers held in each RANK_BLOCK slots
+  memory_account *memory;
+} run_list;
+
+// Slice of [r1, r2] with its own storage and lock. Readers share the lock, so
+// find, pred and succ only wait on adds and deletes to the same shard. Dense
+// shards update their counters atomically, so their adds and deletes share the
+// lock too and only a migration takes it exclusively
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+  _Atomic storage_mode mode;
+  counter_array counts;
+  occupancy_bitmap bitmap;
+  block_index blocks;
+  run_list runs;
+  bptree tree;
+  value_t r1, range;               // First value and number of values covered
+  value_t cached_min, cached_max;  // -1 while empty, not kept for dense shards
+  atomic_long num_stored, num_distinct;
+
+  // Adds and deletes since the shard was built, last checked and last migrated
+  atomic_long ops_applied, ops_since_check, ops_since_migration;
+  multiset *set;  // Set the shard belongs to
+} shard;
+
+// Start of a snapshot file. checksum covers the header and the shard
+// directory that follows it, taking its own field as zero
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  int32_t num_shards;
+  int64_t r1, range, shard_width;
+  int64_t num_stored;
+  uint64_t checksum;
+} snapshot_header;
+
+// Snapshot directory entry for one shard. A dense payload holds the counters,
+// each bitmap level, the block index and the overflow table, others hold the
+// 64-bit values then the counts of their (value, count) pairs. Each piece is
+// padded to 8 bytes
+typedef struct {
+  int32_t mode;
+  int32_t overflow_size, overflow_capacity;
+  int32_t counter_width;  // Bytes per dense counter
+  int64_t num_stored, num_distinct;
+  uint64_t offset, bytes;
+  uint64_t checksum;  // Covers bytes from offset
+} snapshot_entry;
+
+// Search kernels from slowest to fastest
+typedef enum { SCALAR_SEARCH, SSE_SEARCH, AVX2_SEARCH } search_level;
+
+// Sorted (value, count) pairs a layout is built from. Bulk loads collapse
+// 32-bit keys in place, leaving them as offsets from base with 32-bit counts,
+// while everything else passes full values and counts
+typedef struct {
+  const value_t *values;
+  const long *counts;
+  const uint32_t *offsets, *offset_counts;
+  value_t base;
+  long num;
+} pair_array;
+
+// Position of a batched operation once sorted by value
+typedef struct {
+  value_t value;
+  int index;
+} batch_key;
+
+// Share of the bulk load handled by one thread. start and end bound the
+// numbers, buckets or shards it covers in the current phase. Keys are offsets
+// from r1, 32-bit unless the range needs them wide
+typedef struct {
+  pthread_t thread;
+  int id, num_threads;
+  multiset *set;
+  const multiset_source *source;  // Numbers being loaded, NULL for restores
+  long start, end;
+  int shift;              // Bits below the digit of the current sort pass
+  void *keys, *buffer;    // Sort source and destination, NULL keys for input
+  bool wide;              // Whether keys are uint64_t rather than uint32_t
+  const long *bounds;     // First key of each shard
+  uint32_t **histograms;  // Bucket counts per thread, NULL to count in place
+  long digits[RADIX_BUCKETS];  // Digit counts, then scatter offsets
+  bool sorted;            // Whether the slice of source numbers is in order
+  long invalid;           // First number outside [r1, r2] or bad shard, or -1
+  value_t stray;          // Value of that number
+  bool failed;            // Whether memory ran out for the slice
+} load_task;
+
+// Everything a set owns. Shards are split evenly over [r1, r1 + range), and
+// a restored set keeps the snapshot it was restored from mapped
+struct multiset {
+  shard *shards;
+  int num_shards;
+  value_t shard_width;
+  value_t r1, range;
+  uint8_t *snapshot_data;
+  size_t snapshot_bytes;
+
+  migration_record migrations[MAX_MIGRATION_RECORDS];
+  int num_migrations;
+  pthread_mutex_t migration_lock;
+
+  // Run list compaction passes started, steps taken and time spent in them
+  atomic_long compaction_passes, compaction_steps, compaction_nanos;
+
+  memory_account memory;
+};
+
+// Sorted searches and gap skipping use the fastest kernels the CPU supports,
+// capped at search_limit. They are shared by every set
+static search_level search_kernels = SCALAR_SEARCH;
+static search_level search_limit = AVX2_SEARCH;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+static const char *search_names[] = {"scalar", "sse4.2", "avx2"};
+
+// Large arrays are mapped with pages no larger than page_limit, interleaved
+// over the NUMA nodes in numa_mask when page_interleave is set. Shared by
+// every set
+static page_policy page_limit = TRANSPARENT_PAGES;
+static bool page_interleave;
+static unsigned long numa_mask;
+static int numa_nodes;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static const char *page_names[] = {"base", "thp", "huge"};
+
+// Why the last failing call on each thread failed, for multiset_error
+static _Thread_local char error_message[256];
+
+// Root of every empty tree, a leaf with no entries that is never written to,
+// so empty trees take no memory and searches need no special case
+static bpt_leaf empty_leaf;
+
+// Function prototypes
+static multiset *create_set(value_t first, value_t size, int num_shards);
+static void empty_shards(multiset *set);
+static bool store_counts(multiset *set, const multiset_source *source, long n,
+                         int num_threads);
+static bool store_numbers(multiset *set, const multiset_source *source, long n,
+                          int num_threads);
+static void free_histograms(multiset *set, uint32_t **histograms,
+                            int num_threads);
+static bool store_failed(load_task *tasks);
+
+static load_task *create_load_tasks(multiset *set,
+                                    const multiset_source *source,
+                                    int num_threads);
+static void split_load(load_task *tasks, long total);
+static void run_load_tasks(load_task *tasks, void *(*task)(void *));
+static void load_chunk(load_task *task, long first, long num, value_t *values);
+static void *scan_source_task(void *arg);
+static void *generate_task(void *arg);
+static void *count_task(void *arg);
+static void *merge_counts_task(void *arg);
+static void *index_counts_task(void *arg);
+static void *radix_sort(void *keys, void *buffer, long n, uint64_t max_key,
+                        load_task *tasks);
+static void *radix_count_task(void *arg);
+static void *radix_scatter_task(void *arg);
+static bool build_sorted_shards(multiset *set, const multiset_source *source,
+                                long n, void *keys, void *buffer, bool wide,
+                                int num_threads);
+static void *build_shards_task(void *arg);
+static value_t load_value(const load_task *task, long i);
+static long count_distinct(const load_task *task, long first, long last);
+static long collapse_keys32(uint32_t *keys, uint32_t *counts, long num);
+static long collapse_keys64(uint64_t *keys, long *counts, long num,
+                            value_t base);
+static long collapse_source(const multiset_source *source, long first,
+                            long last, value_t *values, long *counts);
+static long load_lower_bound(const load_task *task, long first, long last,
+                             value_t value);
+static value_t source_value(const multiset_source *source, long i);
+
+static size_t write_piece(FILE *file, const void *data, size_t bytes,
+                          uint64_t *checksum);
+static bool check_header(snapshot_header *header, size_t bytes,
+                         const char *path);
+static void *restore_shards_task(void *arg);
+static bool restore_dense(shard *s, const snapshot_entry *entry);
+static size_t section_bytes(const shard *s, const snapshot_entry *entry);
+static uint64_t checksum_update(uint64_t checksum, const void *data,
+                                size_t bytes);
+static size_t header_bytes(int count);
+
+static void apply_shard_batch(shard *s, batch_op *ops, const batch_key *keys,
+                              int num);
+static bool dense_batch(shard *s, batch_op *ops, const batch_key *keys,
+                        int num);
+static bool runs_batch(shard *s, batch_op *ops, const batch_key *keys, int num);
+static bool tree_batch(shard *s, batch_op *ops, const batch_key *keys, int num);
+static int compare_batch_keys(const void *a, const void *b);
+
+static bool shard_init(shard *s, value_t first, value_t size);
+static bool in_set(const multiset *set, value_t value);
+static int shard_index(const multiset *set, value_t value);
+static int shard_offset(shard *s, value_t value);
+static long shard_find(shard *s, value_t value);
+static bool shard_add(shard *s, value_t value);
+static int shard_delete(shard *s, value_t value);
+static value_t shard_pred(shard *s, value_t value);
+static value_t shard_succ(shard *s, value_t value);
+static value_t shard_first(shard *s);
+static value_t shard_last(shard *s);
+static long shard_rank(shard *s, value_t value);
+static value_t shard_select(shard *s, long k);
+static long shard_iterate(shard *s, value_t first, value_t last,
+                          range_callback callback, void *context);
+static long dense_sum(shard *s, int from, int to);
+static bool dense_build_index(shard *s);
+static long dense_add(shard *s, value_t value);
+static long dense_delete(shard *s, value_t value);
+static void record_add(shard *s, value_t value, long count);
+static void record_delete(shard *s, value_t value, long remaining);
+static void shard_init_extremes(shard *s);
+static void shard_update_extremes(shard *s, value_t value);
+static bool shard_build(shard *s, storage_mode target,
+                        const pair_array *pairs);
+static value_t pair_value(const pair_array *pairs, long i);
+static long pair_count(const pair_array *pairs, long i);
+static size_t shard_bytes(shard *s);
+static size_t shard_slack(shard *s);
+static bool count_update(shard *s);
+static void check_storage_mode(shard *s);
+static storage_mode choose_storage_mode(shard *s);
+static bool migrate(shard *s, storage_mode target);
+static long export_entries(shard *s, value_t *values, long *counts);
+static void free_layout(shard *s, storage_mode mode);
+static void free_shard(shard *s);
+
+static bool counter_init(counter_array *c, int size, int width);
+static int counter_width(int size, long past8, long past16);
+static bool counter_fit(counter_array *c);
+static bool counter_widen(counter_array *c, int width);
+static uint32_t bucket_load(counter_array *c, int index);
+static bool bucket_swap(counter_array *c, int index, uint32_t *expected,
+                        uint32_t desired);
+static void bucket_store(counter_array *c, int index, uint32_t count);
+static long counter_get(counter_array *c, int index);
+static bool counter_set(counter_array *c, int index, long count);
+static long counter_increment(counter_array *c, int index);
+static long counter_decrement(counter_array *c, int index);
+static overflow_entry *overflow_lookup(counter_array *c, int index);
+static bool overflow_reserve(counter_array *c);
+static bool overflow_resize(counter_array *c, int capacity);
+static void overflow_insert(counter_array *c, int index, long count);
+static void overflow_remove(counter_array *c, int index);
+static void free_counters(counter_array *c);
+
+static bool bitmap_init(occupancy_bitmap *b, int size);
+static void bitmap_layout(occupancy_bitmap *b, int size);
+static void bitmap_set(occupancy_bitmap *b, int index);
+static void bitmap_set_level(occupancy_bitmap *b, int level, size_t position);
+static void bitmap_clear(occupancy_bitmap *b, int index);
+static void bitmap_clear_level(occupancy_bitmap *b, int level, size_t position);
+static int bitmap_next(occupancy_bitmap *b, int index);
+static int bitmap_prev(occupancy_bitmap *b, int index);
+static void free_bitmap(occupancy_bitmap *b);
+
+static bool block_index_init(block_index *x, int size);
+static int block_index_blocks(int size);
+static void block_index_add(block_index *x, int index, long delta);
+static long block_index_prefix(block_index *x, int block);
+static int block_index_find(block_index *x, long *k);
+static void block_index_build(block_index *x);
+static void free_block_index(block_index *x);
+
+static bool runs_build(run_list *r, value_t base, const pair_array *pairs);
+static long runs_find(run_list *r, int value);
+static long runs_insert(run_list *r, int value);
+static long runs_insert_at(run_list *r, int value, int pos);
+static long runs_remove(run_list *r, int value);
+static long runs_remove_at(run_list *r, int value, int pos);
+static int runs_seek(run_list *r, int value, int from);
+static int runs_pred(run_list *r, int value);
+static int runs_succ(run_list *r, int value);
+static int runs_nearest_gap(run_list *r, int pos);
+static void runs_touched(run_list *r, int first, int last);
+static void runs_compact(shard *s);
+static void runs_compact_step(run_list *r);
+static void runs_shifted(run_list *r, int first, int last, int step);
+static bool runs_index(run_list *r, block_index *x, int capacity);
+static void runs_reindex(run_list *r, int first, int last);
+static long runs_rank(run_list *r, int value);
+static int runs_select(run_list *r, long k);
+static bool runs_grow(run_list *r);
+static void free_runs(run_list *r);
+
+static bpt_leaf *create_leaf(bptree *t);
+static bpt_internal *create_internal(bptree *t);
+static bool tree_build(bptree *t, const pair_array *pairs);
+static bpt_leaf *tree_descend(bptree *t, value_t value, bpt_internal **path,
+                              int *slots);
+static long tree_find(bptree *t, value_t value);
+static long leaf_find(const bpt_leaf *leaf, value_t value);
+static long tree_insert(bptree *t, value_t value);
+static long tree_remove(bptree *t, value_t value);
+static value_t tree_pred(bptree *t, value_t value);
+static value_t tree_succ(bptree *t, value_t value);
+static long tree_rank(bptree *t, value_t value);
+static value_t tree_select(bptree *t, long k);
+static long tree_iterate(bptree *t, value_t first, value_t last,
+                         range_callback callback, void *context);
+static void tree_path_add(bptree *t, bpt_internal **path, int *slots,
+                          long delta);
+static long leaf_total(const bpt_leaf *leaf);
+static long node_total(void *node, int height);
+static bool reserve_split(bptree *t, bpt_internal **path,
+                          bpt_internal **spares);
+static void insert_separator(bptree *t, bpt_internal **path, int *slots,
+                             int level, value_t key, void *child, long total,
+                             bpt_internal **spares);
+static void rebalance_leaf(bptree *t, bpt_internal **path, int *slots);
+static void rebalance_internal(bptree *t, bpt_internal **path, int *slots,
+                               int level);
+static void leaf_locate(const bpt_leaf *leaf, value_t value, leaf_position *at);
+static long leaf_insert(bpt_leaf *leaf, value_t value);
+static long leaf_remove(bpt_leaf *leaf, value_t value);
+static bool leaf_splice(bpt_leaf *leaf, int offset, int old_size,
+                        const uint8_t *bytes, int new_size);
+static bool redistribute_leaves(bptree *t, bpt_leaf *left, bpt_leaf *right);
+static void link_leaf_after(bptree *t, bpt_leaf *leaf, bpt_leaf *right);
+static void unlink_leaf(bptree *t, bpt_leaf *leaf);
+static int leaf_decode(const bpt_leaf *leaf, value_t *keys, long *counts);
+static void leaf_encode(bpt_leaf *leaf, const value_t *keys, const long *counts,
+                        int num);
+static void leaf_encode_pairs(bpt_leaf *leaf, const pair_array *pairs,
+                              long first, int num);
+static int decode_entry(const uint8_t *data, int offset, value_t *key,
+                        long *count);
+static int encode_entry(uint8_t *out, uint64_t delta, long count);
+static int entry_size(uint64_t delta, long count);
+static int encoded_size(const value_t *keys, const long *counts, int num);
+static int split_point(const value_t *keys, const long *counts, int num);
+static int varint_size(uint64_t value);
+static int varint_encode(uint8_t *out, uint64_t value);
+static int varint_decode(const uint8_t *in, uint64_t *value);
+static void internal_remove_at(bpt_internal *node, int pos);
+static void free_tree_node(bptree *t, void *node, int height);
+static void free_tree(bptree *t);
+
+static void *account_alloc(memory_account *m, memory_kind kind, size_t bytes,
+                           bool zeroed);
+static void *account_aligned(memory_account *m, memory_kind kind,
+                             size_t bytes);
+static void *account_realloc(memory_account *m, memory_kind kind, void *block,
+                             size_t bytes);
+static void account_free(memory_account *m, memory_kind kind, void *block);
+static void account_change(memory_account *m, memory_kind kind, long bytes,
+                           long blocks);
+static size_t block_bytes(void *block);
+static void *page_alloc(memory_account *m, memory_kind kind, size_t bytes,
+                        bool zeroed);
+static page_header *map_pages(size_t bytes);
+static void page_free(memory_account *m, memory_kind kind, void *array);
+static void init_numa();
+
+static double now_seconds();
+static uint64_t now_nanos();
+static void set_error(const char *format, ...);
+
+static void init_search();
+static int lower_bound(const int *keys, int num_keys, int value);
+static int upper_bound(const int *keys, int num_keys, int value);
+static int lower_bound64(const value_t *keys, int num_keys, value_t value);
+static int upper_bound64(const value_t *keys, int num_keys, value_t value);
+static int count_below(const int *keys, int num_keys, int value);
+static int count_below64(const value_t *keys, int num_keys, value_t value);
+static int next_nonzero(const int *counts, int from, int to);
+static int prev_nonzero(const int *counts, int from);
+#ifdef SEARCH_X86
+static int count_below_sse(const int *keys, int num_keys, int value);
+static int count_below_avx2(const int *keys, int num_keys, int value);
+static int count_below64_sse(const value_t *keys, int num_keys, value_t value);
+static int count_below64_avx2(const value_t *keys, int num_keys, value_t value);
+static int next_nonzero_avx2(const int *counts, int from, int to);
+static int prev_nonzero_avx2(const int *counts, int from);
+#endif
+
+////////////////////////
+// MULTISET FUNCTIONS //
+////////////////////////
+
+// Function to give the reason the last failing call on this thread failed
+const char *multiset_error() { return error_message; }
+
+// Function to create an empty set over [r1, r2]. Shards start as run lists,
+// or B+-trees when too wide for one, and move on as numbers arrive
+multiset *multiset_create(value_t r1, value_t r2, int num_shards) {
+  // One past r2 must still be representable
+  if (r1 < 1 || r1 >= r2 || r2 == INT64_MAX) {
+    set_error("Error: [%" PRId64 ", %" PRId64 "] is not a valid range.", r1,
+              r2);
+    return NULL;
+  }
+
+  multiset *set = create_set(r1, r2 - r1 + 1, num_shards);
+
+  if (set) {
+    empty_shards(set);
+  }
+
+  return set;
+}
+
+// Function to free everything the set holds, including any snapshot mapping
+void multiset_destroy(multiset *set) {
+  if (!set) {
+    return;
+  }
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    free_shard(&set->shards[i]);
+    pthread_rwlock_destroy(&set->shards[i].lock);
+  }
+
+  account_free(&set->memory, MEMORY_SHARDS, set->shards);
+
+  if (set->snapshot_data) {
+    munmap(set->snapshot_data, set->snapshot_bytes);
+  }
+
+  pthread_mutex_destroy(&set->migration_lock);
+  free(set);
+}
+
+// Function to replace the set's numbers with n numbers from source in a
+// memory efficient layout. Dense counters are indexed by int, so wider shards
+// are never dense
+bool multiset_load(multiset *set, const multiset_source *source, long n,
+                   int num_threads) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    free_shard(&set->shards[i]);
+    set->shards[i].num_stored = set->shards[i].num_distinct = 0;
+  }
+
+  bool loaded;
+
+  if (set->range < n && set->shard_width <= INT_MAX) {
+    loaded = store_counts(set, source, n, num_threads);
+  } else {
+    loaded = store_numbers(set, source, n, num_threads);
+  }
+
+  if (!loaded) {
+    empty_shards(set);
+    return false;
+  }
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard_init_extremes(&set->shards[i]);
+  }
+
+  return true;
+}
+
+// Function to give the set's bounds
+void multiset_bounds(const multiset *set, value_t *r1, value_t *r2) {
+  *r1 = set->r1;
+  *r2 = set->r1 + set->range - 1;
+}
+
+// Function to total up the set's shards, each read under its lock
+void multiset_get_stats(const multiset *set, multiset_stats *stats) {
+  memset(stats, 0, sizeof(multiset_stats));
+  stats->num_shards = set->num_shards;
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard *s = &set->shards[i];
+
+    pthread_rwlock_rdlock(&s->lock);
+    ++stats->mode_counts[s->mode];
+    stats->num_stored += s->num_stored;
+    stats->num_distinct += s->num_distinct;
+    stats->bytes += shard_bytes(s);
+    stats->slack_bytes += shard_slack(s);
+
+    if (s->mode == RUNS_MODE) {
+      stats->run_slots += s->runs.size;
+      stats->run_gaps += s->runs.gaps;
+    }
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  stats->mapped_bytes = set->snapshot_bytes;
+  stats->compaction_passes = set->compaction_passes;
+  stats->compaction_steps = set->compaction_steps;
+  stats->compaction_nanos = set->compaction_nanos;
+  stats->num_migrations = set->num_migrations;
+
+  for (int i = 0; i < NUM_MEMORY_KINDS; ++i) {
+    stats->heap_bytes[i] = set->memory.bytes[i];
+    stats->heap_blocks[i] = set->memory.blocks[i];
+  }
+
+  stats->heap_total = set->memory.total;
+  stats->heap_peak = set->memory.peak;
+
+  for (int i = BASE_PAGES; i <= HUGE_PAGES; ++i) {
+    stats->page_bytes[i] = set->memory.page_bytes[i];
+  }
+}
+
+// Function to give the migrations recorded so far, returning how many there
+// are. Only the first MAX_MIGRATION_RECORDS are kept
+int multiset_migrations(const multiset *set,
+                        const migration_record **records) {
+  *records = set->migrations;
+
+  return set->num_migrations < MAX_MIGRATION_RECORDS ? set->num_migrations
+                                                     : MAX_MIGRATION_RECORDS;
+}
+
+// Function to cap the search kernels at the ones named, so vector and scalar
+// searches can be compared. Returns false for an unknown name
+bool multiset_limit_search(const char *name) {
+  for (int i = SCALAR_SEARCH; i <= AVX2_SEARCH; ++i) {
+    if (strcmp(name, search_names[i]) == 0) {
+      search_limit = (search_level)i;
+      init_search();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *multiset_search_name() {
+  pthread_once(&search_once, init_search);
+  return search_names[search_kernels];
+}
+
+// Function to choose the pages backing large arrays by name, base, thp or
+// huge. Returns false for an unknown name
+bool multiset_use_pages(const char *name) {
+  for (int i = BASE_PAGES; i <= HUGE_PAGES; ++i) {
+    if (strcmp(name, page_names[i]) == 0) {
+      page_limit = (page_policy)i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void multiset_interleave_pages(bool interleave) {
+  page_interleave = interleave;
+}
+
+const char *multiset_pages_name() { return page_names[page_limit]; }
+
+int multiset_numa_nodes() {
+  pthread_once(&numa_once, init_numa);
+  return numa_nodes;
+}
+
+// Utility function to allocate a set over [first, first + size) split into
+// num_shards shards of equal width, leaving their layouts to be built. Returns
+// NULL if memory or locks for it can't be had
+static multiset *create_set(value_t first, value_t size, int num_shards) {
+  multiset *set = (multiset *)calloc(1, sizeof(multiset));
+
+  if (!set) {
+    set_error("Failed to allocate memory for multiset.");
+    return NULL;
+  }
+
+  pthread_once(&search_once, init_search);
+  pthread_mutex_init(&set->migration_lock, NULL);
+  account_change(&set->memory, MEMORY_SHARDS, block_bytes(set), 1);
+
+  if (num_shards < 1) {
+    num_shards = 1;
+  }
+
+  // Drop shards left without values once the width is rounded up
+  set->r1 = first;
+  set->range = size;
+  set->shard_width = (size - 1) / num_shards + 1;
+  set->num_shards = (size - 1) / set->shard_width + 1;
+
+  set->shards = (shard *)account_aligned(&set->memory, MEMORY_SHARDS,
+                                         set->num_shards * sizeof(shard));
+
+  if (!set->shards) {
+    set_error("Failed to allocate memory for shards.");
+    pthread_mutex_destroy(&set->migration_lock);
+    free(set);
+    return NULL;
+  }
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    value_t offset = i * set->shard_width;
+    value_t width =
+        i < set->num_shards - 1 ? set->shard_width : size - offset;
+
+    shard *s = &set->shards[i];
+
+    if (!shard_init(s, first + offset, width)) {
+      set->num_shards = i;
+      multiset_destroy(set);
+      return NULL;
+    }
+    s->set = set;
+    s->counts.memory = s->bitmap.memory = s->blocks.memory = s->runs.memory =
+        s->runs.blocks.memory = s->tree.memory = &set->memory;
+  }
+
+  return set;
+}
+
+// Utility function to give every shard an empty layout, a run list when
+// narrow enough and a B+-tree otherwise. Empty layouts hold no memory, so
+// this can't fail
+static void empty_shards(multiset *set) {
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard *s = &set->shards[i];
+
+    pair_array none = {0};
+
+    free_shard(s);
+    shard_build(s, s->range <= MAX_RUNS_RANGE ? RUNS_MODE : TREE_MODE, &none);
+    shard_init_extremes(s);
+  }
+}
+
+// Take n numbers from the source and store their counts in each shard's
+// array. Threads count into private histograms merged bucket by bucket
+// afterwards, unless those would take more memory than the numbers
+// themselves, a thread's share could overflow their 32-bit buckets or there
+// is no memory for them, in which case they share the atomic counters directly
+static bool store_counts(multiset *set, const multiset_source *source, long n,
+                         int num_threads) {
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard *s = &set->shards[i];
+
+    if (!counter_init(&s->counts, s->range, 1) ||
+        !bitmap_init(&s->bitmap, s->range)) {
+      set_error("Failed to allocate memory for bulk load.");
+      return false;
+    }
+    s->mode = DENSE_MODE;
+  }
+
+  load_task *tasks = create_load_tasks(set, source, num_threads);
+  uint32_t **histograms = NULL;
+
+  if (!tasks) {
+    return false;
+  }
+
+  if (num_threads > 1 && (long)num_threads * set->range <= 2L * n &&
+      n / num_threads < UINT32_MAX) {
+    histograms = (uint32_t **)calloc(num_threads, sizeof(uint32_t *));
+
+    for (int i = 0; histograms && i < num_threads; ++i) {
+      histograms[i] = (uint32_t *)page_alloc(
+          &set->memory, MEMORY_SCRATCH, set->range * sizeof(uint32_t), true);
+
+      if (!histograms[i]) {
+        free_histograms(set, histograms, num_threads);
+        histograms = NULL;
+      }
+    }
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    tasks[i].histograms = histograms;
+  }
+
+  split_load(tasks, n);
+  run_load_tasks(tasks, count_task);
+
+  bool failed = store_failed(tasks);
+
+  if (!failed) {
+    split_load(tasks, set->range);
+    run_load_tasks(tasks, merge_counts_task);
+    failed = store_failed(tasks);
+  }
+
+  if (!failed) {
+    split_load(tasks, set->num_shards);
+    run_load_tasks(tasks, index_counts_task);
+    failed = store_failed(tasks);
+  }
+
+  if (histograms) {
+    free_histograms(set, histograms, num_threads);
+  }
+
+  free(tasks);
+  return !failed;
+}
+
+// Utility function to free the load histograms allocated so far
+static void free_histograms(multiset *set, uint32_t **histograms,
+                            int num_threads) {
+  for (int i = 0; i < num_threads; ++i) {
+    page_free(&set->memory, MEMORY_SCRATCH, histograms[i]);
+  }
+  free(histograms);
+}
+
+// Take n numbers from the source and bulk load each shard's slice of them
+// into a run list for narrow shards, or a B+-tree otherwise. Generation,
+// sorting and the per shard builds are all split between the threads. Keys
+// are sorted as 32-bit offsets unless the range is too wide, and source
+// numbers already in order skip the sort altogether
+static bool store_numbers(multiset *set, const multiset_source *source, long n,
+                          int num_threads) {
+  load_task *tasks = create_load_tasks(set, source, num_threads);
+
+  if (!tasks) {
+    return false;
+  }
+
+  if (source->numbers) {
+    bool sorted = true;
+
+    // Check the numbers in parallel, which also faults mapped pages in
+    split_load(tasks, n);
+    run_load_tasks(tasks, scan_source_task);
+
+    for (int i = 0; i < num_threads; ++i) {
+      sorted = sorted && tasks[i].sorted;
+    }
+
+    if (store_failed(tasks)) {
+      free(tasks);
+      return false;
+    }
+
+    if (sorted) {
+      free(tasks);
+      return build_sorted_shards(set, source, n, NULL, NULL, false,
+                                 num_threads);
+    }
+  }
+
+  // Counts are collapsed into the sort buffer, so they must fit a key too
+  bool wide = (uint64_t)(set->range - 1) > UINT32_MAX || n > UINT32_MAX;
+  size_t key_bytes = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+  void *keys =
+      page_alloc(&set->memory, MEMORY_SCRATCH, (n + 1) * key_bytes, false);
+  void *buffer =
+      page_alloc(&set->memory, MEMORY_SCRATCH, (n + 1) * key_bytes, false);
+
+  if (!keys || !buffer) {
+    set_error("Failed to allocate memory for number generation.");
+    free(tasks);
+    page_free(&set->memory, MEMORY_SCRATCH, keys);
+    page_free(&set->memory, MEMORY_SCRATCH, buffer);
+    return false;
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    tasks[i].keys = keys;
+    tasks[i].wide = wide;
+  }
+
+  split_load(tasks, n);
+  run_load_tasks(tasks, generate_task);
+
+  bool failed = store_failed(tasks);
+
+  // Keys are offsets from r1, so the sort only needs as many digits as the
+  // range
+  if (!failed) {
+    void *sorted = radix_sort(keys, buffer, n, set->range - 1, tasks);
+    void *spare = sorted == keys ? buffer : keys;
+    failed = !build_sorted_shards(set, source, n, sorted, spare, wide,
+                                  num_threads);
+  }
+
+  free(tasks);
+  page_free(&set->memory, MEMORY_SCRATCH, keys);
+  page_free(&set->memory, MEMORY_SCRATCH, buffer);
+
+  return !failed;
+}
+
+// Utility function to record why a load's threads stopped, at the first
+// number outside [r1, r2] or for want of memory, returning true if they did
+static bool store_failed(load_task *tasks) {
+  for (int i = 0; i < tasks[0].num_threads; ++i) {
+    if (tasks[i].invalid >= 0) {
+      set_error("Error: input number %" PRId64 " is outside [r1, r2].",
+                tasks[i].stray);
+      return true;
+    }
+
+    if (tasks[i].failed) {
+      set_error("Failed to allocate memory for bulk load.");
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/////////////////////////
+// BULK LOAD FUNCTIONS //
+/////////////////////////
+
+// Utility function to set up one load task per thread over the set, NULL if
+// there is no memory for them
+static load_task *create_load_tasks(multiset *set,
+                                    const multiset_source *source,
+                                    int num_threads) {
+  load_task *tasks = (load_task *)calloc(num_threads, sizeof(load_task));
+
+  if (!tasks) {
+    set_error("Failed to allocate memory for bulk load.");
+    return NULL;
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    tasks[i].id = i;
+    tasks[i].num_threads = num_threads;
+    tasks[i].set = set;
+    tasks[i].source = source;
+    tasks[i].invalid = -1;
+  }
+
+  return tasks;
+}
+
+// Utility function to split total items into contiguous slices, one per thread
+static void split_load(load_task *tasks, long total) {
+  int num_threads = tasks[0].num_threads;
+
+  for (int i = 0; i < num_threads; ++i) {
+    tasks[i].start = total * i / num_threads;
+    tasks[i].end = total * (i + 1) / num_threads;
+  }
+}
+
+// Run task over every slice, on the calling thread when there is only one.
+// Slices whose thread can't be started are run on the calling thread instead
+static void run_load_tasks(load_task *tasks, void *(*task)(void *)) {
+  int num_threads = tasks[0].num_threads;
+  int started = 0;
+
+  if (num_threads > 1) {
+    while (started < num_threads &&
+           pthread_create(&tasks[started].thread, NULL, task,
+                          &tasks[started]) == 0) {
+      ++started;
+    }
+  }
+
+  for (int i = started; i < num_threads; ++i) {
+    task(&tasks[i]);
+  }
+
+  for (int i = 0; i < started; ++i) {
+    pthread_join(tasks[i].thread, NULL);
+  }
+}
+
+// Utility function to take num numbers from the source starting at first,
+// recording the first one outside [r1, r2] in the task
+static void load_chunk(load_task *task, long first, long num, value_t *values) {
+  const multiset_source *source = task->source;
+  value_t r1 = task->set->r1, range = task->set->range;
+
+  if (source->numbers) {
+    for (long i = 0; i < num; ++i) {
+      values[i] = source_value(source, first + i);
+    }
+  } else {
+    source->fill(source->context, task->id, first, num, values);
+  }
+
+  for (long i = 0; i < num; ++i) {
+    if (values[i] < r1 || values[i] - r1 >= range) {
+      task->invalid = first + i;
+      task->stray = values[i];
+      return;
+    }
+  }
+}
+
+// Check the slice of source numbers lies in [r1, r2] and is in order,
+// including against the number before it
+static void *scan_source_task(void *arg) {
+  load_task *task = (load_task *)arg;
+  value_t r1 = task->set->r1, range = task->set->range;
+
+  task->sorted = true;
+
+  for (long i = task->start; i < task->end; ++i) {
+    value_t value = source_value(task->source, i);
+
+    if (value < r1 || value - r1 >= range) {
+      task->invalid = i;
+      task->stray = value;
+      return NULL;
+    }
+
+    if (i > 0 && source_value(task->source, i - 1) > value) {
+      task->sorted = false;
+    }
+  }
+
+  return NULL;
+}
+
+// Fill the slice with the source's numbers as offsets from r1, a chunk at a
+// time, stopping at the first one outside [r1, r2]
+static void *generate_task(void *arg) {
+  load_task *task = (load_task *)arg;
+  value_t values[LOAD_CHUNK];
+
+  for (long first = task->start; first < task->end; first += LOAD_CHUNK) {
+    long num = task->end - first < LOAD_CHUNK ? task->end - first : LOAD_CHUNK;
+
+    load_chunk(task, first, num, values);
+    if (task->invalid >= 0) {
+      return NULL;
+    }
+
+    for (long i = 0; i < num; ++i) {
+      value_t offset = values[i] - task->set->r1;
+
+      if (task->wide) {
+        ((uint64_t *)task->keys)[first + i] = offset;
+      } else {
+        ((uint32_t *)task->keys)[first + i] = (uint32_t)offset;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// Take the slice's share of numbers from the source, counting them in the
+// thread's own histogram or straight into the shared atomic counters
+static void *count_task(void *arg) {
+  load_task *task = (load_task *)arg;
+  multiset *set = task->set;
+  uint32_t *histogram =
+      task->histograms ? task->histograms[task->id] : NULL;
+  value_t values[LOAD_CHUNK];
+
+  for (long first = task->start; first < task->end; first += LOAD_CHUNK) {
+    long num = task->end - first < LOAD_CHUNK ? task->end - first : LOAD_CHUNK;
+
+    load_chunk(task, first, num, values);
+    if (task->invalid >= 0) {
+      return NULL;
+    }
+
+    for (long i = 0; i < num; ++i) {
+      value_t offset = values[i] - set->r1;
+
+      if (histogram) {
+        ++histogram[offset];
+      } else {
+        shard *s = &set->shards[offset / set->shard_width];
+        long count = counter_increment(&s->counts, (int)(values[i] - s->r1));
+
+        // A lone thread has the counters to itself, so widens them as soon
+        // as enough buckets have spilled rather than after the load
+        if (count < 0 || (task->num_threads == 1 &&
+                          count == s->counts.saturated &&
+                          !counter_fit(&s->counts))) {
+          task->failed = true;
+          return NULL;
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// Merge the histograms over the slice's buckets into the counters, then mark
+// occupied buckets and tally each shard's totals
+static void *merge_counts_task(void *arg) {
+  load_task *task = (load_task *)arg;
+  multiset *set = task->set;
+  shard *s = NULL;
+  long stored = 0, distinct = 0;
+
+  for (long offset = task->start; offset < task->end; ++offset) {
+    if (!s || offset >= s->r1 - set->r1 + s->range) {
+      if (s) {
+        atomic_fetch_add_explicit(&s->num_stored, stored,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->num_distinct, distinct,
+                                  memory_order_relaxed);
+      }
+
+      s = &set->shards[offset / set->shard_width];
+      stored = distinct = 0;
+    }
+
+    int index = (int)(offset - (s->r1 - set->r1));
+    long count;
+
+    if (task->histograms) {
+      count = 0;
+      for (int i = 0; i < task->num_threads; ++i) {
+        count += task->histograms[i][offset];
+      }
+
+      if (count > 0 && !counter_set(&s->counts, index, count)) {
+        task->failed = true;
+        return NULL;
+      }
+    } else {
+      count = counter_get(&s->counts, index);
+    }
+
+    if (count > 0) {
+      bitmap_set(&s->bitmap, index);
+      stored += count;
+      ++distinct;
+    }
+  }
+
+  if (s) {
+    atomic_fetch_add_explicit(&s->num_stored, stored, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->num_distinct, distinct,
+                              memory_order_relaxed);
+  }
+
+  return NULL;
+}
+
+// Widen the counters of each of the slice's shards if enough have spilled,
+// and build their block index, once they are complete
+static void *index_counts_task(void *arg) {
+  load_task *task = (load_task *)arg;
+
+  for (long i = task->start; i < task->end; ++i) {
+    shard *s = &task->set->shards[i];
+
+    if (!counter_fit(&s->counts) || !dense_build_index(s)) {
+      task->failed = true;
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+// Sort non-negative keys with a least significant digit radix sort, skipping
+// digits above the largest key. Each pass has every thread count the digits
+// of its slice, then scatter the slice to offsets reserved for it, keeping
+// the sort stable. Keys are as wide as the tasks say. Returns whichever of
+// keys and buffer ends up sorted
+static void *radix_sort(void *keys, void *buffer, long n, uint64_t max_key,
+                        load_task *tasks) {
+  int num_threads = tasks[0].num_threads;
+
+  split_load(tasks, n);
+
+  for (int shift = 0; shift < 64 && (max_key >> shift) > 0;
+       shift += RADIX_BITS) {
+    for (int i = 0; i < num_threads; ++i) {
+      tasks[i].keys = keys;
+      tasks[i].buffer = buffer;
+      tasks[i].shift = shift;
+    }
+
+    run_load_tasks(tasks, radix_count_task);
+
+    // Digit d of thread t lands after all smaller digits, and after digit d
+    // of every earlier thread
+    long offset = 0;
+    for (int digit = 0; digit < RADIX_BUCKETS; ++digit) {
+      for (int i = 0; i < num_threads; ++i) {
+        long count = tasks[i].digits[digit];
+        tasks[i].digits[digit] = offset;
+        offset += count;
+      }
+    }
+
+    run_load_tasks(tasks, radix_scatter_task);
+
+    void *sorted = buffer;
+    buffer = keys;
+    keys = sorted;
+  }
+
+  return keys;
+}
+
+static void *radix_count_task(void *arg) {
+  load_task *task = (load_task *)arg;
+
+  memset(task->digits, 0, sizeof(task->digits));
+
+  if (task->wide) {
+    const uint64_t *keys = (const uint64_t *)task->keys;
+
+    for (long i = task->start; i < task->end; ++i) {
+      ++task->digits[(keys[i] >> task->shift) & (RADIX_BUCKETS - 1)];
+    }
+  } else {
+    const uint32_t *keys = (const uint32_t *)task->keys;
+
+    for (long i = task->start; i < task->end; ++i) {
+      ++task->digits[(keys[i] >> task->shift) & (RADIX_BUCKETS - 1)];
+    }
+  }
+
+  return NULL;
+}
+
+static void *radix_scatter_task(void *arg) {
+  load_task *task = (load_task *)arg;
+
+  if (task->wide) {
+    const uint64_t *keys = (const uint64_t *)task->keys;
+    uint64_t *buffer = (uint64_t *)task->buffer;
+
+    for (long i = task->start; i < task->end; ++i) {
+      int digit = (keys[i] >> task->shift) & (RADIX_BUCKETS - 1);
+      buffer[task->digits[digit]++] = keys[i];
+    }
+  } else {
+    const uint32_t *keys = (const uint32_t *)task->keys;
+    uint32_t *buffer = (uint32_t *)task->buffer;
+
+    for (long i = task->start; i < task->end; ++i) {
+      int digit = (keys[i] >> task->shift) & (RADIX_BUCKETS - 1);
+      buffer[task->digits[digit]++] = keys[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Bulk load n sorted numbers, either sorted keys with the spare sort buffer
+// beside them or, when keys is NULL, source numbers that were already in
+// order. Source numbers in order are used straight from where they lie. Each
+// shard's run of numbers is found by binary search and collapsed as the shard
+// is built. Returns false if memory ran out
+static bool build_sorted_shards(multiset *set, const multiset_source *source,
+                                long n, void *keys, void *buffer, bool wide,
+                                int num_threads) {
+  long *bounds = (long *)malloc((set->num_shards + 1) * sizeof(long));
+  load_task *tasks = create_load_tasks(set, source, num_threads);
+
+  if (!bounds || !tasks) {
+    set_error("Failed to allocate memory for shard bounds.");
+    free(bounds);
+    free(tasks);
+    return false;
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    tasks[i].keys = keys;
+    tasks[i].buffer = buffer;
+    tasks[i].wide = wide;
+    tasks[i].bounds = bounds;
+  }
+
+  bounds[0] = 0;
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard *s = &set->shards[i];
+    bounds[i + 1] = load_lower_bound(&tasks[0], bounds[i], n, s->r1 + s->range);
+  }
+
+  split_load(tasks, set->num_shards);
+  run_load_tasks(tasks, build_shards_task);
+
+  bool failed = store_failed(tasks);
+
+  free(tasks);
+  free(bounds);
+  return !failed;
+}
+
+// Collapse each of the slice's shards into (value, count) pairs and bulk load
+// it. Sorted keys are collapsed in place, leaving each shard's distinct keys
+// at the front of its slice and their counts in the same slots of the spare
+// sort buffer, so a load never holds more than its two key arrays. Source
+// numbers in order can't be written to, so they are collapsed into one pair
+// buffer sized for the slice's largest shard
+static void *build_shards_task(void *arg) {
+  load_task *task = (load_task *)arg;
+  shard *shards = task->set->shards;
+  memory_account *memory = &task->set->memory;
+  value_t *values = NULL;
+  long *counts = NULL;
+
+  if (!task->keys) {
+    long capacity = 1;
+
+    for (long i = task->start; i < task->end; ++i) {
+      long distinct =
+          count_distinct(task, task->bounds[i], task->bounds[i + 1]);
+
+      if (distinct > capacity) {
+        capacity = distinct;
+      }
+    }
+
+    values = (value_t *)account_alloc(memory, MEMORY_SCRATCH,
+                                      capacity * sizeof(value_t), false);
+    counts = (long *)account_alloc(memory, MEMORY_SCRATCH,
+                                   capacity * sizeof(long), false);
+
+    if (!values || !counts) {
+      account_free(memory, MEMORY_SCRATCH, values);
+      account_free(memory, MEMORY_SCRATCH, counts);
+      task->failed = true;
+      return NULL;
+    }
+  }
+
+  for (long i = task->start; i < task->end; ++i) {
+    shard *s = &shards[i];
+    long first = task->bounds[i], num = task->bounds[i + 1] - first;
+    pair_array pairs = {0};
+
+    if (!task->keys) {
+      pairs.values = values;
+      pairs.counts = counts;
+      pairs.num = collapse_source(task->source, first, first + num, values,
+                                  counts);
+    } else if (task->wide) {
+      uint64_t *keys = (uint64_t *)task->keys + first;
+      long *key_counts = (long *)task->buffer + first;
+
+      pairs.num = collapse_keys64(keys, key_counts, num, task->set->r1);
+      pairs.values = (const value_t *)keys;
+      pairs.counts = key_counts;
+    } else {
+      uint32_t *keys = (uint32_t *)task->keys + first;
+      uint32_t *key_counts = (uint32_t *)task->buffer + first;
+
+      pairs.num = collapse_keys32(keys, key_counts, num);
+      pairs.offsets = keys;
+      pairs.offset_counts = key_counts;
+      pairs.base = task->set->r1;
+    }
+
+    storage_mode mode = s->range <= MAX_RUNS_RANGE ? RUNS_MODE : TREE_MODE;
+    if (mode == RUNS_MODE && num > RUNS_MAX_STORED) {
+      mode = DENSE_MODE;
+    }
+
+    if (!shard_build(s, mode, &pairs)) {
+      task->failed = true;
+      break;
+    }
+  }
+
+  account_free(memory, MEMORY_SCRATCH, values);
+  account_free(memory, MEMORY_SCRATCH, counts);
+
+  return NULL;
+}
+
+// Utility functions to collapse a sorted run of keys in place, or of source
+// numbers into (value, count) pairs, returning the number of pairs. 32-bit
+// keys stay offsets from r1, while 64-bit keys are turned into values by
+// adding base, each written no later than it is read. Each key width has its
+// own loop so the inner loop stays free of branches on the layout
+static long collapse_keys32(uint32_t *keys, uint32_t *counts, long num) {
+  long distinct = 0;
+
+  for (long j = 0; j < num; ++j) {
+    if (distinct > 0 && keys[j] == keys[distinct - 1]) {
+      ++counts[distinct - 1];
+    } else {
+      keys[distinct] = keys[j];
+      counts[distinct++] = 1;
+    }
+  }
+
+  return distinct;
+}
+
+static long collapse_keys64(uint64_t *keys, long *counts, long num,
+                            value_t base) {
+  value_t *values = (value_t *)keys;
+  long distinct = 0;
+
+  for (long j = 0; j < num; ++j) {
+    value_t value = base + (value_t)keys[j];
+
+    if (distinct > 0 && value == values[distinct - 1]) {
+      ++counts[distinct - 1];
+    } else {
+      values[distinct] = value;
+      counts[distinct++] = 1;
+    }
+  }
+
+  return distinct;
+}
+
+static long collapse_source(const multiset_source *source, long first,
+                            long last, value_t *values, long *counts) {
+  long distinct = 0;
+
+  for (long j = first; j < last; ++j) {
+    value_t value = source_value(source, j);
+
+    if (distinct > 0 && values[distinct - 1] == value) {
+      ++counts[distinct - 1];
+    } else {
+      values[distinct] = value;
+      counts[distinct++] = 1;
+    }
+  }
+
+  return distinct;
+}
+
+// Utility function to read the i-th number being loaded, from the sorted keys
+// or straight from the source
+static value_t load_value(const load_task *task, long i) {
+  if (!task->keys) {
+    return source_value(task->source, i);
+  }
+
+  value_t offset = task->wide ? (value_t)((const uint64_t *)task->keys)[i]
+                              : (value_t)((const uint32_t *)task->keys)[i];
+  return task->set->r1 + offset;
+}
+
+// Utility function to count the distinct numbers in [first, last) being
+// loaded. Each run of equal numbers is galloped past, so a value held many
+// times costs a few probes rather than a read per copy
+static long count_distinct(const load_task *task, long first, long last) {
+  long distinct = 0;
+
+  while (first < last) {
+    value_t value = load_value(task, first);
+    long step = 1;
+
+    while (first + step < last && load_value(task, first + step) == value) {
+      step *= 2;
+    }
+
+    // The run ends after first + step / 2 and by first + step
+    long end = first + step < last ? first + step : last;
+    first = load_lower_bound(task, first + step / 2 + 1, end, value + 1);
+    ++distinct;
+  }
+
+  return distinct;
+}
+
+// Utility function to find the first number in [first, last) being loaded
+// that is >= value
+static long load_lower_bound(const load_task *task, long first, long last,
+                             value_t value) {
+  while (first < last) {
+    long mid = first + (last - first) / 2;
+
+    if (load_value(task, mid) < value) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+
+  return first;
+}
+
+// Utility function to read the source's i-th number at its width
+static value_t source_value(const multiset_source *source, long i) {
+  return source->wide ? ((const int64_t *)source->numbers)[i]
+                      : ((const int32_t *)source->numbers)[i];
+}
+
+////////////////////////
+// SNAPSHOT FUNCTIONS //
+////////////////////////
+
+// Function to write every shard to a snapshot at path, giving the bytes
+// written. Shards are only read, so this must run while no operations are in
+// flight. The file is written under a temporary name and renamed into place,
+// so a crash never leaves a partial snapshot behind
+bool multiset_save(const multiset *set, const char *path, size_t *bytes) {
+  char *temp_path = (char *)malloc(strlen(path) + 5);
+  snapshot_header *header =
+      (snapshot_header *)calloc(1, header_bytes(set->num_shards));
+
+  if (!temp_path || !header) {
+    set_error("Failed to allocate memory for snapshot.");
+    free(header);
+    free(temp_path);
+    return false;
+  }
+
+  sprintf(temp_path, "%s.tmp", path);
+  FILE *file = fopen(temp_path, "wb");
+
+  if (!file) {
+    set_error("Error: could not create snapshot %s.", temp_path);
+    free(header);
+    free(temp_path);
+    return false;
+  }
+
+  snapshot_entry *entries = (snapshot_entry *)(header + 1);
+  size_t offset = header_bytes(set->num_shards);
+  bool failed = false;
+
+  for (int i = 0; i < set->num_shards && !failed; ++i) {
+    shard *s = &set->shards[i];
+    snapshot_entry *entry = &entries[i];
+
+    offset = (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT *
+             SNAPSHOT_ALIGNMENT;
+    fseek(file, offset, SEEK_SET);
+
+    entry->mode = s->mode;
+    entry->num_stored = s->num_stored;
+    entry->num_distinct = s->num_distinct;
+    entry->offset = offset;
+    entry->checksum = 0;
+
+    if (s->mode == DENSE_MODE) {
+      entry->overflow_size = s->counts.overflow_size;
+      entry->overflow_capacity = s->counts.overflow_capacity;
+      entry->counter_width = s->counts.width;
+      entry->bytes = write_piece(file, s->counts.primary,
+                                 s->range * s->counts.width,
+                                 &entry->checksum);
+
+      for (int level = 0; level < s->bitmap.num_levels; ++level) {
+        entry->bytes += write_piece(file, (const void *)s->bitmap.levels[level],
+                                    s->bitmap.num_words[level] *
+                                        sizeof(uint64_t),
+                                    &entry->checksum);
+      }
+
+      entry->bytes += write_piece(file, (const void *)s->blocks.sums,
+                                  (s->blocks.num_blocks + 1) * sizeof(long),
+                                  &entry->checksum);
+      entry->bytes += write_piece(file, s->counts.overflow,
+                                  s->counts.overflow_capacity *
+                                      sizeof(overflow_entry),
+                                  &entry->checksum);
+    } else {
+      value_t *values =
+          (value_t *)malloc((s->num_distinct + 1) * sizeof(value_t));
+      long *counts = (long *)malloc((s->num_distinct + 1) * sizeof(long));
+
+      if (values && counts) {
+        long distinct = export_entries(s, values, counts);
+
+        entry->bytes = write_piece(file, values, distinct * sizeof(value_t),
+                                   &entry->checksum);
+        entry->bytes += write_piece(file, counts, distinct * sizeof(long),
+                                    &entry->checksum);
+      } else {
+        set_error("Failed to allocate memory for snapshot.");
+        failed = true;
+      }
+
+      free(values);
+      free(counts);
+    }
+
+    offset += entry->bytes;
+  }
+
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->r1 = set->r1;
+  header->range = set->range;
+  header->num_shards = set->num_shards;
+  header->shard_width = set->shard_width;
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    header->num_stored += entries[i].num_stored;
+  }
+
+  header->checksum = checksum_update(0, header, header_bytes(set->num_shards));
+
+  fseek(file, 0, SEEK_SET);
+  fwrite(header, header_bytes(set->num_shards), 1, file);
+
+  bool written = !ferror(file);
+
+  if (fclose(file) != 0) {
+    written = false;
+  }
+
+  if (!failed && (!written || rename(temp_path, path) != 0)) {
+    set_error("Error: could not write snapshot %s.", path);
+    failed = true;
+  }
+
+  // A failed save leaves nothing behind
+  if (failed) {
+    unlink(temp_path);
+  }
+
+  *bytes = offset;
+
+  free(header);
+  free(temp_path);
+  return !failed;
+}
+
+// Utility function to write a piece of a shard's payload padded to 8 bytes,
+// folding it into the shard's checksum. Returns the bytes written
+static size_t write_piece(FILE *file, const void *data, size_t bytes,
+                          uint64_t *checksum) {
+  static const uint8_t padding[8];
+  size_t padded = (bytes + 7) / 8 * 8;
+
+  fwrite(data, 1, bytes, file);
+  fwrite(padding, 1, padded - bytes, file);
+  *checksum = checksum_update(*checksum, data, bytes);
+
+  return padded;
+}
+
+// Function to map the snapshot at path and rebuild a set from it in place of
+// loading any numbers, NULL if it can't be read. The mapping is private, so
+// its pages are only copied once something writes to them
+multiset *multiset_restore(const char *path, int num_threads) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    set_error("Error: could not open snapshot %s.", path);
+
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  size_t bytes = info.st_size;
+
+  if (bytes < sizeof(snapshot_header)) {
+    set_error("Error: snapshot %s is truncated.", path);
+    close(fd);
+    return NULL;
+  }
+
+  uint8_t *data =
+      (uint8_t *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    set_error("Error: could not map snapshot %s.", path);
+    return NULL;
+  }
+
+  snapshot_header *header = (snapshot_header *)data;
+
+  if (!check_header(header, bytes, path)) {
+    munmap(data, bytes);
+    return NULL;
+  }
+
+  multiset *set = create_set(header->r1, header->range, header->num_shards);
+
+  if (!set) {
+    munmap(data, bytes);
+    return NULL;
+  }
+
+  set->snapshot_data = data;
+  set->snapshot_bytes = bytes;
+
+  if (set->num_shards != header->num_shards ||
+      set->shard_width != header->shard_width) {
+    set_error("Error: snapshot %s header is corrupt.", path);
+    multiset_destroy(set);
+    return NULL;
+  }
+
+  // Shards are checked and rebuilt in parallel
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  load_task *tasks = create_load_tasks(set, NULL, num_threads);
+
+  if (!tasks) {
+    multiset_destroy(set);
+    return NULL;
+  }
+
+  split_load(tasks, set->num_shards);
+  run_load_tasks(tasks, restore_shards_task);
+
+  for (int i = 0; i < num_threads; ++i) {
+    if (tasks[i].invalid >= 0 || tasks[i].failed) {
+      if (tasks[i].invalid >= 0) {
+        set_error("Error: snapshot %s is corrupt at shard %ld.", path,
+                  tasks[i].invalid);
+      } else {
+        set_error("Failed to allocate memory for snapshot restore.");
+      }
+
+      free(tasks);
+      multiset_destroy(set);
+      return NULL;
+    }
+  }
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard_init_extremes(&set->shards[i]);
+  }
+
+  free(tasks);
+  return set;
+}
+
+// Utility function to check a mapped snapshot's header and directory fit in
+// its bytes and match their checksum
+static bool check_header(snapshot_header *header, size_t bytes,
+                         const char *path) {
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+    set_error("Error: %s is not a snapshot.", path);
+    return false;
+  }
+
+  if (header->version != SNAPSHOT_VERSION) {
+    set_error("Error: snapshot %s has version %u, expected %d.", path,
+              header->version, SNAPSHOT_VERSION);
+    return false;
+  }
+
+  if (header->num_shards < 1 || header->range < 2 || header->r1 < 1 ||
+      header->num_shards > header->range ||
+      header_bytes(header->num_shards) > bytes) {
+    set_error("Error: snapshot %s is truncated.", path);
+    return false;
+  }
+
+  // Check the header with its checksum taken as zero, as it was written
+  uint64_t checksum = header->checksum;
+  header->checksum = 0;
+
+  bool valid =
+      checksum_update(0, header, header_bytes(header->num_shards)) == checksum;
+
+  header->checksum = checksum;
+
+  if (!valid || header->num_stored < 0 ||
+      header->range > INT64_MAX - header->r1) {
+    set_error("Error: snapshot %s header is corrupt.", path);
+    return false;
+  }
+
+  return true;
+}
+
+// Check the slice of shards' payloads against their directory entries and
+// restore them, stopping at the first one that doesn't match or can't be
+// allocated
+static void *restore_shards_task(void *arg) {
+  load_task *task = (load_task *)arg;
+  multiset *set = task->set;
+  uint8_t *snapshot_data = set->snapshot_data;
+  size_t snapshot_bytes = set->snapshot_bytes;
+  snapshot_entry *entries =
+      (snapshot_entry *)(snapshot_data + sizeof(snapshot_header));
+
+  for (long i = task->start; i < task->end; ++i) {
+    shard *s = &set->shards[i];
+    const snapshot_entry *entry = &entries[i];
+
+    // An empty shard's payload may start past the last one written, so only
+    // payloads holding bytes have to lie within the file
+    size_t offset = entry->bytes > 0 ? entry->offset : 0;
+
+    if (entry->mode < DENSE_MODE || entry->mode > TREE_MODE ||
+        entry->offset % SNAPSHOT_ALIGNMENT != 0 || offset > snapshot_bytes ||
+        entry->bytes > snapshot_bytes - offset ||
+        entry->num_distinct < 0 || entry->num_distinct > s->range ||
+        entry->bytes != section_bytes(s, entry) ||
+        checksum_update(0, snapshot_data + offset, entry->bytes) !=
+            entry->checksum) {
+      task->invalid = i;
+      return NULL;
+    }
+
+    bool restored;
+
+    if (entry->mode == DENSE_MODE) {
+      restored = restore_dense(s, entry);
+    } else {
+      pair_array pairs = {0};
+      pairs.values = (const value_t *)(snapshot_data + offset);
+      pairs.counts = (const long *)(pairs.values + entry->num_distinct);
+      pairs.num = entry->num_distinct;
+
+      restored = shard_build(s, entry->mode, &pairs);
+    }
+
+    if (!restored) {
+      task->failed = true;
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+// Point a dense shard's counters, bitmap and block index at its payload, so
+// they are used where they lie. Only the small overflow table is copied, as it
+// is reallocated when it grows. Returns false if there is no memory for it
+static bool restore_dense(shard *s, const snapshot_entry *entry) {
+  uint8_t *payload = s->set->snapshot_data + entry->offset;
+  counter_array *c = &s->counts;
+
+  c->primary = payload;
+  c->size = (int)s->range;
+  c->width = entry->counter_width;
+  c->saturated = c->width < 4 ? (1u << (8 * c->width)) - 1 : UINT32_MAX;
+  c->mapped = true;
+  payload += (s->range * c->width + 7) / 8 * 8;
+
+  bitmap_layout(&s->bitmap, (int)s->range);
+  s->bitmap.mapped = true;
+
+  for (int level = 0; level < s->bitmap.num_levels; ++level) {
+    s->bitmap.levels[level] = (_Atomic uint64_t *)payload;
+    payload += s->bitmap.num_words[level] * sizeof(uint64_t);
+  }
+
+  s->blocks.num_blocks = block_index_blocks((int)s->range);
+  s->blocks.sums = (atomic_long *)payload;
+  s->blocks.mapped = true;
+  payload += (s->blocks.num_blocks + 1) * sizeof(long);
+
+  c->overflow_size = entry->overflow_size;
+  c->overflow_capacity = entry->overflow_capacity;
+  c->overflow = (overflow_entry *)account_alloc(
+      c->memory, MEMORY_OVERFLOW,
+      c->overflow_capacity * sizeof(overflow_entry), false);
+
+  if (!c->overflow) {
+    return false;
+  }
+
+  memcpy(c->overflow, payload, c->overflow_capacity * sizeof(overflow_entry));
+  pthread_mutex_init(&c->overflow_lock, NULL);
+
+  s->mode = DENSE_MODE;
+  s->num_stored = entry->num_stored;
+  s->num_distinct = entry->num_distinct;
+  return true;
+}
+
+// Utility function to find the payload bytes a shard's directory entry should
+// describe, 0 if its overflow table can't be valid, the shard is too wide for
+// its layout's 32-bit offsets or a run list holds more than its counts can
+static size_t section_bytes(const shard *s, const snapshot_entry *entry) {
+  if (entry->mode == RUNS_MODE &&
+      (s->range > INT_MAX || entry->num_stored > RUNS_MAX_STORED)) {
+    return 0;
+  }
+
+  if (entry->mode != DENSE_MODE) {
+    return entry->num_distinct * (sizeof(value_t) + sizeof(long));
+  }
+
+  // The overflow table is a power of two, at most half full
+  int capacity = entry->overflow_capacity;
+  int width = entry->counter_width;
+  if (capacity < OVERFLOW_INITIAL_CAPACITY || (capacity & (capacity - 1)) ||
+      entry->overflow_size < 0 || 2 * entry->overflow_size > capacity ||
+      (width != 1 && width != 2 && width != 4) || s->range > INT_MAX) {
+    return 0;
+  }
+
+  occupancy_bitmap layout;
+  size_t bytes = (s->range * width + 7) / 8 * 8;
+
+  bitmap_layout(&layout, (int)s->range);
+  for (int level = 0; level < layout.num_levels; ++level) {
+    bytes += layout.num_words[level] * sizeof(uint64_t);
+  }
+
+  bytes += (block_index_blocks((int)s->range) + 1) * sizeof(long);
+
+  return bytes + capacity * sizeof(overflow_entry);
+}
+
+// Utility function to fold bytes into a running checksum a word at a time,
+// treating a partial last word as padded with zeros
+static uint64_t checksum_update(uint64_t checksum, const void *data,
+                                size_t bytes) {
+  const uint8_t *in = (const uint8_t *)data;
+  uint64_t word;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+    memcpy(&word, in + i, sizeof(uint64_t));
+    checksum = (checksum ^ word) * 0x100000001b3ULL;
+    checksum ^= checksum >> 32;
+  }
+
+  if (i < bytes) {
+    word = 0;
+    memcpy(&word, in + i, bytes - i);
+    checksum = (checksum ^ word) * 0x100000001b3ULL;
+    checksum ^= checksum >> 32;
+  }
+
+  return checksum;
+}
+
+// Utility function to find the bytes taken by a header and its directory
+static size_t header_bytes(int count) {
+  return sizeof(snapshot_header) + count * sizeof(snapshot_entry);
+}
+
+/////////////////////////
+// OPERATIVE FUNCTIONS //
+/////////////////////////
+
+// Function to return number of times the value occurs in stored numbers
+long multiset_find(multiset *set, value_t value) {
+  if (!in_set(set, value)) {
+    return 0;
+  }
+
+  shard *s = &set->shards[shard_index(set, value)];
+
+  pthread_rwlock_rdlock(&s->lock);
+  long count = shard_find(s, value);
+  pthread_rwlock_unlock(&s->lock);
+
+  return count;
+}
+
+// Function to add the value to stored numbers, returning -1 without adding it
+// if it is outside [r1, r2] or memory ran out
+int multiset_add(multiset *set, value_t value) {
+  if (!in_set(set, value)) {
+    set_error("Error: %" PRId64 " is outside [r1, r2].", value);
+    return -1;
+  }
+
+  shard *s = &set->shards[shard_index(set, value)];
+
+  // Dense counters are atomic, so the lock only has to keep migrations out
+  if (atomic_load_explicit(&s->mode, memory_order_relaxed) == DENSE_MODE) {
+    pthread_rwlock_rdlock(&s->lock);
+
+    if (s->mode == DENSE_MODE) {
+      if (dense_add(s, value) < 0) {
+        pthread_rwlock_unlock(&s->lock);
+        return -1;
+      }
+
+      bool check = count_update(s);
+      pthread_rwlock_unlock(&s->lock);
+
+      if (check) {
+        pthread_rwlock_wrlock(&s->lock);
+        check_storage_mode(s);
+        pthread_rwlock_unlock(&s->lock);
+      }
+      return 1;
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  pthread_rwlock_wrlock(&s->lock);
+  bool added = shard_add(s, value);
+  pthread_rwlock_unlock(&s->lock);
+
+  return added ? 1 : -1;
+}
+
+// Function to delete a single value from stored numbers
+int multiset_delete(multiset *set, value_t value) {
+  if (!in_set(set, value)) {
+    return 0;
+  }
+
+  shard *s = &set->shards[shard_index(set, value)];
+
+  if (atomic_load_explicit(&s->mode, memory_order_relaxed) == DENSE_MODE) {
+    pthread_rwlock_rdlock(&s->lock);
+
+    if (s->mode == DENSE_MODE) {
+      int removed = dense_delete(s, value) >= 0;
+      bool check = count_update(s);
+      pthread_rwlock_unlock(&s->lock);
+
+      if (check) {
+        pthread_rwlock_wrlock(&s->lock);
+        check_storage_mode(s);
+        pthread_rwlock_unlock(&s->lock);
+      }
+      return removed;
+    }
+
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  pthread_rwlock_wrlock(&s->lock);
+  int removed = shard_delete(s, value);
+  pthread_rwlock_unlock(&s->lock);
+
+  return removed;
+}
+
+// Function to return the number before the value appears in stored numbers,
+// moving on to the largest number of earlier shards if its own has none
+value_t multiset_pred(multiset *set, value_t value) {
+  int index = shard_index(set, value);
+  shard *s = &set->shards[index];
+
+  pthread_rwlock_rdlock(&s->lock);
+  value_t result = shard_pred(s, value);
+  pthread_rwlock_unlock(&s->lock);
+
+  while (result == -1 && --index >= 0) {
+    s = &set->shards[index];
+
+    pthread_rwlock_rdlock(&s->lock);
+    result = shard_last(s);
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  return result;
+}
+
+// Function to return the number after the value appears in stored numbers,
+// moving on to the smallest number of later shards if its own has none
+value_t multiset_succ(multiset *set, value_t value) {
+  int index = shard_index(set, value);
+  shard *s = &set->shards[index];
+
+  pthread_rwlock_rdlock(&s->lock);
+  value_t result = shard_succ(s, value);
+  pthread_rwlock_unlock(&s->lock);
+
+  while (result == -1 && ++index < set->num_shards) {
+    s = &set->shards[index];
+
+    pthread_rwlock_rdlock(&s->lock);
+    result = shard_first(s);
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  return result;
+}
+
+// Function to find minimum number in the array
+value_t multiset_min(multiset *set) {
+  value_t result = -1;
+
+  for (int i = 0; i < set->num_shards && result == -1; ++i) {
+    pthread_rwlock_rdlock(&set->shards[i].lock);
+    result = shard_first(&set->shards[i]);
+    pthread_rwlock_unlock(&set->shards[i].lock);
+  }
+
+  return result;
+}
+
+// Function to find maximum number in the array
+value_t multiset_max(multiset *set) {
+  value_t result = -1;
+
+  for (int i = set->num_shards - 1; i >= 0 && result == -1; --i) {
+    pthread_rwlock_rdlock(&set->shards[i].lock);
+    result = shard_last(&set->shards[i]);
+    pthread_rwlock_unlock(&set->shards[i].lock);
+  }
+
+  return result;
+}
+
+// Function to count the stored numbers in [first, last], duplicates included.
+// Each shard the range touches is locked in turn and answers from its block
+// index or tree counts in O(log n) plus a scan within one block, so numbers in
+// shards wholly inside the range are never visited
+long multiset_count_range(multiset *set, value_t first, value_t last) {
+  value_t r2 = set->r1 + set->range - 1;
+
+  first = first > set->r1 ? first : set->r1;
+  last = last < r2 ? last : r2;
+
+  if (first > last) {
+    return 0;
+  }
+
+  long count = 0;
+
+  for (int i = shard_index(set, first); i <= shard_index(set, last); ++i) {
+    shard *s = &set->shards[i];
+
+    pthread_rwlock_rdlock(&s->lock);
+    count += shard_rank(s, last + 1) - shard_rank(s, first);
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  return count;
+}
+
+// Function to pass each distinct number in [first, last] and its count to
+// callback in increasing order, returning the number of distinct values
+// visited. A shard's lock is held while its values are visited, so callback
+// must not add or delete numbers
+long multiset_iterate_range(multiset *set, value_t first, value_t last,
+                            range_callback callback, void *context) {
+  value_t r2 = set->r1 + set->range - 1;
+
+  first = first > set->r1 ? first : set->r1;
+  last = last < r2 ? last : r2;
+
+  if (first > last) {
+    return 0;
+  }
+
+  long visited = 0;
+
+  for (int i = shard_index(set, first); i <= shard_index(set, last); ++i) {
+    shard *s = &set->shards[i];
+
+    pthread_rwlock_rdlock(&s->lock);
+    visited += shard_iterate(s, first, last, callback, context);
+    pthread_rwlock_unlock(&s->lock);
+  }
+
+  return visited;
+}
+
+// Function to count the stored numbers below value, which is the position of
+// its first copy in sorted order. Earlier shards only contribute their totals
+long multiset_rank(multiset *set, value_t value) {
+  int index = shard_index(set, value);
+  long count = 0;
+
+  for (int i = 0; i < index; ++i) {
+    count += atomic_load_explicit(&set->shards[i].num_stored,
+                                  memory_order_relaxed);
+  }
+
+  shard *s = &set->shards[index];
+
+  pthread_rwlock_rdlock(&s->lock);
+  count += shard_rank(s, value);
+  pthread_rwlock_unlock(&s->lock);
+
+  return count;
+}
+
+// Function to find the k-th smallest stored number counting from 0, with
+// duplicates taking a position each. Returns -1 when fewer than k + 1 numbers
+// are stored. Shards before the one holding it are skipped on their totals
+// without taking their locks, and that shard's total is read again under its
+// lock in case it changed in between
+value_t multiset_select(multiset *set, long k) {
+  if (k < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < set->num_shards; ++i) {
+    shard *s = &set->shards[i];
+    long stored = atomic_load_explicit(&s->num_stored, memory_order_relaxed);
+
+    if (k >= stored) {
+      k -= stored;
+      continue;
+    }
+
+    pthread_rwlock_rdlock(&s->lock);
+    stored = s->num_stored;
+    value_t result = k < stored ? shard_select(s, k) : -1;
+    pthread_rwlock_unlock(&s->lock);
+
+    if (k < stored) {
+      return result;
+    }
+    k -= stored;
+  }
+
+  return -1;
+}
+
+/////////////////////
+// BATCH FUNCTIONS //
+/////////////////////
+
+// Function to apply a batch of finds, adds and deletes, writing each result
+// back into its operation. Operations are sorted by value so each shard is
+// locked once and swept in a single forward pass, while operations on the
+// same value keep their original order. Returns false if an add failed,
+// leaving it with a result of -1, because its value was outside [r1, r2] or
+// memory ran out
+bool multiset_apply_batch(multiset *set, batch_op *ops, int num_ops) {
+  batch_key *keys = (batch_key *)account_alloc(
+      &set->memory, MEMORY_SCRATCH, (num_ops + 1) * sizeof(batch_key), false);
+
+  if (!keys) {
+    set_error("Failed to allocate memory for operation batch.");
+
+    for (int i = 0; i < num_ops; ++i) {
+      ops[i].result = -1;
+    }
+    return false;
+  }
+
+  // Values outside [r1, r2] are answered here and left out of the sweep
+  int num_keys = 0;
+
+  for (int i = 0; i < num_ops; ++i) {
+    if (in_set(set, ops[i].value)) {
+      keys[num_keys].value = ops[i].value;
+      keys[num_keys++].index = i;
+    } else if (ops[i].type == 1) {
+      set_error("Error: %" PRId64 " is outside [r1, r2].", ops[i].value);
+      ops[i].result = -1;
+    } else {
+      ops[i].result = 0;
+    }
+  }
+
+  qsort(keys, num_keys, sizeof(batch_key), compare_batch_keys);
+
+  for (int start = 0; start < num_keys;) {
+    int index = shard_index(set, keys[start].value);
+    int end = start + 1;
+
+    while (end < num_keys && shard_index(set, keys[end].value) == index) {
+      ++end;
+    }
+
+    apply_shard_batch(&set->shards[index], ops, keys + start, end - start);
+    start = end;
+  }
+
+  account_free(&set->memory, MEMORY_SCRATCH, keys);
+
+  // Only adds can fail
+  for (int i = 0; i < num_ops; ++i) {
+    if (ops[i].type == 1 && ops[i].result < 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Apply one shard's part of a batch under a single lock, shared if it only
+// holds finds. A layout check falling due is left until the sweep is done
+static void apply_shard_batch(shard *s, batch_op *ops, const batch_key *keys,
+                              int num) {
+  bool updates = false;
+
+  for (int i = 0; i < num && !updates; ++i) {
+    updates = ops[keys[i].index].type != 0;
+  }
+
+  if (updates) {
+    pthread_rwlock_wrlock(&s->lock);
+  } else {
+    pthread_rwlock_rdlock(&s->lock);
+  }
+
+  // Every op might be an add, so make sure a run list can take them all. If
+  // it can't be moved, adds past the cap fail instead
+  if (updates && s->mode == RUNS_MODE &&
+      s->num_stored + num > RUNS_MAX_STORED) {
+    migrate(s, DENSE_MODE);
+  }
+
+  bool check;
+  if (s->mode == DENSE_MODE) {
+    check = dense_batch(s, ops, keys, num);
+  } else if (s->mode == RUNS_MODE) {
+    check = runs_batch(s, ops, keys, num);
+  } else {
+    check = tree_batch(s, ops, keys, num);
+  }
+
+  if (check) {
+    check_storage_mode(s);
+  }
+
+  pthread_rwlock_unlock(&s->lock);
+}
+
+// Sweep the dense counters in increasing index order
+static bool dense_batch(shard *s, batch_op *ops, const batch_key *keys,
+                        int num) {
+  bool check = false;
+
+  for (int i = 0; i < num; ++i) {
+    batch_op *op = &ops[keys[i].index];
+
+    if (op->type == 0) {
+      op->result = counter_get(&s->counts, (int)(op->value - s->r1));
+      continue;
+    }
+
+    if (op->type == 1) {
+      if (dense_add(s, op->value) < 0) {
+        op->result = -1;
+        continue;
+      }
+      op->result = 1;
+    } else {
+      op->result = dense_delete(s, op->value) >= 0;
+    }
+
+    check |= count_update(s);
+  }
+
+  return check;
+}
+
+// Merge the batch into the run list, each search galloping forward from where
+// the previous operation left off rather than starting from scratch
+static bool runs_batch(shard *s, batch_op *ops, const batch_key *keys,
+                       int num) {
+  run_list *r = &s->runs;
+  bool check = false;
+  int pos = 0, updates = 0;
+
+  for (int i = 0; i < num; ++i) {
+    batch_op *op = &ops[keys[i].index];
+    int offset = shard_offset(s, op->value);
+    pos = runs_seek(r, offset, pos);
+
+    if (op->type == 0) {
+      op->result =
+          pos < r->size && r->values[pos] == offset ? r->counts[pos] : 0;
+    } else if (op->type == 1) {
+      long count = s->num_stored < RUNS_MAX_STORED
+                       ? runs_insert_at(r, offset, pos)
+                       : -1;
+
+      if (count < 0) {
+        op->result = -1;
+        continue;
+      }
+
+      record_add(s, op->value, count);
+      op->result = 1;
+    } else {
+      long remaining = runs_remove_at(r, offset, pos);
+      record_delete(s, op->value, remaining);
+      op->result = remaining >= 0;
+    }
+
+    if (op->type != 0) {
+      check |= count_update(s);
+      ++updates;
+    }
+
+    // An insert may have shifted the slots before pos down by one
+    pos = pos > 0 ? pos - 1 : 0;
+  }
+
+  // Compaction moves slots, so its steps wait until the sweep is done
+  for (int i = 0; i < updates; ++i) {
+    runs_compact(s);
+  }
+
+  return check;
+}
+
+// Walk the leaves in order, only descending from the root once the batch moves
+// past the current leaf's last key. Any value between one routed to the leaf
+// and a key held in it belongs to the same leaf, so the path down stays valid
+// for updating the subtree counts too
+static bool tree_batch(shard *s, batch_op *ops, const batch_key *keys,
+                       int num) {
+  bptree *t = &s->tree;
+  bpt_internal *path[MAX_TREE_HEIGHT];
+  int slots[MAX_TREE_HEIGHT];
+  bpt_leaf *leaf = NULL;
+  bool check = false;
+
+  for (int i = 0; i < num; ++i) {
+    batch_op *op = &ops[keys[i].index];
+
+    if (!leaf || op->value > leaf->last_key) {
+      leaf = tree_descend(t, op->value, path, slots);
+    }
+
+    if (op->type == 0) {
+      op->result = leaf_find(leaf, op->value);
+      continue;
+    }
+
+    if (op->type == 1) {
+      long count = leaf != &empty_leaf ? leaf_insert(leaf, op->value) : 0;
+
+      // A full block, or an empty tree, is left to the full insert instead
+      if (count == 0) {
+        count = tree_insert(t, op->value);
+        leaf = NULL;
+      } else {
+        tree_path_add(t, path, slots, 1);
+      }
+
+      if (count < 0) {
+        op->result = -1;
+        continue;
+      }
+
+      record_add(s, op->value, count);
+      op->result = 1;
+    } else {
+      long remaining = leaf_remove(leaf, op->value);
+
+      if (remaining >= 0) {
+        tree_path_add(t, path, slots, -1);
+      }
+
+      if (remaining >= 0 && t->height > 0 && leaf->num_bytes < LEAF_MIN_BYTES) {
+        rebalance_leaf(t, path, slots);
+        leaf = NULL;
+      }
+
+      record_delete(s, op->value, remaining);
+      op->result = remaining >= 0;
+    }
+
+    check |= count_update(s);
+  }
+
+  return check;
+}
+
+// Utility function to order batched operations by value, then by position in
+// the batch
+static int compare_batch_keys(const void *a, const void *b) {
+  const batch_key *key1 = (const batch_key *)a;
+  const batch_key *key2 = (const batch_key *)b;
+
+  if (key1->value != key2->value) {
+    return (key1->value > key2->value) - (key1->value < key2->value);
+  }
+
+  return (key1->index > key2->index) - (key1->index < key2->index);
+}
+
+/////////////////////
+// SHARD FUNCTIONS //
+/////////////////////
+
+static bool shard_init(shard *s, value_t first, value_t size) {
+  memset(s, 0, sizeof(shard));
+
+  if (pthread_rwlock_init(&s->lock, NULL)) {
+    set_error("Failed to initialise shard lock.");
+    return false;
+  }
+
+  s->r1 = first;
+  s->range = size;
+  s->cached_min = s->cached_max = -1;
+  return true;
+}
+
+// Utility function to check value lies in [r1, r2]
+static bool in_set(const multiset *set, value_t value) {
+  return value >= set->r1 && value - set->r1 < set->range;
+}
+
+// Utility function to find the shard covering value, values outside [r1, r2]
+// fall into the first or last shard
+static int shard_index(const multiset *set, value_t value) {
+  if (value < set->r1) {
+    return 0;
+  }
+
+  value_t index = (value - set->r1) / set->shard_width;
+  return index < set->num_shards ? (int)index : set->num_shards - 1;
+}
+
+// Utility function to find value's offset from the start of the shard, as
+// held by run lists. Values outside the shard are clamped to just before or
+// just after it
+static int shard_offset(shard *s, value_t value) {
+  if (value < s->r1) {
+    return -1;
+  }
+
+  return value - s->r1 < s->range ? (int)(value - s->r1) : (int)s->range;
+}
+
+static long shard_find(shard *s, value_t value) {
+  if (s->mode == DENSE_MODE) {
+    return counter_get(&s->counts, (int)(value - s->r1));
+  } else if (s->mode == RUNS_MODE) {
+    return runs_find(&s->runs, shard_offset(s, value));
+  }
+
+  return tree_find(&s->tree, value);
+}
+
+// Add value to a shard held exclusively, moving a full run list to dense
+// counters first. Returns false, leaving the shard as it was, if memory ran
+// out
+static bool shard_add(shard *s, value_t value) {
+  if (s->mode == RUNS_MODE && s->num_stored >= RUNS_MAX_STORED &&
+      !migrate(s, DENSE_MODE)) {
+    return false;
+  }
+
+  if (s->mode == DENSE_MODE) {
+    if (dense_add(s, value) < 0) {
+      return false;
+    }
+  } else {
+    long count = s->mode == RUNS_MODE
+                     ? runs_insert(&s->runs, shard_offset(s, value))
+                     : tree_insert(&s->tree, value);
+
+    if (count < 0) {
+      return false;
+    }
+
+    record_add(s, value, count);
+
+    if (s->mode == RUNS_MODE) {
+      runs_compact(s);
+    }
+  }
+
+  if (count_update(s)) {
+    check_storage_mode(s);
+  }
+
+  return true;
+}
+
+// Remove a single occurrence of value from a shard held exclusively, returns 1
+// if one was removed
+static int shard_delete(shard *s, value_t value) {
+  long remaining;
+
+  if (s->mode == DENSE_MODE) {
+    remaining = dense_delete(s, value);
+  } else {
+    if (s->mode == RUNS_MODE) {
+      remaining = runs_remove(&s->runs, shard_offset(s, value));
+      runs_compact(s);
+    } else {
+      remaining = tree_remove(&s->tree, value);
+    }
+    record_delete(s, value, remaining);
+  }
+
+  if (count_update(s)) {
+    check_storage_mode(s);
+  }
+
+  return remaining >= 0;
+}
+
+// Update the totals and cached extremes of a sparse shard after value was
+// added, leaving it with count copies
+static void record_add(shard *s, value_t value, long count) {
+  ++s->num_stored;
+  if (count == 1) {
+    ++s->num_distinct;
+  }
+
+  if (s->cached_min == -1 || value < s->cached_min) {
+    s->cached_min = value;
+  }
+
+  if (value > s->cached_max) {
+    s->cached_max = value;
+  }
+}
+
+// Update the totals and cached extremes of a sparse shard after a delete of
+// value left remaining copies, or found none when remaining is -1
+static void record_delete(shard *s, value_t value, long remaining) {
+  if (remaining >= 0) {
+    --s->num_stored;
+  }
+
+  if (remaining == 0) {
+    --s->num_distinct;
+
+    if (value == s->cached_min || value == s->cached_max) {
+      shard_update_extremes(s, value);
+    }
+  }
+}
+
+// Add value to a dense shard, safe alongside other dense adds and deletes
+// holding the lock shared. Returns the new count, or -1 if memory ran out
+static long dense_add(shard *s, value_t value) {
+  int index = (int)(value - s->r1);
+  long count = counter_increment(&s->counts, index);
+
+  if (count < 0) {
+    return -1;
+  }
+
+  if (count == 1) {
+    bitmap_set(&s->bitmap, index);
+    atomic_fetch_add_explicit(&s->num_distinct, 1, memory_order_relaxed);
+  }
+
+  block_index_add(&s->blocks, index, 1);
+  atomic_fetch_add_explicit(&s->num_stored, 1, memory_order_relaxed);
+  return count;
+}
+
+// Remove one occurrence of value from a dense shard, returns the remaining
+// count or -1 if value isn't stored. A concurrent add may revive the bucket
+// between the counter reaching zero and its bit being cleared, so the bit is
+// restored if that happened. Bits can briefly outlive their counts, which
+// pred and succ skip over
+static long dense_delete(shard *s, value_t value) {
+  int index = (int)(value - s->r1);
+  long remaining = counter_decrement(&s->counts, index);
+
+  if (remaining < 0) {
+    return -1;
+  }
+
+  if (remaining == 0) {
+    bitmap_clear(&s->bitmap, index);
+
+    if (counter_get(&s->counts, index) > 0) {
+      bitmap_set(&s->bitmap, index);
+    }
+    atomic_fetch_sub_explicit(&s->num_distinct, 1, memory_order_relaxed);
+  }
+
+  block_index_add(&s->blocks, index, -1);
+  atomic_fetch_sub_explicit(&s->num_stored, 1, memory_order_relaxed);
+  return remaining;
+}
+
+static value_t shard_pred(shard *s, value_t value) {
+  if (s->mode == DENSE_MODE) {
+    // Search from the index before value for predecessor
+    int index = shard_offset(s, value) - 1;
+    if (index < 0) {
+      return -1;
+    }
+
+    index = bitmap_prev(&s->bitmap, index);
+    while (index >= 0 && counter_get(&s->counts, index) == 0) {
+      index = index > 0 ? bitmap_prev(&s->bitmap, index - 1) : -1;
+    }
+
+    return index >= 0 ? index + s->r1 : -1;
+  } else if (s->mode == RUNS_MODE) {
+    int offset = runs_pred(&s->runs, shard_offset(s, value));
+    return offset >= 0 ? offset + s->r1 : -1;
+  }
+
+  return tree_pred(&s->tree, value);
+}
+
+static value_t shard_succ(shard *s, value_t value) {
+  if (s->mode == DENSE_MODE) {
+    // Search from the index after value for successor
+    int index = shard_offset(s, value) + 1;
+    if (index >= s->range) {
+      return -1;
+    }
+
+    index = bitmap_next(&s->bitmap, index);
+    while (index >= 0 && counter_get(&s->counts, index) == 0) {
+      index = index + 1 < s->range ? bitmap_next(&s->bitmap, index + 1) : -1;
+    }
+
+    return index >= 0 ? index + s->r1 : -1;
+  } else if (s->mode == RUNS_MODE) {
+    int offset = runs_succ(&s->runs, shard_offset(s, value));
+    return offset >= 0 ? offset + s->r1 : -1;
+  }
+
+  return tree_succ(&s->tree, value);
+}
+
+// Utility function to find the shard's smallest number, -1 if it is empty.
+// Dense shards search their bitmap rather than keep a cached copy
+static value_t shard_first(shard *s) {
+  return s->mode == DENSE_MODE ? shard_succ(s, s->r1 - 1) : s->cached_min;
+}
+
+// Utility function to find the shard's largest number, -1 if it is empty
+static value_t shard_last(shard *s) {
+  return s->mode == DENSE_MODE ? shard_pred(s, s->r1 + s->range)
+                               : s->cached_max;
+}
+
+// Count the shard's numbers below value. Dense shards add the block index's
+// prefix to a scan of at most one block, trees add up subtree counts on the
+// way down, and run lists sum their slots
+static long shard_rank(shard *s, value_t value) {
+  if (value <= s->r1) {
+    return 0;
+  }
+
+  if (value - s->r1 >= s->range) {
+    return s->num_stored;
+  }
+
+  int offset = shard_offset(s, value);
+
+  if (s->mode == DENSE_MODE) {
+    int block = offset / RANK_BLOCK;
+    return block_index_prefix(&s->blocks, block) +
+           dense_sum(s, block * RANK_BLOCK, offset);
+  } else if (s->mode == RUNS_MODE) {
+    return runs_rank(&s->runs, offset);
+  }
+
+  return tree_rank(&s->tree, value);
+}
+
+// Find the shard's k-th number counting from 0, or -1 if it holds no more
+// than k. Dense updates share the lock, so a block that emptied since its
+// index was read also gives -1
+static value_t shard_select(shard *s, long k) {
+  if (s->mode == DENSE_MODE) {
+    int block = block_index_find(&s->blocks, &k);
+    int end = (block + 1) * RANK_BLOCK < s->range ? (block + 1) * RANK_BLOCK
+                                                  : (int)s->range;
+
+    for (int index = block >= 0 ? bitmap_next(&s->bitmap, block * RANK_BLOCK)
+                                : -1;
+         index >= 0 && index < end;
+         index = index + 1 < end ? bitmap_next(&s->bitmap, index + 1) : -1) {
+      long count = counter_get(&s->counts, index);
+
+      if (k < count) {
+        return index + s->r1;
+      }
+      k -= count;
+    }
+
+    return -1;
+  } else if (s->mode == RUNS_MODE) {
+    int pos = runs_select(&s->runs, k);
+    return pos >= 0 ? s->runs.values[pos] + s->r1 : -1;
+  }
+
+  return tree_select(&s->tree, k);
+}
+
+// Pass each distinct number of the shard in [first, last] to callback in
+// order, returning how many were passed
+static long shard_iterate(shard *s, value_t first, value_t last,
+                          range_callback callback, void *context) {
+  value_t end = s->r1 + s->range - 1;
+  long visited = 0;
+
+  first = first > s->r1 ? first : s->r1;
+  last = last < end ? last : end;
+
+  if (first > last) {
+    return 0;
+  }
+
+  int from = shard_offset(s, first), to = shard_offset(s, last);
+
+  if (s->mode == DENSE_MODE) {
+    for (int index = bitmap_next(&s->bitmap, from); index >= 0 && index <= to;
+         index = index < to ? bitmap_next(&s->bitmap, index + 1) : -1) {
+      long count = counter_get(&s->counts, index);
+
+      if (count > 0) {
+        callback(index + s->r1, count, context);
+        ++visited;
+      }
+    }
+  } else if (s->mode == RUNS_MODE) {
+    run_list *r = &s->runs;
+
+    for (int pos = lower_bound(r->values, r->size, from);
+         pos < r->size && r->values[pos] <= to; ++pos) {
+      if (r->counts[pos] > 0) {
+        callback(r->values[pos] + s->r1, r->counts[pos], context);
+        ++visited;
+      }
+    }
+  } else {
+    visited = tree_iterate(&s->tree, first, last, callback, context);
+  }
+
+  return visited;
+}
+
+// Utility function to sum the counts of a dense shard's buckets in
+// [from, to), taking only the buckets whose occupancy bits are set
+static long dense_sum(shard *s, int from, int to) {
+  long sum = 0;
+
+  for (int index = from; index < to; index = (index | 63) + 1) {
+    uint64_t bits = atomic_load_explicit(&s->bitmap.levels[0][index >> 6],
+                                         memory_order_relaxed) &
+                    (~0ULL << (index & 63));
+
+    if ((index | 63) >= to) {
+      bits &= ~0ULL >> (63 - ((to - 1) & 63));
+    }
+
+    while (bits) {
+      sum += counter_get(&s->counts, (index & ~63) + __builtin_ctzll(bits));
+      bits &= bits - 1;
+    }
+  }
+
+  return sum;
+}
+
+// Utility function to build a dense shard's block index from its counters,
+// returning false if there is no memory for it
+static bool dense_build_index(shard *s) {
+  block_index *x = &s->blocks;
+
+  if (!block_index_init(x, (int)s->range)) {
+    return false;
+  }
+
+  for (int block = 0; block < x->num_blocks; ++block) {
+    int end = (block + 1) * RANK_BLOCK < s->range ? (block + 1) * RANK_BLOCK
+                                                  : (int)s->range;
+    x->sums[block + 1] = dense_sum(s, block * RANK_BLOCK, end);
+  }
+
+  block_index_build(x);
+  return true;
+}
+
+// Utility function to derive the cached extremes from the shard's numbers
+static void shard_init_extremes(shard *s) {
+  value_t last = s->r1 + s->range - 1;
+
+  s->cached_min = shard_find(s, s->r1) > 0 ? s->r1 : shard_succ(s, s->r1);
+  s->cached_max = shard_find(s, last) > 0 ? last : shard_pred(s, last);
+}
+
+// Utility function to move a cached extreme inwards once the last copy of
+// it has been deleted
+static void shard_update_extremes(shard *s, value_t value) {
+  if (value == s->cached_min) {
+    s->cached_min = shard_succ(s, value);
+  }
+
+  if (value == s->cached_max) {
+    s->cached_max = shard_pred(s, value);
+  }
+}
+
+// Load sorted (value, count) pairs into the layout given by target. Any other
+// layout the shard holds is left alone, so if memory runs out the partly built
+// one is freed and the shard carries on as it was
+static bool shard_build(shard *s, storage_mode target,
+                        const pair_array *pairs) {
+  bool built;
+
+  if (target == DENSE_MODE) {
+    long past8 = 0, past16 = 0;
+
+    for (long i = 0; i < pairs->num; ++i) {
+      past8 += pair_count(pairs, i) >= UINT8_MAX;
+      past16 += pair_count(pairs, i) >= UINT16_MAX;
+    }
+
+    built = counter_init(&s->counts, (int)s->range,
+                         counter_width((int)s->range, past8, past16)) &&
+            bitmap_init(&s->bitmap, (int)s->range);
+
+    for (long i = 0; built && i < pairs->num; ++i) {
+      int index = (int)(pair_value(pairs, i) - s->r1);
+
+      built = counter_set(&s->counts, index, pair_count(pairs, i));
+      bitmap_set(&s->bitmap, index);
+    }
+
+    built = built && dense_build_index(s);
+  } else if (target == RUNS_MODE) {
+    built = runs_build(&s->runs, s->r1, pairs);
+  } else {
+    built = tree_build(&s->tree, pairs);
+  }
+
+  if (!built) {
+    free_layout(s, target);
+    return false;
+  }
+
+  long stored = 0;
+  for (long i = 0; i < pairs->num; ++i) {
+    stored += pair_count(pairs, i);
+  }
+
+  s->mode = target;
+  s->num_stored = stored;
+  s->num_distinct = pairs->num;
+  return true;
+}
+
+// Utility functions to read the i-th pair a layout is built from
+static value_t pair_value(const pair_array *pairs, long i) {
+  return pairs->values ? pairs->values[i] : pairs->base + pairs->offsets[i];
+}
+
+static long pair_count(const pair_array *pairs, long i) {
+  return pairs->values ? pairs->counts[i] : (long)pairs->offset_counts[i];
+}
+
+// Utility function to find the bytes the shard's layout reserves, whether
+// they lie in the heap or in a snapshot mapping
+static size_t shard_bytes(shard *s) {
+  if (s->mode == DENSE_MODE) {
+    size_t bytes = s->range * s->counts.width +
+                   (s->blocks.num_blocks + 1) * sizeof(long) +
+                   s->counts.overflow_capacity * sizeof(overflow_entry);
+
+    for (int level = 0; level < s->bitmap.num_levels; ++level) {
+      bytes += s->bitmap.num_words[level] * sizeof(uint64_t);
+    }
+    return bytes;
+  } else if (s->mode == RUNS_MODE) {
+    return s->runs.capacity * 2 * sizeof(int) +
+           (s->runs.blocks.num_blocks + 1) * sizeof(long);
+  }
+
+  return s->tree.num_leaves * sizeof(bpt_leaf) +
+         s->tree.num_internals * sizeof(bpt_internal);
+}
+
+// Utility function to find the part of shard_bytes holding no numbers: empty
+// overflow slots, run list gaps and spare capacity, and the unused bytes of
+// leaves and slots of internal nodes. Every node but the root is one child
+// of another, so the internal slots in use follow from the node counts
+static size_t shard_slack(shard *s) {
+  if (s->mode == DENSE_MODE) {
+    return (s->counts.overflow_capacity - s->counts.overflow_size) *
+           sizeof(overflow_entry);
+  } else if (s->mode == RUNS_MODE) {
+    return (s->runs.capacity - s->runs.size + s->runs.gaps) * 2 * sizeof(int);
+  }
+
+  bptree *t = &s->tree;
+  size_t slack = 0;
+
+  for (bpt_leaf *leaf = t->head; leaf; leaf = leaf->next) {
+    slack += LEAF_BYTES - leaf->num_bytes;
+  }
+
+  if (t->num_internals > 0) {
+    size_t children = t->num_leaves + t->num_internals - 1;
+    size_t keys = children - t->num_internals;
+
+    slack += (t->num_internals * INTERNAL_CAPACITY - keys) *
+             (sizeof(value_t) + sizeof(void *) + sizeof(long));
+  }
+
+  return slack;
+}
+
+// Function to tally an add or delete, returns true once the layout is due to
+// be revisited with the shard held exclusively
+static bool count_update(shard *s) {
+  atomic_fetch_add_explicit(&s->ops_applied, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->ops_since_migration, 1, memory_order_relaxed);
+
+  long since_check =
+      atomic_fetch_add_explicit(&s->ops_since_check, 1, memory_order_relaxed);
+  return since_check + 1 >= MIGRATION_CHECK_INTERVAL;
+}
+
+// Migrate once the break-even point is crossed, as long as the updates since
+// the last migration have paid for rebuilding every distinct value. Several
+// dense updates can find a check due, only the first gets to run it
+static void check_storage_mode(shard *s) {
+  if (s->ops_since_check < MIGRATION_CHECK_INTERVAL) {
+    return;
+  }
+
+  storage_mode target = choose_storage_mode(s);
+
+  // A migration that runs out of memory keeps the current layout, which is
+  // checked again after the next interval
+  if (target != s->mode && s->ops_since_migration >= s->num_distinct) {
+    migrate(s, target);
+  }
+
+  // Widening the counters also needs the shard to itself. If memory runs out
+  // they stay as they are until the next check
+  if (s->mode == DENSE_MODE) {
+    counter_fit(&s->counts);
+  }
+
+  s->ops_since_check = 0;
+  s->runs.work = 0;
+}
+
+// Dense storage pays off once there are more numbers than buckets, and is kept
+// until it is well below that so sets near the threshold don't flip back and
+// forth. Run lists hold until inserts and searches spend too long shifting or
+// skipping slots, and a tree with only a handful of values returns to a list.
+// Counters and run lists index by 32-bit offset, so shards wider than that
+// always stay trees
+static storage_mode choose_storage_mode(shard *s) {
+  if (s->range > INT_MAX) {
+    return TREE_MODE;
+  }
+
+  if (s->num_stored > s->range) {
+    return DENSE_MODE;
+  }
+
+  if (s->mode == DENSE_MODE) {
+    if (s->num_stored * DENSE_EXIT_RATIO >= s->range) {
+      return DENSE_MODE;
+    }
+    return s->range <= MAX_RUNS_RANGE ? RUNS_MODE : TREE_MODE;
+  }
+
+  if (s->mode == RUNS_MODE) {
+    return s->runs.work > RUNS_MAX_WORK * s->ops_since_check ? TREE_MODE
+                                                              : RUNS_MODE;
+  }
+
+  return s->num_distinct <= RUNS_MAX_WORK ? RUNS_MODE : TREE_MODE;
+}
+
+// Function to move the shard's numbers into the target layout, recording how
+// long the rebuild took. The new layout is built before the old one is
+// freed, so if memory runs out the shard is left as it was and false is
+// returned
+static bool migrate(shard *s, storage_mode target) {
+  double start = now_seconds();
+  multiset *set = s->set;
+  value_t *values = (value_t *)account_alloc(
+      &set->memory, MEMORY_SCRATCH, (s->num_distinct + 1) * sizeof(value_t),
+      false);
+  long *counts = (long *)account_alloc(&set->memory, MEMORY_SCRATCH,
+                                       (s->num_distinct + 1) * sizeof(long),
+                                       false);
+  storage_mode from = s->mode;
+  long distinct = 0;
+  bool built = values && counts;
+
+  if (built) {
+    distinct = export_entries(s, values, counts);
+    pair_array pairs = {values, counts, NULL, NULL, 0, distinct};
+    built = shard_build(s, target, &pairs);
+  }
+
+  account_free(&set->memory, MEMORY_SCRATCH, values);
+  account_free(&set->memory, MEMORY_SCRATCH, counts);
+
+  if (!built) {
+    set_error("Failed to allocate memory for storage migration.");
+    return false;
+  }
+
+  free_layout(s, from);
+  shard_init_extremes(s);
+
+  pthread_mutex_lock(&set->migration_lock);
+  if (set->num_migrations < MAX_MIGRATION_RECORDS) {
+    migration_record *m = &set->migrations[set->num_migrations];
+    m->shard = s - set->shards;
+    m->from = from;
+    m->to = target;
+    m->op = s->ops_applied;
+    m->stored = s->num_stored;
+    m->distinct = distinct;
+    m->seconds = now_seconds() - start;
+  }
+  ++set->num_migrations;
+  pthread_mutex_unlock(&set->migration_lock);
+
+  s->ops_since_migration = 0;
+  return true;
+}
+
+// Utility function to write the shard's numbers out as sorted (value, count)
+// pairs, returning the number of pairs
+static long export_entries(shard *s, value_t *values, long *counts) {
+  long distinct = 0;
+
+  if (s->mode == DENSE_MODE) {
+    for (int i = bitmap_next(&s->bitmap, 0); i >= 0;
+         i = bitmap_next(&s->bitmap, i + 1)) {
+      values[distinct] = i + s->r1;
+      counts[distinct] = counter_get(&s->counts, i);
+      ++distinct;
+    }
+  } else if (s->mode == RUNS_MODE) {
+    for (int i = 0; i < s->runs.size; ++i) {
+      if (s->runs.counts[i] > 0) {
+        values[distinct] = s->runs.values[i] + s->r1;
+        counts[distinct] = s->runs.counts[i];
+        ++distinct;
+      }
+    }
+  } else {
+    for (bpt_leaf *leaf = s->tree.head; leaf; leaf = leaf->next) {
+      distinct += leaf_decode(leaf, values + distinct, counts + distinct);
+    }
+  }
+
+  return distinct;
+}
+
+// Free the layout given by mode, leaving any other the shard holds alone
+static void free_layout(shard *s, storage_mode mode) {
+  if (mode == DENSE_MODE) {
+    if (s->counts.primary) {
+      free_counters(&s->counts);
+    }
+
+    free_bitmap(&s->bitmap);
+    free_block_index(&s->blocks);
+  } else if (mode == RUNS_MODE) {
+    free_runs(&s->runs);
+  } else {
+    free_tree(&s->tree);
+  }
+}
+
+// Free whichever layout the shard holds, leaving its lock and totals intact
+static void free_shard(shard *s) {
+  for (int mode = DENSE_MODE; mode <= TREE_MODE; ++mode) {
+    free_layout(s, (storage_mode)mode);
+  }
+}
+
+///////////////////////
+// COUNTER FUNCTIONS //
+///////////////////////
+
+// Allocate zeroed counters over size buckets of width bytes, returning false
+// with nothing allocated if there is no memory for them
+static bool counter_init(counter_array *c, int size, int width) {
+  c->primary = page_alloc(c->memory, MEMORY_COUNTERS, (size_t)size * width,
+                          true);
+  c->overflow = (overflow_entry *)account_alloc(
+      c->memory, MEMORY_OVERFLOW,
+      OVERFLOW_INITIAL_CAPACITY * sizeof(overflow_entry), false);
+
+  if (!c->primary || !c->overflow) {
+    set_error("Failed to allocate memory for counts_array.");
+    page_free(c->memory, MEMORY_COUNTERS, c->primary);
+    account_free(c->memory, MEMORY_OVERFLOW, c->overflow);
+    c->primary = NULL;
+    c->overflow = NULL;
+    return false;
+  }
+
+  c->size = size;
+  c->width = width;
+  c->saturated = width < 4 ? (1u << (8 * width)) - 1 : UINT32_MAX;
+  c->mapped = false;
+  c->overflow_size = 0;
+  c->overflow_capacity = OVERFLOW_INITIAL_CAPACITY;
+  for (int i = 0; i < c->overflow_capacity; ++i) {
+    c->overflow[i].index = -1;
+  }
+
+  pthread_mutex_init(&c->overflow_lock, NULL);
+  return true;
+}
+
+// Utility function to find the narrowest bucket width leaving no more than
+// one bucket in COUNTER_WIDEN_RATIO in the overflow table, given how many
+// counts reach the largest 8-bit and 16-bit values
+static int counter_width(int size, long past8, long past16) {
+  if (past8 * COUNTER_WIDEN_RATIO <= size) {
+    return 1;
+  }
+
+  return past16 * COUNTER_WIDEN_RATIO <= size ? 2 : 4;
+}
+
+// Widen the buckets once too many have spilled into the overflow table,
+// straight to the width the spilled counts need. Only called while the
+// counters are held exclusively. Returns false, leaving them as they were, if
+// there is no memory for wider ones
+static bool counter_fit(counter_array *c) {
+  if (c->width == 4 ||
+      (long)c->overflow_size * COUNTER_WIDEN_RATIO <= c->size) {
+    return true;
+  }
+
+  // Every count past 16 bits is in the table while buckets are a byte
+  int width = 4;
+  if (c->width == 1) {
+    long past16 = 0;
+
+    for (int i = 0; i < c->overflow_capacity; ++i) {
+      past16 += c->overflow[i].index != -1 &&
+                c->overflow[i].count >= UINT16_MAX;
+    }
+    width = counter_width(c->size, c->overflow_size, past16);
+  }
+
+  return counter_widen(c, width);
+}
+
+// Copy the buckets into wider ones, moving counts that now fit out of the
+// overflow table and shrinking the table to what is left. Only the new
+// buckets need memory, so if it runs out nothing has changed
+static bool counter_widen(counter_array *c, int width) {
+  counter_array wide = {0};
+
+  wide.primary = page_alloc(c->memory, MEMORY_COUNTERS,
+                            (size_t)c->size * width, true);
+  if (!wide.primary) {
+    set_error("Failed to allocate memory for counts_array.");
+    return false;
+  }
+
+  wide.width = width;
+  wide.saturated = width < 4 ? (1u << (8 * width)) - 1 : UINT32_MAX;
+
+  for (int i = 0; i < c->size; ++i) {
+    uint32_t small = bucket_load(c, i);
+
+    if (small == c->saturated) {
+      long count = overflow_lookup(c, i)->count;
+
+      if (count < wide.saturated) {
+        overflow_remove(c, i);
+        small = (uint32_t)count;
+      } else {
+        small = wide.saturated;
+      }
+    }
+
+    if (small > 0) {
+      bucket_store(&wide, i, small);
+    }
+  }
+
+  if (!c->mapped) {
+    page_free(c->memory, MEMORY_COUNTERS, c->primary);
+  }
+
+  c->primary = wide.primary;
+  c->width = width;
+  c->saturated = wide.saturated;
+  c->mapped = false;
+
+  // Keep the table at least a quarter full, unless the smaller one can't be
+  // had
+  int capacity = c->overflow_capacity;
+  while (capacity > OVERFLOW_INITIAL_CAPACITY &&
+         4 * c->overflow_size < capacity) {
+    capacity /= 2;
+  }
+
+  if (capacity < c->overflow_capacity) {
+    overflow_resize(c, capacity);
+  }
+
+  return true;
+}
+
+// Utility functions to read, compare and swap, and write the bucket at index
+// at the counters' current width
+static uint32_t bucket_load(counter_array *c, int index) {
+  if (c->width == 1) {
+    return atomic_load_explicit((_Atomic uint8_t *)c->primary + index,
+                                memory_order_relaxed);
+  } else if (c->width == 2) {
+    return atomic_load_explicit((_Atomic uint16_t *)c->primary + index,
+                                memory_order_relaxed);
+  }
+
+  return atomic_load_explicit((_Atomic uint32_t *)c->primary + index,
+                              memory_order_relaxed);
+}
+
+static bool bucket_swap(counter_array *c, int index, uint32_t *expected,
+                        uint32_t desired) {
+  bool swapped;
+
+  if (c->width == 1) {
+    uint8_t seen = (uint8_t)*expected;
+    swapped = atomic_compare_exchange_weak_explicit(
+        (_Atomic uint8_t *)c->primary + index, &seen, (uint8_t)desired,
+        memory_order_relaxed, memory_order_relaxed);
+    *expected = seen;
+  } else if (c->width == 2) {
+    uint16_t seen = (uint16_t)*expected;
+    swapped = atomic_compare_exchange_weak_explicit(
+        (_Atomic uint16_t *)c->primary + index, &seen, (uint16_t)desired,
+        memory_order_relaxed, memory_order_relaxed);
+    *expected = seen;
+  } else {
+    swapped = atomic_compare_exchange_weak_explicit(
+        (_Atomic uint32_t *)c->primary + index, expected, desired,
+        memory_order_relaxed, memory_order_relaxed);
+  }
+
+  return swapped;
+}
+
+static void bucket_store(counter_array *c, int index, uint32_t count) {
+  if (c->width == 1) {
+    atomic_store_explicit((_Atomic uint8_t *)c->primary + index,
+                          (uint8_t)count, memory_order_relaxed);
+  } else if (c->width == 2) {
+    atomic_store_explicit((_Atomic uint16_t *)c->primary + index,
+                          (uint16_t)count, memory_order_relaxed);
+  } else {
+    atomic_store_explicit((_Atomic uint32_t *)c->primary + index, count,
+                          memory_order_relaxed);
+  }
+}
+
+static long counter_get(counter_array *c, int index) {
+  uint32_t small = bucket_load(c, index);
+
+  if (small < c->saturated) {
+    return small;
+  }
+
+  // Reload under the lock, the bucket may have dropped out of the table
+  pthread_mutex_lock(&c->overflow_lock);
+  small = bucket_load(c, index);
+  long count = small < c->saturated ? small : overflow_lookup(c, index)->count;
+  pthread_mutex_unlock(&c->overflow_lock);
+
+  return count;
+}
+
+// Store count in an empty bucket, spilling it into the overflow table if it
+// doesn't fit in the bucket. Returns false, leaving the bucket empty, if the
+// table can't grow to take it
+static bool counter_set(counter_array *c, int index, long count) {
+  if (count < c->saturated) {
+    bucket_store(c, index, (uint32_t)count);
+    return true;
+  }
+
+  pthread_mutex_lock(&c->overflow_lock);
+  bool reserved = overflow_reserve(c);
+
+  if (reserved) {
+    bucket_store(c, index, c->saturated);
+    overflow_insert(c, index, count);
+  }
+
+  pthread_mutex_unlock(&c->overflow_lock);
+  return reserved;
+}
+
+// Add one to the bucket at index and return its new count, or -1 leaving it
+// as it was if the overflow table can't grow. Counts below saturation are
+// bumped with a relaxed CAS, only the step into the overflow table and counts
+// already in it take the lock
+static long counter_increment(counter_array *c, int index) {
+  uint32_t saturated = c->saturated;
+  uint32_t small = bucket_load(c, index);
+
+  while (small < saturated - 1) {
+    if (bucket_swap(c, index, &small, small + 1)) {
+      return small + 1;
+    }
+  }
+
+  long count;
+  pthread_mutex_lock(&c->overflow_lock);
+  small = bucket_load(c, index);
+
+  // A concurrent decrement may still move the bucket while it is unsaturated
+  while (true) {
+    if (small == saturated) {
+      count = ++overflow_lookup(c, index)->count;
+      break;
+    }
+
+    // Make room in the table before the bucket saturates, so a failure
+    // leaves nothing half done
+    if (small == saturated - 1 && !overflow_reserve(c)) {
+      count = -1;
+      break;
+    }
+
+    if (bucket_swap(c, index, &small, small + 1)) {
+      count = (long)small + 1;
+      if (count == saturated) {
+        overflow_insert(c, index, count);
+      }
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&c->overflow_lock);
+  return count;
+}
+
+// Remove one from the bucket at index and return its new count, or -1 if it
+// was already empty. The CAS refuses to take a count below zero
+static long counter_decrement(counter_array *c, int index) {
+  uint32_t saturated = c->saturated;
+  uint32_t small = bucket_load(c, index);
+
+  while (small > 0 && small < saturated) {
+    if (bucket_swap(c, index, &small, small - 1)) {
+      return small - 1;
+    }
+  }
+
+  if (small == 0) {
+    return -1;
+  }
+
+  long count;
+  pthread_mutex_lock(&c->overflow_lock);
+  small = bucket_load(c, index);
+
+  while (true) {
+    if (small == 0) {
+      count = -1;
+      break;
+    }
+
+    if (small == saturated) {
+      count = --overflow_lookup(c, index)->count;
+
+      // Drop back into the bucket once the count fits again
+      if (count < saturated) {
+        overflow_remove(c, index);
+        bucket_store(c, index, (uint32_t)count);
+      }
+      break;
+    }
+
+    if (bucket_swap(c, index, &small, small - 1)) {
+      count = small - 1;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&c->overflow_lock);
+  return count;
+}
+
+// Return the overflow slot holding index, or the empty slot where it belongs
+static overflow_entry *overflow_lookup(counter_array *c, int index) {
+  unsigned int mask = c->overflow_capacity - 1;
+  unsigned int slot = ((unsigned int)index * 2654435761u) & mask;
+
+  while (c->overflow[slot].index != -1 && c->overflow[slot].index != index) {
+    slot = (slot + 1) & mask;
+  }
+
+  return &c->overflow[slot];
+}
+
+// Grow the table if one more entry would take it past half full, so probe
+// sequences stay short. Returns false, leaving the table as it was, if there
+// is no memory for the larger one
+static bool overflow_reserve(counter_array *c) {
+  if (2 * (c->overflow_size + 1) <= c->overflow_capacity) {
+    return true;
+  }
+
+  return overflow_resize(c, 2 * c->overflow_capacity);
+}
+
+// Rehash the table into capacity slots, a power of two with room for every
+// entry. Returns false, leaving the table as it was, if there is no memory for
+// the new one
+static bool overflow_resize(counter_array *c, int capacity) {
+  overflow_entry *old = c->overflow;
+  int old_capacity = c->overflow_capacity;
+  overflow_entry *resized = (overflow_entry *)account_alloc(
+      c->memory, MEMORY_OVERFLOW, capacity * sizeof(overflow_entry), false);
+
+  if (!resized) {
+    set_error("Failed to allocate memory for counter overflow table.");
+    return false;
+  }
+
+  c->overflow = resized;
+  c->overflow_capacity = capacity;
+
+  for (int i = 0; i < c->overflow_capacity; ++i) {
+    c->overflow[i].index = -1;
+  }
+
+  for (int i = 0; i < old_capacity; ++i) {
+    if (old[i].index != -1) {
+      *overflow_lookup(c, old[i].index) = old[i];
+    }
+  }
+
+  account_free(c->memory, MEMORY_OVERFLOW, old);
+  return true;
+}
+
+// Add index to the table, which overflow_reserve has made room for
+static void overflow_insert(counter_array *c, int index, long count) {
+  overflow_entry *entry = overflow_lookup(c, index);
+  entry->index = index;
+  entry->count = count;
+  ++c->overflow_size;
+}
+
+// Remove index from the table, shifting later entries of its probe run back so
+// lookups never stop early at the hole
+static void overflow_remove(counter_array *c, int index) {
+  unsigned int mask = c->overflow_capacity - 1;
+  overflow_entry *entry = overflow_lookup(c, index);
+  unsigned int hole = entry - c->overflow;
+  unsigned int slot = hole;
+
+  while (true) {
+    slot = (slot + 1) & mask;
+    if (c->overflow[slot].index == -1) {
+      break;
+    }
+
+    unsigned int home =
+        ((unsigned int)c->overflow[slot].index * 2654435761u) & mask;
+
+    // Move the entry into the hole unless its home lies between the two
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      c->overflow[hole] = c->overflow[slot];
+      hole = slot;
+    }
+  }
+
+  c->overflow[hole].index = -1;
+  --c->overflow_size;
+}
+
+static void free_counters(counter_array *c) {
+  if (!c->mapped) {
+    page_free(c->memory, MEMORY_COUNTERS, c->primary);
+  }
+
+  account_free(c->memory, MEMORY_OVERFLOW, c->overflow);
+  pthread_mutex_destroy(&c->overflow_lock);
+
+  c->primary = NULL;
+  c->overflow = NULL;
+  c->overflow_size = c->overflow_capacity = 0;
+}
+
+//////////////////////
+// BITMAP FUNCTIONS //
+//////////////////////
+
+// Allocate enough summary levels over size bits to end in a single word,
+// returning false with nothing allocated if there is no memory for them
+static bool bitmap_init(occupancy_bitmap *b, int size) {
+  bitmap_layout(b, size);
+  b->mapped = false;
+
+  for (int level = 0; level < b->num_levels; ++level) {
+    b->levels[level] = (_Atomic uint64_t *)page_alloc(
+        b->memory, MEMORY_BITMAP, b->num_words[level] * sizeof(uint64_t),
+        true);
+
+    if (!b->levels[level]) {
+      set_error("Failed to allocate memory for occupancy bitmap.");
+      b->num_levels = level;
+      free_bitmap(b);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Work out the number of levels over size bits and the words in each
+static void bitmap_layout(occupancy_bitmap *b, int size) {
+  size_t bits = size > 0 ? size : 1;
+  b->num_levels = 0;
+
+  do {
+    size_t words = (bits + 63) / 64;
+
+    b->num_words[b->num_levels] = words;
+    ++b->num_levels;
+    bits = words;
+  } while (bits > 1);
+}
+
+static void bitmap_set(occupancy_bitmap *b, int index) {
+  bitmap_set_level(b, 0, index);
+}
+
+// Set bits from level upwards. Summaries above a word that already had bits
+// set are already correct, or are about to be restored by the clear that
+// emptied it
+static void bitmap_set_level(occupancy_bitmap *b, int level, size_t position) {
+  for (; level < b->num_levels; ++level) {
+    uint64_t old = atomic_fetch_or(&b->levels[level][position >> 6],
+                                   1ULL << (position & 63));
+
+    if (old != 0) {
+      return;
+    }
+    position >>= 6;
+  }
+}
+
+static void bitmap_clear(occupancy_bitmap *b, int index) {
+  bitmap_clear_level(b, 0, index);
+}
+
+// Clear a bit, and its summary bit if the word is left empty. A concurrent set
+// can refill the word before the summary bit goes, so the word is checked
+// again afterwards and its summary restored
+static void bitmap_clear_level(occupancy_bitmap *b, int level,
+                               size_t position) {
+  _Atomic uint64_t *word = &b->levels[level][position >> 6];
+  uint64_t bit = 1ULL << (position & 63);
+
+  if ((atomic_fetch_and(word, ~bit) & ~bit) != 0 ||
+      level + 1 == b->num_levels) {
+    return;
+  }
+
+  bitmap_clear_level(b, level + 1, position >> 6);
+
+  if (atomic_load(word) != 0) {
+    bitmap_set_level(b, level + 1, position >> 6);
+  }
+}
+
+// Return the first set index >= index, or -1 if there is none. Climbs until a
+// summary word has a later bit set, then descends taking the lowest bit. A
+// word emptied by a concurrent clear after its summary was read restarts the
+// search past everything the word covers
+static int bitmap_next(occupancy_bitmap *b, int index) {
+  size_t position = index;
+
+  while (true) {
+    int level = 0;
+
+    for (; level < b->num_levels; ++level) {
+      size_t word = position >> 6;
+      if (word >= b->num_words[level]) {
+        return -1;
+      }
+
+      uint64_t bits = atomic_load_explicit(&b->levels[level][word],
+                                           memory_order_relaxed) &
+                      (~0ULL << (position & 63));
+      if (bits) {
+        position = (word << 6) + __builtin_ctzll(bits);
+        break;
+      }
+
+      position = word + 1;
+    }
+
+    if (level == b->num_levels) {
+      return -1;
+    }
+
+    uint64_t bits = 1;
+    while (level > 0) {
+      bits = atomic_load_explicit(&b->levels[level - 1][position],
+                                  memory_order_relaxed);
+      if (!bits) {
+        break;
+      }
+
+      position = (position << 6) + __builtin_ctzll(bits);
+      --level;
+    }
+
+    if (bits) {
+      return (int)position;
+    }
+
+    position = (position + 1) << (6 * level);
+  }
+}
+
+// Return the last set index <= index, or -1 if there is none
+static int bitmap_prev(occupancy_bitmap *b, int index) {
+  long position = index;
+
+  while (true) {
+    int level = 0;
+
+    for (; level < b->num_levels; ++level) {
+      if (position < 0) {
+        return -1;
+      }
+
+      size_t word = position >> 6;
+      uint64_t bits = atomic_load_explicit(&b->levels[level][word],
+                                           memory_order_relaxed) &
+                      (~0ULL >> (63 - (position & 63)));
+      if (bits) {
+        position = (word << 6) + 63 - __builtin_clzll(bits);
+        break;
+      }
+
+      position = (long)word - 1;
+    }
+
+    if (level == b->num_levels) {
+      return -1;
+    }
+
+    uint64_t bits = 1;
+    while (level > 0) {
+      bits = atomic_load_explicit(&b->levels[level - 1][position],
+                                  memory_order_relaxed);
+      if (!bits) {
+        break;
+      }
+
+      position = (position << 6) + 63 - __builtin_clzll(bits);
+      --level;
+    }
+
+    if (bits) {
+      return (int)position;
+    }
+
+    position = (position << (6 * level)) - 1;
+  }
+}
+
+static void free_bitmap(occupancy_bitmap *b) {
+  for (int level = 0; level < b->num_levels; ++level) {
+    if (!b->mapped) {
+      page_free(b->memory, MEMORY_BITMAP, (void *)b->levels[level]);
+    }
+    b->levels[level] = NULL;
+  }
+
+  b->num_levels = 0;
+}
+
+///////////////////////////
+// BLOCK INDEX FUNCTIONS //
+///////////////////////////
+
+static bool block_index_init(block_index *x, int size) {
+  x->num_blocks = block_index_blocks(size);
+  x->sums = (atomic_long *)page_alloc(
+      x->memory, MEMORY_BLOCKS, (x->num_blocks + 1) * sizeof(atomic_long),
+      true);
+  x->mapped = false;
+
+  if (!x->sums) {
+    set_error("Failed to allocate memory for block index.");
+    x->num_blocks = 0;
+    return false;
+  }
+
+  return true;
+}
+
+// Utility function to find the blocks covering size buckets
+static int block_index_blocks(int size) {
+  return (size + RANK_BLOCK - 1) / RANK_BLOCK;
+}
+
+// Add delta to the count of the block holding bucket index. Adds are relaxed
+// and commute, so concurrent dense updates need no lock
+static void block_index_add(block_index *x, int index, long delta) {
+  for (int i = index / RANK_BLOCK + 1; i <= x->num_blocks; i += i & -i) {
+    atomic_fetch_add_explicit(&x->sums[i], delta, memory_order_relaxed);
+  }
+}
+
+// Return the numbers held in blocks before block
+static long block_index_prefix(block_index *x, int block) {
+  long sum = 0;
+
+  for (int i = block; i > 0; i -= i & -i) {
+    sum += atomic_load_explicit(&x->sums[i], memory_order_relaxed);
+  }
+
+  return sum;
+}
+
+// Find the block holding the k-th number counting from 0, leaving k as its
+// position within the block. Descends from the highest power of two, so each
+// step halves the blocks left. Returns -1 if fewer numbers are indexed
+static int block_index_find(block_index *x, long *k) {
+  int block = 0, step = 1;
+
+  while (step * 2 <= x->num_blocks) {
+    step *= 2;
+  }
+
+  for (; step > 0; step /= 2) {
+    if (block + step <= x->num_blocks) {
+      long sum = atomic_load_explicit(&x->sums[block + step],
+                                      memory_order_relaxed);
+
+      if (sum <= *k) {
+        block += step;
+        *k -= sum;
+      }
+    }
+  }
+
+  return block < x->num_blocks ? block : -1;
+}
+
+// Turn sums holding each block's own count into the Fenwick tree in
+// O(blocks), each entry passing its total up to the next one covering it
+static void block_index_build(block_index *x) {
+  for (int i = 1; i <= x->num_blocks; ++i) {
+    int parent = i + (i & -i);
+
+    if (parent <= x->num_blocks) {
+      x->sums[parent] += x->sums[i];
+    }
+  }
+}
+
+static void free_block_index(block_index *x) {
+  if (!x->mapped) {
+    page_free(x->memory, MEMORY_BLOCKS, x->sums);
+  }
+
+  x->sums = NULL;
+  x->num_blocks = 0;
+}
+
+//////////////////////////
+// RUN-LENGTH FUNCTIONS //
+//////////////////////////
+
+// Build the list from sorted (value, count) pairs, storing each value as its
+// offset from base. Run lists only hold shards of at most INT_MAX values, so
+// the number of pairs always fits an int
+static bool runs_build(run_list *r, value_t base, const pair_array *pairs) {
+  r->gaps = 0;
+  r->compact_at = -1;
+  r->work = 0;
+
+  // Empty lists hold no memory, so emptying a shard can't fail
+  if (pairs->num == 0) {
+    r->values = r->counts = NULL;
+    r->size = r->capacity = 0;
+    r->blocks.sums = NULL;
+    r->blocks.num_blocks = 0;
+    return true;
+  }
+
+  r->size = (int)pairs->num;
+  r->capacity = r->size + r->size / 4 + RUNS_INITIAL_CAPACITY;
+  r->values = (int *)account_alloc(r->memory, MEMORY_RUNS,
+                                   r->capacity * sizeof(int), false);
+  r->counts = (int *)account_alloc(r->memory, MEMORY_RUNS,
+                                   r->capacity * sizeof(int), false);
+  r->blocks.sums = NULL;
+
+  if (!r->values || !r->counts) {
+    set_error("Failed to allocate memory for run list.");
+    free_runs(r);
+    return false;
+  }
+
+  for (int i = 0; i < r->size; ++i) {
+    r->values[i] = (int)(pair_value(pairs, i) - base);
+    r->counts[i] = (int)pair_count(pairs, i);
+  }
+
+  if (!runs_index(r, &r->blocks, r->capacity)) {
+    free_runs(r);
+    return false;
+  }
+
+  return true;
+}
+
+static long runs_find(run_list *r, int value) {
+  int pos = lower_bound(r->values, r->size, value);
+
+  if (pos < r->size && r->values[pos] == value) {
+    return r->counts[pos];
+  }
+
+  return 0;
+}
+
+// Add one occurrence of value and return its new count, or -1 if the list
+// can't grow to take it
+static long runs_insert(run_list *r, int value) {
+  return runs_insert_at(r, value, lower_bound(r->values, r->size, value));
+}
+
+// Add one occurrence of value, where pos is the first slot holding a value
+// >= value
+static long runs_insert_at(run_list *r, int value, int pos) {
+  // Existing values, including gaps left by deletes, are a counter update
+  if (pos < r->size && r->values[pos] == value) {
+    if (r->counts[pos] == 0) {
+      --r->gaps;
+      runs_touched(r, pos, pos);
+    }
+    block_index_add(&r->blocks, pos, 1);
+    return ++r->counts[pos];
+  }
+
+  // A gap either side of the insertion point can take the value directly
+  // without breaking the ordering
+  if (pos > 0 && r->counts[pos - 1] == 0) {
+    --pos;
+  } else if (pos >= r->size || r->counts[pos] != 0) {
+    // Otherwise shift the slots between here and the nearest gap by one
+    int gap = runs_nearest_gap(r, pos);
+
+    if (gap >= pos) {
+      if (gap == r->size) {
+        if (r->size == r->capacity && !runs_grow(r)) {
+          return -1;
+        }
+        ++r->size;
+        ++r->gaps;
+      }
+
+      memmove(r->values + pos + 1, r->values + pos, (gap - pos) * sizeof(int));
+      memmove(r->counts + pos + 1, r->counts + pos, (gap - pos) * sizeof(int));
+      r->work += gap - pos;
+      runs_touched(r, pos, gap);
+      runs_shifted(r, pos + 1, gap, 1);
+    } else {
+      --pos;
+      memmove(r->values + gap, r->values + gap + 1, (pos - gap) * sizeof(int));
+      memmove(r->counts + gap, r->counts + gap + 1, (pos - gap) * sizeof(int));
+      r->work += pos - gap;
+      runs_touched(r, gap, pos);
+      runs_shifted(r, gap, pos - 1, -1);
+    }
+  }
+
+  r->values[pos] = value;
+  r->counts[pos] = 1;
+  --r->gaps;
+  runs_touched(r, pos, pos);
+  block_index_add(&r->blocks, pos, 1);
+  return 1;
+}
+
+// Remove a single occurrence of value, leaving a gap if it was the last one.
+// Returns the remaining count, or -1 if value isn't stored
+static long runs_remove(run_list *r, int value) {
+  return runs_remove_at(r, value, lower_bound(r->values, r->size, value));
+}
+
+static long runs_remove_at(run_list *r, int value, int pos) {
+  if (pos < r->size && r->values[pos] == value && r->counts[pos] > 0) {
+    if (--r->counts[pos] == 0) {
+      ++r->gaps;
+    }
+    block_index_add(&r->blocks, pos, -1);
+    return r->counts[pos];
+  }
+
+  return -1;
+}
+
+// Gaps skipped by searches are tallied atomically, since readers share the
+// shard's lock
+static int runs_pred(run_list *r, int value) {
+  int start = lower_bound(r->values, r->size, value) - 1;
+  int pos = prev_nonzero(r->counts, start);
+  int skipped = start - pos;
+
+  if (skipped > 0) {
+    atomic_fetch_add_explicit(&r->work, skipped, memory_order_relaxed);
+  }
+
+  return pos >= 0 ? r->values[pos] : -1;
+}
+
+static int runs_succ(run_list *r, int value) {
+  int start = upper_bound(r->values, r->size, value);
+  int pos = next_nonzero(r->counts, start, r->size);
+  int skipped = pos - start;
+
+  if (skipped > 0) {
+    atomic_fetch_add_explicit(&r->work, skipped, memory_order_relaxed);
+  }
+
+  return pos < r->size ? r->values[pos] : -1;
+}
+
+// Find the first slot at or after from holding a value >= value, given every
+// slot before from holds a smaller one. Gallops forward so a sorted sweep costs
+// O(log distance) per step rather than a full binary search
+static int runs_seek(run_list *r, int value, int from) {
+  int low = from, high = from, step = 1;
+
+  while (high < r->size && r->values[high] < value) {
+    low = high + 1;
+    high = from + step;
+    step *= 2;
+  }
+
+  if (high > r->size) {
+    high = r->size;
+  }
+
+  return low + lower_bound(r->values + low, high - low, value);
+}
+
+// Find the closest gap to pos within a bounded window, falling back to the
+// first unused slot at the end of the list
+static int runs_nearest_gap(run_list *r, int pos) {
+  for (int distance = 1; distance <= RUNS_GAP_SEARCH; ++distance) {
+    if (pos + distance < r->size && r->counts[pos + distance] == 0) {
+      return pos + distance;
+    }
+
+    if (pos - 1 - distance >= 0 && r->counts[pos - 1 - distance] == 0) {
+      return pos - 1 - distance;
+    }
+  }
+
+  return r->size;
+}
+
+// Function to keep a compaction pass's carried gaps valid after an add
+// changed slots first to last. Changes that reach into the carried gaps, or
+// the slot before them, drop them from the pass. They stay behind as ordinary
+// gaps and are picked up again by the next step
+static void runs_touched(run_list *r, int first, int last) {
+  if (r->compact_at >= 0 && first <= r->compact_at + r->compact_gaps &&
+      last >= r->compact_at - 1) {
+    r->compact_gaps = 0;
+  }
+}
+
+// Function to start a compaction pass once too many slots are gaps, and to
+// move a running pass on by one step. Called after each add or delete to a run
+// list held exclusively
+static void runs_compact(shard *s) {
+  run_list *r = &s->runs;
+
+  if (r->compact_at < 0) {
+    if (r->size < RUNS_COMPACT_CHUNK ||
+        r->gaps * RUNS_COMPACT_RATIO <= r->size) {
+      return;
+    }
+
+    r->compact_at = r->compact_gaps = r->compact_spacing = 0;
+    atomic_fetch_add_explicit(&s->set->compaction_passes, 1,
+                              memory_order_relaxed);
+  }
+
+  uint64_t start = now_nanos();
+  runs_compact_step(r);
+
+  atomic_fetch_add_explicit(&s->set->compaction_steps, 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->set->compaction_nanos, now_nanos() - start,
+                            memory_order_relaxed);
+}
+
+// Function to move the next RUNS_COMPACT_CHUNK slots after the carried gaps
+// down over them, so the gaps come out after those slots. One gap per
+// RUNS_GAP_SPACING values moved is left behind, so adds anywhere still find
+// one close by. The carried gaps take the value of the slot before them to
+// keep the list in order, and are cut off once the pass reaches the end
+static void runs_compact_step(run_list *r) {
+  int write = r->compact_at;
+  int end = write + r->compact_gaps + RUNS_COMPACT_CHUNK;
+
+  if (end > r->size) {
+    end = r->size;
+  }
+
+  int first = write;
+
+  for (int read = write + r->compact_gaps; read < end; ++read) {
+    if (r->counts[read] == 0) {
+      continue;
+    }
+
+    r->values[write] = r->values[read];
+    r->counts[write] = r->counts[read];
+    ++write;
+
+    if (++r->compact_spacing >= RUNS_GAP_SPACING && write <= read) {
+      r->values[write] = r->values[write - 1];
+      r->counts[write] = 0;
+      ++write;
+      r->compact_spacing = 0;
+    }
+  }
+
+  int fill = write > 0 ? r->values[write - 1] : -1;
+
+  for (int i = write; i < end; ++i) {
+    r->values[i] = fill;
+    r->counts[i] = 0;
+  }
+
+  if (end == r->size) {
+    r->gaps -= end - write;
+    r->size = write;
+    r->compact_at = -1;
+  } else {
+    r->compact_at = write;
+    r->compact_gaps = end - write;
+  }
+
+  runs_reindex(r, first, end - 1);
+}
+
+// Function to move the counts now in slots first to last, just shifted there
+// by step slots, into the blocks they lie in. Only counts that crossed a block
+// boundary change a block's sum, so a shift costs O(log n) per boundary. Going
+// up a count crosses onto the boundary, going down onto the slot before it
+static void runs_shifted(run_list *r, int first, int last, int step) {
+  int below = step < 0;
+  int boundary = (first + below + RANK_BLOCK - 1) / RANK_BLOCK * RANK_BLOCK;
+
+  for (; boundary <= last + below; boundary += RANK_BLOCK) {
+    int pos = boundary - below;
+    int count = r->counts[pos];
+
+    if (count != 0) {
+      block_index_add(&r->blocks, pos - step, -count);
+      block_index_add(&r->blocks, pos, count);
+    }
+  }
+}
+
+// Function to give x the per-block sums of the list's slots over a capacity
+// of capacity slots, leaving x empty and returning false if there is no
+// memory for it
+static bool runs_index(run_list *r, block_index *x, int capacity) {
+  x->memory = r->memory;
+
+  if (!block_index_init(x, capacity)) {
+    return false;
+  }
+
+  for (int i = 0; i < r->size; ++i) {
+    x->sums[i / RANK_BLOCK + 1] += r->counts[i];
+  }
+
+  block_index_build(x);
+  return true;
+}
+
+// Function to recount the blocks holding slots first to last after their
+// counts were rewritten in place, passing each block's change to the index
+static void runs_reindex(run_list *r, int first, int last) {
+  for (int block = first / RANK_BLOCK; block <= last / RANK_BLOCK; ++block) {
+    int end = (block + 1) * RANK_BLOCK < r->size ? (block + 1) * RANK_BLOCK
+                                                 : r->size;
+    long sum = 0;
+
+    for (int i = block * RANK_BLOCK; i < end; ++i) {
+      sum += r->counts[i];
+    }
+
+    sum -= block_index_prefix(&r->blocks, block + 1) -
+           block_index_prefix(&r->blocks, block);
+    if (sum != 0) {
+      block_index_add(&r->blocks, block * RANK_BLOCK, sum);
+    }
+  }
+}
+
+// Count the numbers held at offsets below value, from the index for the
+// blocks before value's slot and the slots of its own block
+static long runs_rank(run_list *r, int value) {
+  int pos = lower_bound(r->values, r->size, value);
+  int block = pos / RANK_BLOCK;
+  long sum = block_index_prefix(&r->blocks, block);
+
+  for (int i = block * RANK_BLOCK; i < pos; ++i) {
+    sum += r->counts[i];
+  }
+
+  return sum;
+}
+
+// Return the slot holding the k-th number counting from 0, or -1 if there
+// are no more than k
+static int runs_select(run_list *r, long k) {
+  int block = block_index_find(&r->blocks, &k);
+
+  if (block < 0) {
+    return -1;
+  }
+
+  int end = (block + 1) * RANK_BLOCK < r->size ? (block + 1) * RANK_BLOCK
+                                               : r->size;
+
+  for (int pos = block * RANK_BLOCK; pos < end; ++pos) {
+    if (k < r->counts[pos]) {
+      return pos;
+    }
+    k -= r->counts[pos];
+  }
+
+  return -1;
+}
+
+// Double the list's capacity, returning false with the list still usable at
+// its old capacity if there is no memory for it. The index is rebuilt over the
+// new capacity, which doubling keeps to O(1) per add
+static bool runs_grow(run_list *r) {
+  int capacity = r->capacity ? 2 * r->capacity : RUNS_INITIAL_CAPACITY;
+  block_index blocks;
+
+  if (!runs_index(r, &blocks, capacity)) {
+    return false;
+  }
+
+  int *values = (int *)account_realloc(r->memory, MEMORY_RUNS, r->values,
+                                       capacity * sizeof(int));
+
+  if (values) {
+    r->values = values;
+  }
+
+  int *counts = values ? (int *)account_realloc(r->memory, MEMORY_RUNS,
+                                                r->counts,
+                                                capacity * sizeof(int))
+                       : NULL;
+
+  if (!counts) {
+    set_error("Failed to allocate memory for run list.");
+    free_block_index(&blocks);
+    return false;
+  }
+
+  free_block_index(&r->blocks);
+  r->blocks = blocks;
+  r->counts = counts;
+  r->capacity = capacity;
+  return true;
+}
+
+static void free_runs(run_list *r) {
+  account_free(r->memory, MEMORY_RUNS, r->values);
+  account_free(r->memory, MEMORY_RUNS, r->counts);
+  free_block_index(&r->blocks);
+
+  r->values = r->counts = NULL;
+  r->size = r->capacity = r->gaps = 0;
+  r->compact_at = -1;
+  r->work = 0;
+}
+
+///////////////////////
+// B+-TREE FUNCTIONS //
+///////////////////////
+
+static bpt_leaf *create_leaf(bptree *t) {
+  bpt_leaf *leaf =
+      (bpt_leaf *)account_aligned(t->memory, MEMORY_LEAVES, sizeof(bpt_leaf));
+
+  if (!leaf) {
+    set_error("Failed to allocate memory for B+-tree leaf.");
+    return NULL;
+  }
+
+  leaf->prev = leaf->next = NULL;
+  leaf->first_key = leaf->last_key = 0;
+  leaf->num_keys = leaf->num_bytes = 0;
+  ++t->num_leaves;
+
+  return leaf;
+}
+
+static bpt_internal *create_internal(bptree *t) {
+  bpt_internal *node = (bpt_internal *)account_aligned(
+      t->memory, MEMORY_INTERNALS, sizeof(bpt_internal));
+
+  if (!node) {
+    set_error("Failed to allocate memory for B+-tree node.");
+    return NULL;
+  }
+
+  node->num_keys = 0;
+  ++t->num_internals;
+
+  return node;
+}
+
+// Bulk load sorted (value, count) pairs bottom up, packing leaves to a fill
+// target so every node starts at or above its minimum occupancy. Returns
+// false with nothing allocated if memory runs out
+static bool tree_build(bptree *t, const pair_array *pairs) {
+  long distinct = pairs->num;
+
+  t->height = 0;
+  t->num_leaves = t->num_internals = 0;
+  t->head = t->tail = NULL;
+
+  // Empty trees share the static leaf, so emptying a shard can't fail
+  if (distinct == 0) {
+    t->root = &empty_leaf;
+    return true;
+  }
+
+  // Upper bound on leaves, every one but the last being closed only once
+  // another entry wouldn't fit
+  long max_nodes = distinct / MIN_BUILD_ENTRIES + 1;
+  void **nodes = (void **)account_alloc(t->memory, MEMORY_SCRATCH,
+                                        max_nodes * sizeof(void *), false);
+  value_t *first_keys = (value_t *)account_alloc(
+      t->memory, MEMORY_SCRATCH, max_nodes * sizeof(value_t), false);
+  bpt_leaf *leaf = nodes && first_keys ? create_leaf(t) : NULL;
+
+  if (!leaf) {
+    set_error("Failed to allocate memory for B+-tree build.");
+    account_free(t->memory, MEMORY_SCRATCH, nodes);
+    account_free(t->memory, MEMORY_SCRATCH, first_keys);
+    return false;
+  }
+
+  long num_nodes = 1, start = 0;
+  int bytes = 0;
+  bool built = true;
+
+  nodes[0] = leaf;
+  t->head = t->tail = leaf;
+
+  for (long i = 0; i <= distinct; ++i) {
+    int size = 0;
+    if (i < distinct) {
+      uint64_t delta =
+          i > start ? pair_value(pairs, i) - pair_value(pairs, i - 1) : 0;
+      size = entry_size(delta, pair_count(pairs, i));
+    }
+
+    // Close the current leaf at the end of input or once it reaches the fill
+    if (i == distinct || (i > start && bytes + size > LEAF_FILL_BYTES)) {
+      leaf_encode_pairs(leaf, pairs, start, (int)(i - start));
+
+      if (i == distinct) {
+        break;
+      }
+
+      bpt_leaf *next = create_leaf(t);
+      if (!next) {
+        built = false;
+        break;
+      }
+
+      link_leaf_after(t, leaf, next);
+      nodes[num_nodes++] = next;
+
+      leaf = next;
+      start = i;
+      bytes = entry_size(0, pair_count(pairs, i));
+    } else {
+      bytes += size;
+    }
+  }
+
+  // Leaves so far are all on the list, nothing above them yet
+  if (!built) {
+    for (bpt_leaf *next; t->head; t->head = next) {
+      next = t->head->next;
+      account_free(t->memory, MEMORY_LEAVES, t->head);
+    }
+    num_nodes = 0;
+  }
+
+  // The last leaf takes whatever is left, so even it out with its neighbour
+  if (num_nodes > 1 && leaf->num_bytes < LEAF_MIN_BYTES) {
+    if (redistribute_leaves(t, (bpt_leaf *)nodes[num_nodes - 2], leaf)) {
+      --num_nodes;
+    }
+  }
+
+  for (long i = 0; i < num_nodes; ++i) {
+    first_keys[i] = ((bpt_leaf *)nodes[i])->first_key;
+  }
+
+  // Build internal levels until a single root remains
+  while (built && num_nodes > 1) {
+    long num_parents = 1;
+    if (num_nodes > INTERNAL_CAPACITY + 1) {
+      num_parents = (num_nodes + INTERNAL_FILL) / (INTERNAL_FILL + 1);
+    }
+
+    long offset = 0;
+    for (long i = 0; i < num_parents; ++i) {
+      bpt_internal *node = create_internal(t);
+
+      // Free the parents made so far, with their children, and the children
+      // still waiting for one
+      if (!node) {
+        for (long j = 0; j < i; ++j) {
+          free_tree_node(t, nodes[j], t->height + 1);
+        }
+        for (long j = offset; j < num_nodes; ++j) {
+          free_tree_node(t, nodes[j], t->height);
+        }
+
+        built = false;
+        break;
+      }
+
+      int size = num_nodes / num_parents + (i < num_nodes % num_parents);
+
+      for (int j = 0; j < size; ++j) {
+        node->children[j] = nodes[offset + j];
+        node->counts[j] = node_total(nodes[offset + j], t->height);
+        if (j > 0) {
+          node->keys[j - 1] = first_keys[offset + j];
+        }
+      }
+      node->num_keys = size - 1;
+
+      nodes[i] = node;
+      first_keys[i] = first_keys[offset];
+      offset += size;
+    }
+
+    num_nodes = num_parents;
+    ++t->height;
+  }
+
+  account_free(t->memory, MEMORY_SCRATCH, first_keys);
+
+  if (!built) {
+    account_free(t->memory, MEMORY_SCRATCH, nodes);
+    t->root = NULL;
+    t->head = t->tail = NULL;
+    t->height = 0;
+    t->num_leaves = t->num_internals = 0;
+    return false;
+  }
+
+  t->root = nodes[0];
+  account_free(t->memory, MEMORY_SCRATCH, nodes);
+  return true;
+}
+
+// Walk from the root to the leaf responsible for value, optionally recording
+// the internal nodes and child slots taken on the way down
+static bpt_leaf *tree_descend(bptree *t, value_t value, bpt_internal **path,
+                              int *slots) {
+  void *node = t->root;
+
+  for (int level = 0; level < t->height; ++level) {
+    bpt_internal *internal = (bpt_internal *)node;
+    int slot = upper_bound64(internal->keys, internal->num_keys, value);
+
+    if (path) {
+      path[level] = internal;
+      slots[level] = slot;
+    }
+
+    node = internal->children[slot];
+  }
+
+  return (bpt_leaf *)node;
+}
+
+// Decode the leaf's block only as far as value's position
+static long tree_find(bptree *t, value_t value) {
+  return leaf_find(tree_descend(t, value, NULL, NULL), value);
+}
+
+static long leaf_find(const bpt_leaf *leaf, value_t value) {
+  if (leaf->num_keys == 0 || value < leaf->first_key ||
+      value > leaf->last_key) {
+    return 0;
+  }
+
+  leaf_position at;
+  leaf_locate(leaf, value, &at);
+
+  return at.key == value ? at.count : 0;
+}
+
+// Splice value into the leaf's block, splitting the block if it no longer
+// fits. Returns the new count of value
+static long tree_insert(bptree *t, value_t value) {
+  bpt_internal *path[MAX_TREE_HEIGHT];
+  int slots[MAX_TREE_HEIGHT];
+  bpt_internal *spares[MAX_TREE_HEIGHT + 1];
+  value_t keys[MAX_LEAF_ENTRIES + 1];
+  long counts[MAX_LEAF_ENTRIES + 1];
+
+  // The first number into an empty tree needs a leaf of its own
+  if (t->root == &empty_leaf) {
+    bpt_leaf *first = create_leaf(t);
+    if (!first) {
+      return -1;
+    }
+    t->root = t->head = t->tail = first;
+  }
+
+  bpt_leaf *leaf = tree_descend(t, value, path, slots);
+  long count = leaf_insert(leaf, value);
+
+  if (count > 0) {
+    tree_path_add(t, path, slots, 1);
+    return count;
+  }
+
+  // Take every node the split needs up front, so running out of memory
+  // leaves the tree as it was
+  bpt_leaf *right = create_leaf(t);
+
+  if (!right || !reserve_split(t, path, spares)) {
+    if (right) {
+      account_free(t->memory, MEMORY_LEAVES, right);
+      --t->num_leaves;
+    }
+    return -1;
+  }
+
+  tree_path_add(t, path, slots, 1);
+
+  // Block is full, decode it and split the entries by encoded size
+  int num = leaf_decode(leaf, keys, counts);
+  int pos = lower_bound64(keys, num, value);
+
+  if (pos < num && keys[pos] == value) {
+    count = ++counts[pos];
+  } else {
+    memmove(keys + pos + 1, keys + pos, (num - pos) * sizeof(value_t));
+    memmove(counts + pos + 1, counts + pos, (num - pos) * sizeof(long));
+    keys[pos] = value;
+    counts[pos] = count = 1;
+    ++num;
+  }
+
+  int split = split_point(keys, counts, num);
+
+  leaf_encode(leaf, keys, counts, split);
+  leaf_encode(right, keys + split, counts + split, num - split);
+  link_leaf_after(t, leaf, right);
+
+  insert_separator(t, path, slots, t->height - 1, right->first_key, right,
+                   leaf_total(right), spares);
+  return count;
+}
+
+// Remove a single occurrence of value, returns the remaining count or -1 if
+// value isn't stored
+static long tree_remove(bptree *t, value_t value) {
+  bpt_internal *path[MAX_TREE_HEIGHT];
+  int slots[MAX_TREE_HEIGHT];
+
+  bpt_leaf *leaf = tree_descend(t, value, path, slots);
+  long remaining = leaf_remove(leaf, value);
+
+  if (remaining < 0) {
+    return -1;
+  }
+
+  tree_path_add(t, path, slots, -1);
+
+  if (t->height > 0 && leaf->num_bytes < LEAF_MIN_BYTES) {
+    rebalance_leaf(t, path, slots);
+  }
+
+  return remaining;
+}
+
+static value_t tree_pred(bptree *t, value_t value) {
+  bpt_leaf *leaf = tree_descend(t, value, NULL, NULL);
+
+  if (leaf->num_keys > 0 && leaf->first_key < value) {
+    if (leaf->last_key < value) {
+      return leaf->last_key;
+    }
+
+    value_t key = leaf->first_key, previous = -1;
+    long count;
+    int offset = 0;
+    for (int i = 0; i < leaf->num_keys; ++i) {
+      offset = decode_entry(leaf->data, offset, &key, &count);
+      if (key >= value) {
+        break;
+      }
+      previous = key;
+    }
+
+    return previous;
+  }
+
+  // Non-root leaves are never empty, so the neighbour's last key is the answer
+  if (leaf->prev) {
+    return leaf->prev->last_key;
+  }
+
+  return -1;
+}
+
+static value_t tree_succ(bptree *t, value_t value) {
+  bpt_leaf *leaf = tree_descend(t, value, NULL, NULL);
+
+  if (leaf->num_keys > 0 && leaf->last_key > value) {
+    if (leaf->first_key > value) {
+      return leaf->first_key;
+    }
+
+    value_t key = leaf->first_key;
+    long count;
+    int offset = 0;
+    for (int i = 0; i < leaf->num_keys; ++i) {
+      offset = decode_entry(leaf->data, offset, &key, &count);
+      if (key > value) {
+        return key;
+      }
+    }
+  }
+
+  if (leaf->next) {
+    return leaf->next->first_key;
+  }
+
+  return -1;
+}
+
+// Count the numbers below value, adding up the subtree counts left of the
+// path down and then the leaf's entries before value
+static long tree_rank(bptree *t, value_t value) {
+  void *node = t->root;
+  long count = 0;
+
+  for (int level = 0; level < t->height; ++level) {
+    bpt_internal *internal = (bpt_internal *)node;
+    int slot = upper_bound64(internal->keys, internal->num_keys, value);
+
+    for (int i = 0; i < slot; ++i) {
+      count += internal->counts[i];
+    }
+
+    node = internal->children[slot];
+  }
+
+  bpt_leaf *leaf = (bpt_leaf *)node;
+  value_t key = leaf->first_key;
+  long entry_count;
+  int offset = 0;
+
+  for (int i = 0; i < leaf->num_keys; ++i) {
+    offset = decode_entry(leaf->data, offset, &key, &entry_count);
+    if (key >= value) {
+      break;
+    }
+    count += entry_count;
+  }
+
+  return count;
+}
+
+// Find the k-th number counting from 0 by steering down with the subtree
+// counts, or -1 if there are no more than k
+static value_t tree_select(bptree *t, long k) {
+  void *node = t->root;
+
+  for (int level = 0; level < t->height; ++level) {
+    bpt_internal *internal = (bpt_internal *)node;
+    int slot = 0;
+
+    while (slot < internal->num_keys && k >= internal->counts[slot]) {
+      k -= internal->counts[slot];
+      ++slot;
+    }
+
+    node = internal->children[slot];
+  }
+
+  bpt_leaf *leaf = (bpt_leaf *)node;
+  value_t key = leaf->first_key;
+  long count;
+  int offset = 0;
+
+  for (int i = 0; i < leaf->num_keys; ++i) {
+    offset = decode_entry(leaf->data, offset, &key, &count);
+    if (k < count) {
+      return key;
+    }
+    k -= count;
+  }
+
+  return -1;
+}
+
+// Pass each distinct number in [first, last] to callback, decoding leaves in
+// order from the one holding first. Returns how many were passed
+static long tree_iterate(bptree *t, value_t first, value_t last,
+                         range_callback callback, void *context) {
+  long visited = 0;
+
+  for (bpt_leaf *leaf = tree_descend(t, first, NULL, NULL); leaf;
+       leaf = leaf->next) {
+    value_t key = leaf->first_key;
+    long count;
+    int offset = 0;
+
+    for (int i = 0; i < leaf->num_keys; ++i) {
+      offset = decode_entry(leaf->data, offset, &key, &count);
+
+      if (key > last) {
+        return visited;
+      }
+
+      if (key >= first) {
+        callback(key, count, context);
+        ++visited;
+      }
+    }
+  }
+
+  return visited;
+}
+
+// Utility function to add delta to the subtree counts along a path taken by
+// tree_descend
+static void tree_path_add(bptree *t, bpt_internal **path, int *slots,
+                          long delta) {
+  for (int level = 0; level < t->height; ++level) {
+    path[level]->counts[slots[level]] += delta;
+  }
+}
+
+// Utility function to total the counts in a leaf's block
+static long leaf_total(const bpt_leaf *leaf) {
+  value_t key = leaf->first_key;
+  long count;
+  int offset = 0;
+  long total = 0;
+
+  for (int i = 0; i < leaf->num_keys; ++i) {
+    offset = decode_entry(leaf->data, offset, &key, &count);
+    total += count;
+  }
+
+  return total;
+}
+
+// Utility function to total the numbers under a node height levels above the
+// leaves
+static long node_total(void *node, int height) {
+  if (height == 0) {
+    return leaf_total((const bpt_leaf *)node);
+  }
+
+  bpt_internal *internal = (bpt_internal *)node;
+  long total = 0;
+
+  for (int i = 0; i <= internal->num_keys; ++i) {
+    total += internal->counts[i];
+  }
+
+  return total;
+}
+
+// Allocate the internal nodes a leaf split under path will need into spares,
+// ending the list with NULL: one per full node it climbs through, and a new
+// root if it climbs out of the top. Returns false with nothing allocated if
+// memory runs out
+static bool reserve_split(bptree *t, bpt_internal **path,
+                          bpt_internal **spares) {
+  int level = t->height - 1;
+  while (level >= 0 && path[level]->num_keys == INTERNAL_CAPACITY) {
+    --level;
+  }
+
+  int needed = level < 0 ? t->height + 1 : t->height - 1 - level;
+
+  for (int i = 0; i < needed; ++i) {
+    spares[i] = create_internal(t);
+
+    if (!spares[i]) {
+      while (i-- > 0) {
+        account_free(t->memory, MEMORY_INTERNALS, spares[i]);
+        --t->num_internals;
+      }
+      return false;
+    }
+  }
+
+  spares[needed] = NULL;
+  return true;
+}
+
+// Insert a separator and its right child, split off from children[slot] and
+// holding total numbers, into the parent at the given level. Full internal
+// nodes are split on the way up and a new root is grown if needed, using the
+// nodes reserve_split set aside
+static void insert_separator(bptree *t, bpt_internal **path, int *slots,
+                             int level, value_t key, void *child, long total,
+                             bpt_internal **spares) {
+  for (; level >= 0; --level) {
+    bpt_internal *node = path[level];
+    int slot = slots[level];
+
+    node->counts[slot] -= total;
+
+    if (node->num_keys < INTERNAL_CAPACITY) {
+      memmove(node->keys + slot + 1, node->keys + slot,
+              (node->num_keys - slot) * sizeof(value_t));
+      memmove(node->children + slot + 2, node->children + slot + 1,
+              (node->num_keys - slot) * sizeof(void *));
+      memmove(node->counts + slot + 2, node->counts + slot + 1,
+              (node->num_keys - slot) * sizeof(long));
+      node->keys[slot] = key;
+      node->children[slot + 1] = child;
+      node->counts[slot + 1] = total;
+      ++node->num_keys;
+      return;
+    }
+
+    // Node is full, lay out the overfull key/child lists then split them
+    value_t keys[INTERNAL_CAPACITY + 1];
+    void *children[INTERNAL_CAPACITY + 2];
+    long counts[INTERNAL_CAPACITY + 2];
+
+    memcpy(keys, node->keys, slot * sizeof(value_t));
+    keys[slot] = key;
+    memcpy(keys + slot + 1, node->keys + slot,
+           (INTERNAL_CAPACITY - slot) * sizeof(value_t));
+
+    memcpy(children, node->children, (slot + 1) * sizeof(void *));
+    children[slot + 1] = child;
+    memcpy(children + slot + 2, node->children + slot + 1,
+           (INTERNAL_CAPACITY - slot) * sizeof(void *));
+
+    memcpy(counts, node->counts, (slot + 1) * sizeof(long));
+    counts[slot + 1] = total;
+    memcpy(counts + slot + 2, node->counts + slot + 1,
+           (INTERNAL_CAPACITY - slot) * sizeof(long));
+
+    int mid = (INTERNAL_CAPACITY + 1) / 2;
+    bpt_internal *right = *spares++;
+
+    node->num_keys = mid;
+    memcpy(node->keys, keys, mid * sizeof(value_t));
+    memcpy(node->children, children, (mid + 1) * sizeof(void *));
+    memcpy(node->counts, counts, (mid + 1) * sizeof(long));
+
+    right->num_keys = INTERNAL_CAPACITY - mid;
+    memcpy(right->keys, keys + mid + 1, right->num_keys * sizeof(value_t));
+    memcpy(right->children, children + mid + 1,
+           (right->num_keys + 1) * sizeof(void *));
+    memcpy(right->counts, counts + mid + 1,
+           (right->num_keys + 1) * sizeof(long));
+
+    // Middle key moves up rather than being copied, as in any B-tree
+    key = keys[mid];
+    child = right;
+    total = node_total(right, 1);
+  }
+
+  bpt_internal *root = *spares;
+  root->num_keys = 1;
+  root->keys[0] = key;
+  root->children[0] = t->root;
+  root->children[1] = child;
+  root->counts[0] = node_total(t->root, t->height);
+  root->counts[1] = total;
+
+  t->root = root;
+  ++t->height;
+}
+
+// Restore minimum occupancy of an underfull leaf by evening it out with, or
+// merging it into, a sibling under the same parent
+static void rebalance_leaf(bptree *t, bpt_internal **path, int *slots) {
+  bpt_internal *parent = path[t->height - 1];
+  int slot = slots[t->height - 1];
+
+  // Pair the leaf with its left sibling where there is one
+  if (slot > 0) {
+    --slot;
+  }
+
+  bpt_leaf *left = (bpt_leaf *)parent->children[slot];
+  bpt_leaf *right = (bpt_leaf *)parent->children[slot + 1];
+
+  if (!redistribute_leaves(t, left, right)) {
+    parent->keys[slot] = right->first_key;
+    parent->counts[slot] = leaf_total(left);
+    parent->counts[slot + 1] = leaf_total(right);
+    return;
+  }
+
+  parent->counts[slot] += parent->counts[slot + 1];
+  internal_remove_at(parent, slot);
+  rebalance_internal(t, path, slots, t->height - 1);
+}
+
+// Restore minimum occupancy of internal nodes from the given level upwards,
+// collapsing the root once it is left with a single child
+static void rebalance_internal(bptree *t, bpt_internal **path, int *slots,
+                               int level) {
+  for (; level > 0; --level) {
+    bpt_internal *node = path[level];
+
+    if (node->num_keys >= INTERNAL_MIN) {
+      return;
+    }
+
+    bpt_internal *parent = path[level - 1];
+    int slot = slots[level - 1];
+
+    bpt_internal *left =
+        slot > 0 ? (bpt_internal *)parent->children[slot - 1] : NULL;
+    bpt_internal *right = slot < parent->num_keys
+                              ? (bpt_internal *)parent->children[slot + 1]
+                              : NULL;
+
+    if (left && left->num_keys > INTERNAL_MIN) {
+      // Rotate the left sibling's last child through the parent
+      long moved = left->counts[left->num_keys];
+
+      memmove(node->keys + 1, node->keys, node->num_keys * sizeof(value_t));
+      memmove(node->children + 1, node->children,
+              (node->num_keys + 1) * sizeof(void *));
+      memmove(node->counts + 1, node->counts,
+              (node->num_keys + 1) * sizeof(long));
+      node->keys[0] = parent->keys[slot - 1];
+      node->children[0] = left->children[left->num_keys];
+      node->counts[0] = moved;
+      ++node->num_keys;
+
+      parent->counts[slot - 1] -= moved;
+      parent->counts[slot] += moved;
+
+      parent->keys[slot - 1] = left->keys[left->num_keys - 1];
+      --left->num_keys;
+      return;
+    }
+
+    if (right && right->num_keys > INTERNAL_MIN) {
+      // Rotate the right sibling's first child through the parent
+      long moved = right->counts[0];
+
+      node->keys[node->num_keys] = parent->keys[slot];
+      node->children[node->num_keys + 1] = right->children[0];
+      node->counts[node->num_keys + 1] = moved;
+      ++node->num_keys;
+
+      parent->keys[slot] = right->keys[0];
+      parent->counts[slot] += moved;
+      parent->counts[slot + 1] -= moved;
+      memmove(right->keys, right->keys + 1,
+              (right->num_keys - 1) * sizeof(value_t));
+      memmove(right->children, right->children + 1,
+              right->num_keys * sizeof(void *));
+      memmove(right->counts, right->counts + 1,
+              right->num_keys * sizeof(long));
+      --right->num_keys;
+      return;
+    }
+
+    // Merge the right node into the left, pulling the separator down
+    if (!left) {
+      left = node;
+      node = right;
+      ++slot;
+    }
+
+    left->keys[left->num_keys] = parent->keys[slot - 1];
+    memcpy(left->keys + left->num_keys + 1, node->keys,
+           node->num_keys * sizeof(value_t));
+    memcpy(left->children + left->num_keys + 1, node->children,
+           (node->num_keys + 1) * sizeof(void *));
+    memcpy(left->counts + left->num_keys + 1, node->counts,
+           (node->num_keys + 1) * sizeof(long));
+    left->num_keys += node->num_keys + 1;
+
+    account_free(t->memory, MEMORY_INTERNALS, node);
+    --t->num_internals;
+
+    parent->counts[slot - 1] += parent->counts[slot];
+    internal_remove_at(parent, slot - 1);
+  }
+
+  bpt_internal *root = (bpt_internal *)t->root;
+  if (t->height > 0 && root->num_keys == 0) {
+    t->root = root->children[0];
+    account_free(t->memory, MEMORY_INTERNALS, root);
+    --t->num_internals;
+    --t->height;
+  }
+}
+
+// Decode entries up to the first one with key >= value
+static void leaf_locate(const bpt_leaf *leaf, value_t value,
+                        leaf_position *at) {
+  value_t key = leaf->first_key;
+  int offset = 0;
+
+  at->prev_key = key;
+  for (at->pos = 0; at->pos < leaf->num_keys; ++at->pos) {
+    int next = decode_entry(leaf->data, offset, &key, &at->count);
+
+    if (key >= value) {
+      at->key = key;
+      at->offset = offset;
+      at->size = next - offset;
+      return;
+    }
+
+    at->prev_key = key;
+    offset = next;
+  }
+
+  at->key = -1;
+  at->offset = offset;
+  at->size = 0;
+}
+
+// Add value to the block in place by re-encoding only the entries around it.
+// Returns the new count, or 0 leaving the leaf untouched if the block would
+// overflow
+static long leaf_insert(bpt_leaf *leaf, value_t value) {
+  leaf_position at;
+  uint8_t bytes[32];
+  int size;
+
+  leaf_locate(leaf, value, &at);
+
+  // Duplicates only bump the count of the existing pair
+  if (at.key == value) {
+    uint64_t delta = at.pos > 0 ? value - at.prev_key : 0;
+    size = encode_entry(bytes, delta, at.count + 1);
+    return leaf_splice(leaf, at.offset, at.size, bytes, size) ? at.count + 1
+                                                               : 0;
+  }
+
+  // New entry, whose successor now takes its delta from value
+  size = encode_entry(bytes, at.pos > 0 ? value - at.prev_key : 0, 1);
+  if (at.pos < leaf->num_keys) {
+    size += encode_entry(bytes + size, at.key - value, at.count);
+  }
+
+  if (!leaf_splice(leaf, at.offset, at.size, bytes, size)) {
+    return 0;
+  }
+
+  if (at.pos == 0) {
+    leaf->first_key = value;
+  }
+
+  if (at.pos == leaf->num_keys) {
+    leaf->last_key = value;
+  }
+
+  ++leaf->num_keys;
+  return 1;
+}
+
+// Remove one occurrence of value from the block in place, returns the
+// remaining count or -1 if value isn't stored. Dropping an entry or lowering a
+// count never grows the block
+static long leaf_remove(bpt_leaf *leaf, value_t value) {
+  leaf_position at;
+  uint8_t bytes[32];
+  uint64_t delta;
+  int size = 0;
+
+  if (leaf->num_keys == 0 || value < leaf->first_key ||
+      value > leaf->last_key) {
+    return -1;
+  }
+
+  leaf_locate(leaf, value, &at);
+
+  if (at.key != value) {
+    return -1;
+  }
+
+  delta = at.pos > 0 ? value - at.prev_key : 0;
+
+  if (at.count > 1) {
+    size = encode_entry(bytes, delta, at.count - 1);
+    leaf_splice(leaf, at.offset, at.size, bytes, size);
+    return at.count - 1;
+  }
+
+  // Merge the entry's delta into its successor, which may become first
+  if (at.pos + 1 < leaf->num_keys) {
+    value_t next_key = value;
+    long next_count;
+    int end = decode_entry(leaf->data, at.offset + at.size, &next_key,
+                           &next_count);
+
+    size = encode_entry(bytes, at.pos > 0 ? next_key - at.prev_key : 0,
+                        next_count);
+    leaf_splice(leaf, at.offset, end - at.offset, bytes, size);
+
+    if (at.pos == 0) {
+      leaf->first_key = next_key;
+    }
+  } else {
+    leaf_splice(leaf, at.offset, at.size, bytes, 0);
+    leaf->last_key = at.prev_key;
+  }
+
+  --leaf->num_keys;
+  if (leaf->num_keys == 0) {
+    leaf->first_key = leaf->last_key = 0;
+  }
+
+  return 0;
+}
+
+// Replace old_size bytes at offset with new bytes, shifting the rest of the
+// block. Returns false without changes if the block would overflow
+static bool leaf_splice(bpt_leaf *leaf, int offset, int old_size,
+                        const uint8_t *bytes, int new_size) {
+  int num_bytes = leaf->num_bytes - old_size + new_size;
+
+  if (num_bytes > LEAF_BYTES) {
+    return false;
+  }
+
+  memmove(leaf->data + offset + new_size, leaf->data + offset + old_size,
+          leaf->num_bytes - offset - old_size);
+  memcpy(leaf->data + offset, bytes, new_size);
+  leaf->num_bytes = num_bytes;
+
+  return true;
+}
+
+// Re-split the entries of two neighbouring leaves evenly by encoded size, or
+// merge them into the left leaf when they fit in one block. Returns true when
+// the right leaf was merged away and freed
+static bool redistribute_leaves(bptree *t, bpt_leaf *left, bpt_leaf *right) {
+  value_t keys[2 * MAX_LEAF_ENTRIES];
+  long counts[2 * MAX_LEAF_ENTRIES];
+
+  int num = leaf_decode(left, keys, counts);
+  num += leaf_decode(right, keys + num, counts + num);
+
+  if (encoded_size(keys, counts, num) <= LEAF_BYTES) {
+    leaf_encode(left, keys, counts, num);
+    unlink_leaf(t, right);
+    account_free(t->memory, MEMORY_LEAVES, right);
+    --t->num_leaves;
+    return true;
+  }
+
+  int split = split_point(keys, counts, num);
+  leaf_encode(left, keys, counts, split);
+  leaf_encode(right, keys + split, counts + split, num - split);
+
+  return false;
+}
+
+static void link_leaf_after(bptree *t, bpt_leaf *leaf, bpt_leaf *right) {
+  right->next = leaf->next;
+  right->prev = leaf;
+  if (leaf->next) {
+    leaf->next->prev = right;
+  } else {
+    t->tail = right;
+  }
+  leaf->next = right;
+}
+
+static void unlink_leaf(bptree *t, bpt_leaf *leaf) {
+  if (leaf->prev) {
+    leaf->prev->next = leaf->next;
+  } else {
+    t->head = leaf->next;
+  }
+
+  if (leaf->next) {
+    leaf->next->prev = leaf->prev;
+  } else {
+    t->tail = leaf->prev;
+  }
+}
+
+// Expand a leaf's block into parallel key and count arrays
+static int leaf_decode(const bpt_leaf *leaf, value_t *keys, long *counts) {
+  value_t key = leaf->first_key;
+  int offset = 0;
+
+  for (int i = 0; i < leaf->num_keys; ++i) {
+    offset = decode_entry(leaf->data, offset, &key, &counts[i]);
+    keys[i] = key;
+  }
+
+  return leaf->num_keys;
+}
+
+// Rewrite a leaf's block from sorted key and count arrays that are known to
+// fit within LEAF_BYTES
+static void leaf_encode(bpt_leaf *leaf, const value_t *keys, const long *counts,
+                        int num) {
+  int offset = 0;
+
+  for (int i = 0; i < num; ++i) {
+    uint64_t delta = i > 0 ? keys[i] - keys[i - 1] : 0;
+    offset += encode_entry(leaf->data + offset, delta, counts[i]);
+  }
+
+  leaf->num_keys = num;
+  leaf->num_bytes = offset;
+  leaf->first_key = num > 0 ? keys[0] : 0;
+  leaf->last_key = num > 0 ? keys[num - 1] : 0;
+}
+
+// Encode num of a bulk load's pairs starting at first, widening offsets and
+// counts collapsed in place into a leaf's worth of full ones
+static void leaf_encode_pairs(bpt_leaf *leaf, const pair_array *pairs,
+                              long first, int num) {
+  if (pairs->values) {
+    leaf_encode(leaf, pairs->values + first, pairs->counts + first, num);
+    return;
+  }
+
+  value_t keys[MAX_LEAF_ENTRIES];
+  long counts[MAX_LEAF_ENTRIES];
+
+  for (int i = 0; i < num; ++i) {
+    keys[i] = pair_value(pairs, first + i);
+    counts[i] = pair_count(pairs, first + i);
+  }
+
+  leaf_encode(leaf, keys, counts, num);
+}
+
+// Decode the entry at offset, adding its delta to key, and return the offset
+// of the following entry
+static int decode_entry(const uint8_t *data, int offset, value_t *key,
+                        long *count) {
+  uint64_t header, extra;
+
+  offset += varint_decode(data + offset, &header);
+  *key += (value_t)(header >> 1);
+  *count = 1;
+
+  if (header & 1) {
+    offset += varint_decode(data + offset, &extra);
+    *count = (long)extra + 1;
+  }
+
+  return offset;
+}
+
+static int encode_entry(uint8_t *out, uint64_t delta, long count) {
+  int size = varint_encode(out, (delta << 1) | (count > 1));
+  if (count > 1) {
+    size += varint_encode(out + size, count - 1);
+  }
+
+  return size;
+}
+
+static int entry_size(uint64_t delta, long count) {
+  int size = varint_size((delta << 1) | (count > 1));
+  if (count > 1) {
+    size += varint_size(count - 1);
+  }
+
+  return size;
+}
+
+static int encoded_size(const value_t *keys, const long *counts, int num) {
+  int size = 0;
+
+  for (int i = 0; i < num; ++i) {
+    size += entry_size(i > 0 ? keys[i] - keys[i - 1] : 0, counts[i]);
+  }
+
+  return size;
+}
+
+// Find the entry at which to split so both halves hold about half the bytes
+static int split_point(const value_t *keys, const long *counts, int num) {
+  int half = encoded_size(keys, counts, num) / 2;
+  int size = 0, split = 0;
+
+  while (split < num - 1 && size < half) {
+    size += entry_size(split > 0 ? keys[split] - keys[split - 1] : 0,
+                       counts[split]);
+    ++split;
+  }
+
+  return split > 0 ? split : 1;
+}
+
+static int varint_size(uint64_t value) {
+  int size = 1;
+
+  while (value >= 0x80) {
+    value >>= 7;
+    ++size;
+  }
+
+  return size;
+}
+
+// Write value as little-endian groups of 7 bits, high bit set on all but last
+static int varint_encode(uint8_t *out, uint64_t value) {
+  int size = 0;
+
+  while (value >= 0x80) {
+    out[size++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (uint8_t)value;
+
+  return size;
+}
+
+static int varint_decode(const uint8_t *in, uint64_t *value) {
+  uint64_t result = in[0] & 0x7f;
+  int size = 1;
+
+  while (in[size - 1] & 0x80) {
+    result |= (uint64_t)(in[size] & 0x7f) << (7 * size);
+    ++size;
+  }
+
+  *value = result;
+  return size;
+}
+
+// Remove keys[pos] and the child to its right from an internal node, along
+// with the child's count
+static void internal_remove_at(bpt_internal *node, int pos) {
+  memmove(node->keys + pos, node->keys + pos + 1,
+          (node->num_keys - pos - 1) * sizeof(value_t));
+  memmove(node->children + pos + 1, node->children + pos + 2,
+          (node->num_keys - pos - 1) * sizeof(void *));
+  memmove(node->counts + pos + 1, node->counts + pos + 2,
+          (node->num_keys - pos - 1) * sizeof(long));
+  --node->num_keys;
+}
+
+static void free_tree_node(bptree *t, void *node, int height) {
+  if (height > 0) {
+    bpt_internal *internal = (bpt_internal *)node;
+    for (int i = 0; i <= internal->num_keys; ++i) {
+      free_tree_node(t, internal->children[i], height - 1);
+    }
+  }
+
+  account_free(t->memory, height > 0 ? MEMORY_INTERNALS : MEMORY_LEAVES, node);
+}
+
+static void free_tree(bptree *t) {
+  if (t->root && t->root != &empty_leaf) {
+    free_tree_node(t, t->root, t->height);
+  }
+
+  t->root = NULL;
+  t->head = t->tail = NULL;
+  t->height = 0;
+  t->num_leaves = t->num_internals = 0;
+}
+
+//////////////////////
+// SEARCH FUNCTIONS //
+//////////////////////
+
+// Function to pick the fastest search kernels the CPU supports, no faster
+// than search_limit
+static void init_search() {
+  search_kernels = SCALAR_SEARCH;
+
+#ifdef SEARCH_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+    search_kernels = SSE_SEARCH;
+  }
+
+  if (search_kernels == SSE_SEARCH && __builtin_cpu_supports("avx2")) {
+    search_kernels = AVX2_SEARCH;
+  }
+#endif
+
+  if (search_kernels > search_limit) {
+    search_kernels = search_limit;
+  }
+}
+
+// Function to find the first index holding a key >= value. The range is
+// halved without branches until SEARCH_WINDOW keys are left, so there are no
+// mispredicted jumps, and the window is then compared in whole vectors
+static int lower_bound(const int *keys, int num_keys, int value) {
+  const int *base = keys;
+  int num = num_keys;
+
+  if (num < SEARCH_WINDOW) {
+    return count_below(keys, num, value);
+  }
+
+  while (num > SEARCH_WINDOW) {
+    int half = num / 2;
+    base = base[half] < value ? base + half : base;
+    num -= half;
+  }
+
+  // Widen what's left to a full window, which still holds the answer
+  if (base > keys + num_keys - SEARCH_WINDOW) {
+    base = keys + num_keys - SEARCH_WINDOW;
+  }
+
+  return (int)(base - keys) + count_below(base, SEARCH_WINDOW, value);
+}
+
+// Function to find the first index holding a key > value
+static int upper_bound(const int *keys, int num_keys, int value) {
+  if (value == INT_MAX) {
+    return num_keys;
+  }
+
+  return lower_bound(keys, num_keys, value + 1);
+}
+
+// Function to find the first index holding a 64-bit key >= value
+static int lower_bound64(const value_t *keys, int num_keys, value_t value) {
+  const value_t *base = keys;
+  int num = num_keys;
+
+  if (num < SEARCH_WINDOW) {
+    return count_below64(keys, num, value);
+  }
+
+  while (num > SEARCH_WINDOW) {
+    int half = num / 2;
+    base = base[half] < value ? base + half : base;
+    num -= half;
+  }
+
+  // Widen what's left to a full window, which still holds the answer
+  if (base > keys + num_keys - SEARCH_WINDOW) {
+    base = keys + num_keys - SEARCH_WINDOW;
+  }
+
+  return (int)(base - keys) + count_below64(base, SEARCH_WINDOW, value);
+}
+
+// Function to find the first index holding a 64-bit key > value
+static int upper_bound64(const value_t *keys, int num_keys, value_t value) {
+  if (value == INT64_MAX) {
+    return num_keys;
+  }
+
+  return lower_bound64(keys, num_keys, value + 1);
+}
+
+// Utility function to count the keys below value
+static int count_below(const int *keys, int num_keys, int value) {
+#ifdef SEARCH_X86
+  if (search_kernels == AVX2_SEARCH) {
+    return count_below_avx2(keys, num_keys, value);
+  } else if (search_kernels == SSE_SEARCH) {
+    return count_below_sse(keys, num_keys, value);
+  }
+#endif
+
+  int count = 0;
+
+  for (int i = 0; i < num_keys; ++i) {
+    count += keys[i] < value;
+  }
+
+  return count;
+}
+
+// Utility function to count the 64-bit keys below value
+static int count_below64(const value_t *keys, int num_keys, value_t value) {
+#ifdef SEARCH_X86
+  if (search_kernels == AVX2_SEARCH) {
+    return count_below64_avx2(keys, num_keys, value);
+  } else if (search_kernels == SSE_SEARCH) {
+    return count_below64_sse(keys, num_keys, value);
+  }
+#endif
+
+  int count = 0;
+
+  for (int i = 0; i < num_keys; ++i) {
+    count += keys[i] < value;
+  }
+
+  return count;
+}
+
+// Utility function to find the first non-zero count in [from, to), or to if
+// there is none
+static int next_nonzero(const int *counts, int from, int to) {
+#ifdef SEARCH_X86
+  if (search_kernels == AVX2_SEARCH) {
+    return next_nonzero_avx2(counts, from, to);
+  }
+#endif
+
+  while (from < to && counts[from] == 0) {
+    ++from;
+  }
+
+  return from;
+}
+
+// Utility function to find the last non-zero count at or before from, or -1
+// if there is none
+static int prev_nonzero(const int *counts, int from) {
+#ifdef SEARCH_X86
+  if (search_kernels == AVX2_SEARCH) {
+    return prev_nonzero_avx2(counts, from);
+  }
+#endif
+
+  while (from >= 0 && counts[from] == 0) {
+    --from;
+  }
+
+  return from;
+}
+
+#ifdef SEARCH_X86
+// Kernels for SSE4.2 and AVX2 are compiled whatever the build flags and only
+// called once init_search has found the instructions. Each compares a vector
+// of keys at a time, and popcounts the mask of lanes below value
+__attribute__((target("sse4.2,popcnt"))) int count_below_sse(const int *keys,
+                                                              int num_keys,
+                                                              int value) {
+  __m128i target = _mm_set1_epi32(value);
+  int count = 0, i = 0;
+
+  for (; i + 4 <= num_keys; i += 4) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+    __m128i below = _mm_cmpgt_epi32(target, block);
+    count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(below)));
+  }
+
+  for (; i < num_keys; ++i) {
+    count += keys[i] < value;
+  }
+
+  return count;
+}
+
+__attribute__((target("avx2,popcnt"))) int count_below_avx2(const int *keys,
+                                                             int num_keys,
+                                                             int value) {
+  __m256i target = _mm256_set1_epi32(value);
+  int count = 0, i = 0;
+
+  for (; i + 8 <= num_keys; i += 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+    __m256i below = _mm256_cmpgt_epi32(target, block);
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(below)));
+  }
+
+  for (; i < num_keys; ++i) {
+    count += keys[i] < value;
+  }
+
+  return count;
+}
+
+__attribute__((target("sse4.2,popcnt"))) int count_below64_sse(
+    const value_t *keys, int num_keys, value_t value) {
+  __m128i target = _mm_set1_epi64x(value);
+  int count = 0, i = 0;
+
+  for (; i + 2 <= num_keys; i += 2) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+    __m128i below = _mm_cmpgt_epi64(target, block);
+    count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(below)));
+  }
+
+  for (; i < num_keys; ++i) {
+    count += keys[i] < value;
+  }
+
+  return count;
+}
+
+__attribute__((target("avx2,popcnt"))) int count_below64_avx2(
+    const value_t *keys, int num_keys, value_t value) {
+  __m256i target = _mm256_set1_epi64x(value);
+  int count = 0, i = 0;
+
+  for (; i + 4 <= num_keys; i += 4) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+    __m256i below = _mm256_cmpgt_epi64(target, block);
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(below)));
+  }
+
+  for (; i < num_keys; ++i) {
+    count += keys[i] < value;
+  }
+
+  return count;
+}
+
+// Gaps are skipped eight counts at a time, taking the lowest or highest lane
+// that isn't zero
+__attribute__((target("avx2"))) int next_nonzero_avx2(const int *counts,
+                                                      int from, int to) {
+  __m256i zero = _mm256_setzero_si256();
+
+  for (; from + 8 <= to; from += 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(counts + from));
+    int empty = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(block, zero)));
+
+    if (empty != 0xFF) {
+      return from + __builtin_ctz(~empty & 0xFF);
+    }
+  }
+
+  while (from < to && counts[from] == 0) {
+    ++from;
+  }
+
+  return from;
+}
+
+__attribute__((target("avx2"))) int prev_nonzero_avx2(const int *counts,
+                                                      int from) {
+  __m256i zero = _mm256_setzero_si256();
+
+  for (; from >= 7; from -= 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(counts + from - 7));
+    int empty = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(block, zero)));
+
+    if (empty != 0xFF) {
+      return from - 7 + 31 - __builtin_clz(~empty & 0xFF);
+    }
+  }
+
+  while (from >= 0 && counts[from] == 0) {
+    --from;
+  }
+
+  return from;
+}
+#endif
+
+//////////////////////
+// MEMORY FUNCTIONS //
+//////////////////////
+
+// Allocate bytes charged to kind, zeroed if asked. Returns NULL when out of
+// memory, leaving the caller to report what for
+static void *account_alloc(memory_account *m, memory_kind kind, size_t bytes,
+                           bool zeroed) {
+  void *block = zeroed ? calloc(1, bytes) : malloc(bytes);
+
+  if (block) {
+    account_change(m, kind, block_bytes(block), 1);
+  }
+
+  return block;
+}
+
+// Allocate bytes charged to kind, starting on a cache line
+static void *account_aligned(memory_account *m, memory_kind kind,
+                             size_t bytes) {
+  void *block = aligned_alloc(CACHE_LINE_SIZE, bytes);
+
+  if (block) {
+    account_change(m, kind, block_bytes(block), 1);
+  }
+
+  return block;
+}
+
+// Resize a block charged to kind, moving the charge along with it. The old
+// block is left charged if it couldn't be resized
+static void *account_realloc(memory_account *m, memory_kind kind, void *block,
+                             size_t bytes) {
+  long before = block ? (long)block_bytes(block) : 0;
+  void *resized = realloc(block, bytes);
+
+  if (resized) {
+    account_change(m, kind, (long)block_bytes(resized) - before, block ? 0 : 1);
+  }
+
+  return resized;
+}
+
+static void account_free(memory_account *m, memory_kind kind, void *block) {
+  if (block) {
+    account_change(m, kind, -(long)block_bytes(block), -1);
+    free(block);
+  }
+}
+
+// Move kind's totals by bytes and blocks, raising the peak if the set has
+// never held more
+static void account_change(memory_account *m, memory_kind kind, long bytes,
+                           long blocks) {
+  atomic_fetch_add_explicit(&m->bytes[kind], bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->blocks[kind], blocks, memory_order_relaxed);
+
+  long total =
+      atomic_fetch_add_explicit(&m->total, bytes, memory_order_relaxed) +
+      bytes;
+  long peak = atomic_load_explicit(&m->peak, memory_order_relaxed);
+
+  while (total > peak &&
+         !atomic_compare_exchange_weak_explicit(
+             &m->peak, &peak, total, memory_order_relaxed,
+             memory_order_relaxed)) {
+  }
+}
+
+// Utility function to find what a heap block really takes, its usable size
+// rounded up by the allocator plus its header
+static size_t block_bytes(void *block) {
+  return malloc_usable_size(block) + MALLOC_HEADER_BYTES;
+}
+
+// Allocate an array of bytes charged to kind, zeroed if asked. Large arrays
+// are mapped on their own pages, so random probes into them miss the TLB
+// less once huge pages back them, and smaller ones come from the heap.
+// Returns NULL when out of memory. Freed with page_free
+static void *page_alloc(memory_account *m, memory_kind kind, size_t bytes,
+                        bool zeroed) {
+  size_t needed = sizeof(page_header) + bytes;
+  page_header *header;
+
+  if (needed < LARGE_ARRAY_BYTES) {
+    header = (page_header *)account_aligned(
+        m, kind,
+        (needed + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+
+    if (!header) {
+      return NULL;
+    }
+
+    if (zeroed) {
+      memset(header + 1, 0, bytes);
+    }
+
+    header->length = 0;
+    return header + 1;
+  }
+
+  // Fresh anonymous pages are already zeroed
+  header = map_pages(needed);
+
+  if (!header) {
+    return NULL;
+  }
+
+  account_change(m, kind, header->length, 1);
+  atomic_fetch_add_explicit(&m->page_bytes[header->pages], header->length,
+                            memory_order_relaxed);
+
+  return header + 1;
+}
+
+// Map at least bytes with the largest pages page_limit allows and the system
+// gives, interleaving them over the NUMA nodes when asked. Reserved huge
+// pages are taken from the hugetlbfs pool and fail when it is empty.
+// Transparent huge pages are asked for on a region aligned to a huge page,
+// which the kernel fills with them as they are touched. Base pages are kept
+// from being merged into huge ones, so the two can be compared
+static page_header *map_pages(size_t bytes) {
+  size_t length = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES *
+                  HUGE_PAGE_BYTES;
+  int protection = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  page_policy pages = page_limit;
+  uint8_t *base = MAP_FAILED;
+
+  if (pages == HUGE_PAGES) {
+    base = (uint8_t *)mmap(NULL, length, protection, flags | MAP_HUGETLB, -1,
+                           0);
+    pages = base == MAP_FAILED ? TRANSPARENT_PAGES : HUGE_PAGES;
+  }
+
+  // Over map by a huge page, then trim both ends to align the region
+  if (pages == TRANSPARENT_PAGES) {
+    uint8_t *region = (uint8_t *)mmap(NULL, length + HUGE_PAGE_BYTES,
+                                      protection, flags, -1, 0);
+
+    if (region == MAP_FAILED) {
+      return NULL;
+    }
+
+    base = (uint8_t *)(((uintptr_t)region + HUGE_PAGE_BYTES - 1) /
+                       HUGE_PAGE_BYTES * HUGE_PAGE_BYTES);
+
+    if (base > region) {
+      munmap(region, base - region);
+    }
+
+    if (base + length < region + length + HUGE_PAGE_BYTES) {
+      munmap(base + length, region + HUGE_PAGE_BYTES - base);
+    }
+
+    if (madvise(base, length, MADV_HUGEPAGE) != 0) {
+      pages = BASE_PAGES;
+    }
+  } else if (pages == BASE_PAGES) {
+    length = (bytes + sysconf(_SC_PAGESIZE) - 1) / sysconf(_SC_PAGESIZE) *
+             sysconf(_SC_PAGESIZE);
+    base = (uint8_t *)mmap(NULL, length, protection, flags, -1, 0);
+
+    if (base == MAP_FAILED) {
+      return NULL;
+    }
+
+    madvise(base, length, MADV_NOHUGEPAGE);
+  }
+
+  pthread_once(&numa_once, init_numa);
+
+  // Before any page is touched, so none is placed first. A policy the kernel
+  // refuses just leaves the pages where they are first touched
+  if (page_interleave && numa_nodes > 1) {
+    syscall(SYS_mbind, base, length, MPOL_INTERLEAVE, &numa_mask,
+            MAX_NUMA_NODES + 1, 0);
+  }
+
+  page_header *header = (page_header *)base;
+  header->length = length;
+  header->pages = pages;
+
+  return header;
+}
+
+static void page_free(memory_account *m, memory_kind kind, void *array) {
+  if (!array) {
+    return;
+  }
+
+  page_header *header = (page_header *)array - 1;
+
+  if (header->length == 0) {
+    account_free(m, kind, header);
+    return;
+  }
+
+  account_change(m, kind, -(long)header->length, -1);
+  atomic_fetch_sub_explicit(&m->page_bytes[header->pages], header->length,
+                            memory_order_relaxed);
+  munmap(header, header->length);
+}
+
+// Utility function to read the online NUMA nodes, written as ranges such as
+// 0-3,6. Systems without the file have a single node
+static void init_numa() {
+  FILE *file = fopen("/sys/devices/system/node/online", "r");
+  int first, last;
+  char separator;
+
+  numa_mask = 1;
+  numa_nodes = 1;
+
+  if (!file) {
+    return;
+  }
+
+  numa_mask = 0;
+  numa_nodes = 0;
+
+  while (fscanf(file, "%d", &first) == 1) {
+    last = first;
+
+    if (fscanf(file, "%c", &separator) == 1 && separator == '-') {
+      if (fscanf(file, "%d", &last) != 1) {
+        break;
+      }
+      separator = ',';
+      if (fscanf(file, "%c", &separator) != 1) {
+        separator = '\n';
+      }
+    }
+
+    for (int node = first; node <= last && node < MAX_NUMA_NODES; ++node) {
+      numa_mask |= 1UL << node;
+      ++numa_nodes;
+    }
+
+    if (separator != ',') {
+      break;
+    }
+  }
+
+  fclose(file);
+
+  if (numa_nodes == 0) {
+    numa_mask = 1;
+    numa_nodes = 1;
+  }
+}
+
+///////////////////////
+// UTILITY FUNCTIONS //
+///////////////////////
+
+// Utility function to read a monotonic wall clock in seconds, which unlike
+// clock() stays meaningful while several threads are running
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Utility function to read the same clock in whole nanoseconds, for timing
+// single operations without floating point rounding
+static uint64_t now_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Utility function to record why a call is about to fail, for multiset_error
+// to give back
+static void set_error(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(error_message, sizeof(error_message), format, args);
+  va_end(args);
+}
@@ -0,0 +1,163 @@
+// Programming Fundamentals - High Performant Custom Data Structures
+// Designed and developed by Kobi Chambers - Griffith University
+
+#ifndef MULTISET_H
+#define MULTISET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Multiset of 64-bit numbers in [r1, r2], split into shards that each pick a
+// dense, run-length or B+-tree layout as their numbers change. Every set is
+// reached through its own handle, so any number of them can live side by side.
+// Operations on one set are safe from several threads at once, except that
+// loads, saves and destroys need the set to themselves. Nothing is printed and
+// the process is never ended, calls that fail say so through their result and
+// multiset_error
+
+// Numbers are 64-bit. Dense counters and run lists index them by their 32-bit
+// offset from the first value of their shard, and B+-tree leaves only store
+// the gaps between them, so narrow ranges take no more memory for it
+typedef int64_t value_t;
+
+typedef struct multiset multiset;
+
+// Layout currently holding a shard's numbers
+typedef enum { DENSE_MODE, RUNS_MODE, TREE_MODE } storage_mode;
+
+// What a set's heap allocations hold, as broken down in multiset_stats
+typedef enum {
+  MEMORY_COUNTERS,   // Dense counters
+  MEMORY_OVERFLOW,   // Tables of saturated counters
+  MEMORY_BITMAP,     // Occupancy bitmaps over the counters
+  MEMORY_BLOCKS,     // Fenwick block indexes
+  MEMORY_RUNS,       // Run list slots
+  MEMORY_LEAVES,     // B+-tree leaves
+  MEMORY_INTERNALS,  // B+-tree internal nodes
+  MEMORY_SHARDS,     // The set itself and its shards
+  MEMORY_SCRATCH,    // Buffers held during loads, batches and migrations
+  NUM_MEMORY_KINDS
+} memory_kind;
+
+// Pages backing the arrays of 2 MB and up: dense counters, bitmaps, block
+// indexes and load buffers
+typedef enum { BASE_PAGES, TRANSPARENT_PAGES, HUGE_PAGES } page_policy;
+
+// Callback for multiset_iterate_range, given each distinct value and its count
+typedef void (*range_callback)(value_t value, long count, void *context);
+
+// Find (0), add (1) or delete (2) queued in a batch. result is filled in once
+// the batch has been applied, and is -1 for adds that failed
+typedef struct {
+  int type;
+  value_t value;
+  long result;
+} batch_op;
+
+// Numbers for a bulk load, either an array of int32_t or, when wide, int64_t
+// numbers used where they lie, or a fill callback when numbers is NULL. Each
+// load thread calls fill for consecutive slices of its share, passing its
+// thread number and the position of the slice's first number
+typedef struct {
+  const void *numbers;
+  bool wide;
+  void (*fill)(void *context, int thread, long first, long count,
+               value_t *values);
+  void *context;
+} multiset_source;
+
+// Migration of one shard between two layouts, kept for the stats output
+typedef struct {
+  int shard;
+  storage_mode from, to;
+  long op;                // Adds and deletes applied to the shard before it
+  long stored, distinct;  // Numbers moved and slots they occupied
+  double seconds;
+} migration_record;
+
+// Totals over every shard of a set
+typedef struct {
+  int num_shards;
+  int mode_counts[3];  // Shards in each storage_mode
+  long num_stored, num_distinct;
+  size_t bytes;         // Bytes the layouts reserve, mapped ones included
+  size_t slack_bytes;   // Part of bytes holding no numbers
+  size_t mapped_bytes;  // Snapshot mapping the set was restored from
+
+  // Heap held for each memory_kind as the allocator sees it, rounding and
+  // block headers included, and the most the set has held at once
+  size_t heap_bytes[NUM_MEMORY_KINDS];
+  long heap_blocks[NUM_MEMORY_KINDS];
+  size_t heap_total, heap_peak;
+  size_t page_bytes[3];  // Large arrays on each page_policy, after fallbacks
+  long run_slots, run_gaps;
+  long compaction_passes, compaction_steps;
+  uint64_t compaction_nanos;
+  int num_migrations;  // Including any past the records kept
+} multiset_stats;
+
+// Why the last call on this thread that failed did so, as a sentence ready to
+// print
+const char *multiset_error();
+
+// Create an empty set over [r1, r2] split into about num_shards shards,
+// NULL if the range isn't valid or memory ran out
+multiset *multiset_create(value_t r1, value_t r2, int num_shards);
+void multiset_destroy(multiset *set);
+
+// Replace the set's numbers with n numbers from source, using num_threads
+// threads. Fails, leaving the set empty, if any number is outside [r1, r2] or
+// memory runs out
+bool multiset_load(multiset *set, const multiset_source *source, long n,
+                   int num_threads);
+
+// Write the set to a snapshot at path, or map one back in as a new set whose
+// shards are used from the mapping until they are written to
+bool multiset_save(const multiset *set, const char *path, size_t *bytes);
+multiset *multiset_restore(const char *path, int num_threads);
+
+// Only values in [r1, r2] can be stored. Finds and deletes of values outside
+// it return 0, and adds of them fail
+long multiset_find(multiset *set, value_t value);
+
+// Returns 1, or -1 leaving the set as it was if value is outside [r1, r2] or
+// memory ran out
+int multiset_add(multiset *set, value_t value);
+int multiset_delete(multiset *set, value_t value);
+value_t multiset_pred(multiset *set, value_t value);
+value_t multiset_succ(multiset *set, value_t value);
+value_t multiset_min(multiset *set);
+value_t multiset_max(multiset *set);
+
+long multiset_count_range(multiset *set, value_t first, value_t last);
+long multiset_iterate_range(multiset *set, value_t first, value_t last,
+                            range_callback callback, void *context);
+long multiset_rank(multiset *set, value_t value);
+value_t multiset_select(multiset *set, long k);
+
+// Answers each operation as the single calls would. Returns false if any add
+// failed
+bool multiset_apply_batch(multiset *set, batch_op *ops, int num_ops);
+
+void multiset_bounds(const multiset *set, value_t *r1, value_t *r2);
+void multiset_get_stats(const multiset *set, multiset_stats *stats);
+int multiset_migrations(const multiset *set,
+                        const migration_record **records);
+
+// Cap the search kernels shared by every set at scalar, sse4.2 or avx2, and
+// name the ones in use
+bool multiset_limit_search(const char *name);
+const char *multiset_search_name();
+
+// Back large arrays allocated from now on, by any set, with base pages,
+// transparent huge pages or reserved huge pages. Each falls back to the next
+// smaller pages when the larger can't be had. Interleaved arrays are spread
+// page by page over every NUMA node rather than placed on the node of the
+// thread first touching each page
+bool multiset_use_pages(const char *name);
+void multiset_interleave_pages(bool interleave);
+const char *multiset_pages_name();
+int multiset_numa_nodes();
+
+#endif
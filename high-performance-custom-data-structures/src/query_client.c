@@ -0,0 +1,471 @@
+// Programming Fundamentals - High Performant Custom Data Structures
+// Designed and developed by Kobi Chambers - Griffith University
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "query_server.h"
+
+// Define globals
+// Replies in flight on one connection are kept well under what the server
+// buffers for it, so neither end can block writing while the other does
+#define MAX_OPS_IN_FLIGHT 65536
+
+// State of one connection's load thread. Send times are kept per slot of the
+// pipeline, and round trips per packet
+typedef struct {
+  pthread_t thread;
+  int id;
+  uint64_t random;
+  long num_packets;
+  uint64_t *sent;
+  uint64_t *round_trips;
+} client;
+
+// Server to load and the range its values are drawn from
+const char *socket_path;
+int64_t r1, r2;
+
+// Load settings. Each connection keeps depth packets of batch_size operations
+// in flight, drawn with operation_weights in find, add, delete, succ, pred,
+// min, max order
+int num_connections = 1;
+int depth = 16;
+int batch_size = 64;
+long num_operations = 1000000;
+int random_seed = 1;
+bool stop_server;
+int operation_weights[7] = {1, 1, 1, 1, 1, 1, 1};
+int operation_total = 7;
+
+// Function prototypes
+bool process_arguments(int argc, char *argv[]);
+bool process_option(const char *name, const char *value);
+
+void *run_client(void *arg);
+int connect_server();
+void send_packet(client *c, int fd, uint32_t tag, unsigned char *packet);
+bool receive_reply(int fd, uint32_t tag, unsigned char *reply);
+void send_stop();
+void send_all(int fd, const unsigned char *data, size_t bytes);
+bool receive_all(int fd, unsigned char *data, size_t bytes);
+
+void print_round_trips(client *clients, double seconds);
+int compare_round_trips(const void *a, const void *b);
+bool is_valid_int(const char *str);
+uint64_t next_random(uint64_t *state);
+uint64_t now_nanos();
+
+////////////////////////////////
+// MAIN AND UTILITY FUNCTIONS //
+////////////////////////////////
+
+int main(int argc, char *argv[]) {
+  if (!process_arguments(argc, argv)) {
+    return 1;
+  }
+
+  client *clients = (client *)calloc(num_connections, sizeof(client));
+  long num_packets = (num_operations + batch_size - 1) / batch_size;
+
+  if (!clients) {
+    printf("Failed to allocate memory for load threads.\n");
+    return 1;
+  }
+
+  uint64_t start = now_nanos();
+
+  for (int i = 0; i < num_connections; ++i) {
+    client *c = &clients[i];
+    c->id = i;
+    c->random = (uint64_t)random_seed << 32 | i;
+    c->num_packets =
+        num_packets / num_connections + (i < num_packets % num_connections);
+
+    if (pthread_create(&c->thread, NULL, run_client, c)) {
+      printf("Failed to start load thread.\n");
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < num_connections; ++i) {
+    pthread_join(clients[i].thread, NULL);
+  }
+
+  double seconds = (now_nanos() - start) / 1e9;
+  print_round_trips(clients, seconds);
+
+  if (stop_server) {
+    send_stop();
+  }
+
+  for (int i = 0; i < num_connections; ++i) {
+    free(clients[i].sent);
+    free(clients[i].round_trips);
+  }
+  free(clients);
+
+  return 0;
+}
+
+// Function to process user input arguments and perform error checking
+bool process_arguments(int argc, char *argv[]) {
+  if (argc < 4 || argc % 2 != 0) {
+    printf(
+        "Format as: ./query_client <socket> <r1> <r2> [--connections <c>] "
+        "[--depth <d>] [--batch <b>] [--ops <k>] "
+        "[--mix <balanced|read-heavy|write-heavy>] [--seed <s>] "
+        "[--stop <yes|no>]\n");
+    return false;
+  }
+
+  if (!is_valid_int(argv[2]) || !is_valid_int(argv[3])) {
+    printf("Error for input (r1, r2): should be positive integer values.\n");
+    return false;
+  }
+
+  socket_path = argv[1];
+  r1 = strtoll(argv[2], NULL, 10);
+  r2 = strtoll(argv[3], NULL, 10);
+
+  if (r1 < 1 || r1 >= r2) {
+    printf("Error: r2 should be greater than r1, and r1 positive.\n");
+    return false;
+  }
+
+  for (int i = 4; i < argc; i += 2) {
+    if (!process_option(argv[i], argv[i + 1])) {
+      return false;
+    }
+  }
+
+  if (batch_size > QUERY_MAX_OPS) {
+    printf("Error for option --batch: should be at most %d.\n",
+           QUERY_MAX_OPS);
+    return false;
+  }
+
+  if ((long)depth * batch_size > MAX_OPS_IN_FLIGHT) {
+    printf("Error: --depth times --batch should be at most %d.\n",
+           MAX_OPS_IN_FLIGHT);
+    return false;
+  }
+
+  return true;
+}
+
+// Function to check and apply a single --name value option
+bool process_option(const char *name, const char *value) {
+  int *setting;
+
+  if (strcmp(name, "--mix") == 0) {
+    const char *presets[] = {"balanced", "read-heavy", "write-heavy"};
+    const int preset_weights[][7] = {{1, 1, 1, 1, 1, 1, 1},
+                                     {80, 5, 5, 4, 4, 1, 1},
+                                     {10, 40, 40, 4, 4, 1, 1}};
+
+    for (int i = 0; i < 3; ++i) {
+      if (strcmp(value, presets[i]) == 0) {
+        memcpy(operation_weights, preset_weights[i],
+               sizeof(operation_weights));
+        operation_total = 0;
+
+        for (int j = 0; j < 7; ++j) {
+          operation_total += operation_weights[j];
+        }
+        return true;
+      }
+    }
+
+    printf(
+        "Error for option --mix: should be balanced, read-heavy or "
+        "write-heavy.\n");
+    return false;
+  }
+
+  if (strcmp(name, "--stop") == 0) {
+    if (strcmp(value, "yes") != 0 && strcmp(value, "no") != 0) {
+      printf("Error for option --stop: should be yes or no.\n");
+      return false;
+    }
+
+    stop_server = strcmp(value, "yes") == 0;
+    return true;
+  }
+
+  if (strcmp(name, "--ops") == 0) {
+    if (!is_valid_int(value) || strtol(value, NULL, 10) < 1) {
+      printf("Error for option --ops: should be a positive integer value.\n");
+      return false;
+    }
+
+    num_operations = strtol(value, NULL, 10);
+    return true;
+  }
+
+  if (strcmp(name, "--connections") == 0) {
+    setting = &num_connections;
+  } else if (strcmp(name, "--depth") == 0) {
+    setting = &depth;
+  } else if (strcmp(name, "--batch") == 0) {
+    setting = &batch_size;
+  } else if (strcmp(name, "--seed") == 0) {
+    setting = &random_seed;
+  } else {
+    printf("Error: unknown option %s.\n", name);
+    return false;
+  }
+
+  if (!is_valid_int(value) || strtol(value, NULL, 10) < 1) {
+    printf("Error for option %s: should be a positive integer value.\n",
+           name);
+    return false;
+  }
+
+  *setting = (int)strtol(value, NULL, 10);
+  return true;
+}
+
+//////////////////////
+// CLIENT FUNCTIONS //
+//////////////////////
+
+// Function run by each connection's load thread. Packets are sent until
+// depth of them are waiting, then each reply that comes back makes room for
+// the next, so the pipeline stays full until the last packets drain
+void *run_client(void *arg) {
+  client *c = (client *)arg;
+  size_t packet_bytes = QUERY_HEADER_BYTES + batch_size * QUERY_OP_BYTES;
+  size_t reply_bytes = QUERY_HEADER_BYTES + batch_size * QUERY_RESULT_BYTES;
+  unsigned char *packet = (unsigned char *)malloc(packet_bytes);
+  unsigned char *reply = (unsigned char *)malloc(reply_bytes);
+
+  c->sent = (uint64_t *)malloc(depth * sizeof(uint64_t));
+  c->round_trips = (uint64_t *)malloc((c->num_packets + 1) * sizeof(uint64_t));
+
+  if (!packet || !reply || !c->sent || !c->round_trips) {
+    printf("Failed to allocate memory for load thread.\n");
+    exit(1);
+  }
+
+  int fd = connect_server();
+  long num_sent = 0, num_received = 0;
+
+  while (num_received < c->num_packets) {
+    while (num_sent < c->num_packets && num_sent - num_received < depth) {
+      send_packet(c, fd, (uint32_t)num_sent, packet);
+      ++num_sent;
+    }
+
+    if (!receive_reply(fd, (uint32_t)num_received, reply)) {
+      printf("Error: connection %d lost its reply to packet %ld.\n", c->id,
+             num_received);
+      exit(1);
+    }
+
+    c->round_trips[num_received] = now_nanos() - c->sent[num_received % depth];
+    ++num_received;
+  }
+
+  close(fd);
+  free(packet);
+  free(reply);
+
+  return NULL;
+}
+
+// Connect to the server's socket, exiting if it isn't there
+int connect_server() {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    printf("Error: could not connect to %s (%s).\n", socket_path,
+           strerror(errno));
+    exit(1);
+  }
+
+  return fd;
+}
+
+// Draw a packet of batch_size operations and send it, noting when
+void send_packet(client *c, int fd, uint32_t tag, unsigned char *packet) {
+  query_header header = {batch_size, tag};
+
+  memcpy(packet, &header, sizeof(header));
+
+  for (int i = 0; i < batch_size; ++i) {
+    unsigned char *op = packet + QUERY_HEADER_BYTES + i * QUERY_OP_BYTES;
+    int draw = next_random(&c->random) % operation_total;
+    int opcode = 0;
+
+    while (draw >= operation_weights[opcode]) {
+      draw -= operation_weights[opcode++];
+    }
+
+    int64_t value = r1 + next_random(&c->random) % (uint64_t)(r2 - r1 + 1);
+    op[0] = (unsigned char)opcode;
+    memcpy(op + 1, &value, sizeof(value));
+  }
+
+  c->sent[tag % depth] = now_nanos();
+  send_all(fd, packet, QUERY_HEADER_BYTES + batch_size * QUERY_OP_BYTES);
+}
+
+// Read one whole reply, checking it answers the packet with the given tag
+bool receive_reply(int fd, uint32_t tag, unsigned char *reply) {
+  query_header header;
+
+  if (!receive_all(fd, reply,
+                   QUERY_HEADER_BYTES + batch_size * QUERY_RESULT_BYTES)) {
+    return false;
+  }
+
+  memcpy(&header, reply, sizeof(header));
+  return header.tag == tag && header.num_ops == (uint32_t)batch_size;
+}
+
+// Ask the server to shut down over a connection of its own
+void send_stop() {
+  unsigned char packet[QUERY_HEADER_BYTES + QUERY_OP_BYTES] = {0};
+  unsigned char reply[QUERY_HEADER_BYTES + QUERY_RESULT_BYTES];
+  query_header header = {1, 0};
+  int fd = connect_server();
+
+  memcpy(packet, &header, sizeof(header));
+  packet[QUERY_HEADER_BYTES] = QUERY_STOP;
+  send_all(fd, packet, sizeof(packet));
+
+  if (!receive_all(fd, reply, sizeof(reply))) {
+    printf("Error: the server didn't answer the stop.\n");
+  }
+
+  close(fd);
+}
+
+void send_all(int fd, const unsigned char *data, size_t bytes) {
+  while (bytes > 0) {
+    ssize_t sent = send(fd, data, bytes, MSG_NOSIGNAL);
+
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (sent <= 0) {
+      printf("Error: could not send to %s (%s).\n", socket_path,
+             strerror(errno));
+      exit(1);
+    }
+
+    data += sent;
+    bytes -= sent;
+  }
+}
+
+bool receive_all(int fd, unsigned char *data, size_t bytes) {
+  while (bytes > 0) {
+    ssize_t received = read(fd, data, bytes);
+
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (received <= 0) {
+      return false;
+    }
+
+    data += received;
+    bytes -= received;
+  }
+
+  return true;
+}
+
+// Function to print the throughput over every connection and the round trip
+// percentiles of their packets, in nanoseconds
+void print_round_trips(client *clients, double seconds) {
+  long total = 0;
+
+  for (int i = 0; i < num_connections; ++i) {
+    total += clients[i].num_packets;
+  }
+
+  uint64_t *round_trips = (uint64_t *)malloc((total + 1) * sizeof(uint64_t));
+
+  if (!round_trips) {
+    printf("Failed to allocate memory for round trips.\n");
+    exit(1);
+  }
+
+  long count = 0;
+
+  for (int i = 0; i < num_connections; ++i) {
+    memcpy(round_trips + count, clients[i].round_trips,
+           clients[i].num_packets * sizeof(uint64_t));
+    count += clients[i].num_packets;
+  }
+
+  qsort(round_trips, count, sizeof(uint64_t), compare_round_trips);
+
+  printf(
+      "%d connections, %d packets deep, %d ops per packet: %ld ops in %f s, "
+      "%.0f ops/sec\n",
+      num_connections, depth, batch_size, count * batch_size, seconds,
+      count * batch_size / seconds);
+  printf(
+      "Round trip ns   p50      p90      p99      p999     max\n"
+      "%-15s %-8" PRIu64 " %-8" PRIu64 " %-8" PRIu64 " %-8" PRIu64
+      " %" PRIu64 "\n",
+      "packet", round_trips[count / 2], round_trips[count * 9 / 10],
+      round_trips[count * 99 / 100], round_trips[count * 999 / 1000],
+      round_trips[count - 1]);
+
+  free(round_trips);
+}
+
+int compare_round_trips(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Utility function to check a string only holds digits
+bool is_valid_int(const char *str) {
+  if (*str == '\0') {
+    return false;
+  }
+
+  for (const char *c = str; *c; ++c) {
+    if (*c < '0' || *c > '9') {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// splitmix64, which is plenty for drawing load
+uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+uint64_t now_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,731 @@
+// Programming Fundamentals - High Performant Custom Data Structures
+// Designed and developed by Kobi Chambers - Griffith University
+
+// accept4 and pipe2 are Linux extensions
+#define _GNU_SOURCE
+
+#include "query_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Define globals
+#define MAX_EVENTS 64
+#define LISTEN_BACKLOG 128
+
+// Connections read QUERY_READ_BYTES at a time, and stop reading while more
+// than QUERY_OUTPUT_LIMIT bytes of replies are waiting to be sent, so a client
+// that never reads can't make the server buffer without bound
+#define QUERY_READ_BYTES (64 * 1024)
+#define QUERY_OUTPUT_LIMIT (1 << 20)
+#define QUERY_PACKET_BYTES (QUERY_HEADER_BYTES + QUERY_MAX_OPS * QUERY_OP_BYTES)
+
+// One client connection, owned by a single worker. Input holds bytes read but
+// not yet run, output replies not yet sent from output_start on
+typedef struct {
+  int fd;
+  int slot;  // Position in its worker's connection list
+  uint32_t events;
+  bool stop_requested;
+  bool rejected;  // Sent an error reply, closes once it has gone out
+  unsigned char *input;
+  size_t input_length, input_capacity;
+  unsigned char *output;
+  size_t output_start, output_length, output_capacity;
+} connection;
+
+typedef struct query_server query_server;
+
+// Worker thread with its own epoll instance. The accepting thread hands it
+// new connections through handoff, so every connection is only ever touched
+// by the worker it was handed to
+typedef struct {
+  pthread_t thread;
+  query_server *server;
+  int epoll_fd;
+  int handoff[2];
+  connection **connections;
+  int num_connections, connections_capacity;
+  batch_op *batch;
+  int *batch_slots;
+  long packets, operations;
+} query_worker;
+
+struct query_server {
+  multiset *set;
+  value_t r1, r2;
+  int stop_fd;  // eventfd every epoll instance watches, written to stop
+  atomic_bool failed;  // Set by a worker that ran out of memory
+  query_worker *workers;
+  int num_workers;
+};
+
+// Function prototypes
+static bool open_socket(const char *socket_path, int *listen_fd);
+static void accept_connections(query_server *server, int listen_fd,
+                               int *next_worker, long *connections);
+static void request_stop(query_server *server);
+static void fail_server(query_server *server, const char *message);
+
+static bool start_worker(query_server *server, query_worker *w);
+static void free_worker(query_worker *w);
+static void *run_query_worker(void *arg);
+static bool adopt_connection(query_worker *w, int fd);
+static void close_connection(query_worker *w, connection *c);
+static bool serve_connection(query_worker *w, connection *c);
+static bool read_input(query_worker *w, connection *c);
+static bool run_packets(query_worker *w, connection *c);
+static bool run_packet(query_worker *w, connection *c,
+                       const unsigned char *ops, uint32_t num_ops,
+                       uint32_t tag);
+static bool reject_packet(query_worker *w, connection *c, uint32_t tag);
+static void flush_batch(query_worker *w, unsigned char *results,
+                        int num_pending);
+static int64_t run_operation(query_worker *w, connection *c, int opcode,
+                             value_t value);
+static bool write_output(connection *c);
+static void update_events(query_worker *w, connection *c);
+
+static bool reserve(unsigned char **buffer, size_t *capacity, size_t needed);
+static void put_result(unsigned char *results, int slot, int64_t result);
+static double now_seconds();
+
+//////////////////////
+// SERVER FUNCTIONS //
+//////////////////////
+
+// Function to serve the set until a client asks the server to stop or it is
+// interrupted. The calling thread accepts connections and hands them out to
+// the workers in turn, which run their packets and send back the replies
+bool query_serve(multiset *set, const char *socket_path, int num_workers,
+                 query_stats *stats) {
+  query_server server = {set, 0, 0, -1, false, NULL, num_workers};
+  int listen_fd;
+
+  multiset_bounds(set, &server.r1, &server.r2);
+  memset(stats, 0, sizeof(query_stats));
+
+  if (!open_socket(socket_path, &listen_fd)) {
+    return false;
+  }
+
+  // SIGINT and SIGTERM are taken through a signalfd on the accepting thread,
+  // so block them before the workers start and inherit the mask. Replies are
+  // sent with MSG_NOSIGNAL, so a client that has gone never raises SIGPIPE
+  sigset_t signals, previous;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  server.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server.workers = (query_worker *)calloc(num_workers, sizeof(query_worker));
+  bool ready = true;
+
+  if (signal_fd < 0 || epoll_fd < 0 || server.stop_fd < 0) {
+    printf("Error: could not set up the server's event loop.\n");
+    ready = false;
+  } else if (!server.workers) {
+    printf("Failed to allocate memory for server workers.\n");
+    ready = false;
+  }
+
+  if (ready) {
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+    event.data.fd = server.stop_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.stop_fd, &event);
+  }
+
+  double start = now_seconds();
+  int num_started = 0;
+
+  while (ready && num_started < num_workers) {
+    ready = start_worker(&server, &server.workers[num_started]);
+    num_started += ready;
+  }
+
+  // The stop eventfd is never read, so once written it stays readable and
+  // every epoll instance watching it wakes up and leaves its loop
+  int next_worker = 0;
+  bool running = ready;
+
+  while (running) {
+    struct epoll_event events[3];
+    int num_events = epoll_wait(epoll_fd, events, 3, -1);
+
+    for (int i = 0; i < num_events; ++i) {
+      if (events[i].data.fd == listen_fd) {
+        accept_connections(&server, listen_fd, &next_worker,
+                           &stats->connections);
+        continue;
+      }
+
+      // Take the signal, so it isn't delivered once the mask is restored
+      if (events[i].data.fd == signal_fd) {
+        struct signalfd_siginfo info;
+
+        if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+          continue;
+        }
+      }
+
+      running = false;
+    }
+  }
+
+  // Workers already started are stopped the same way whether the server ran
+  // or a later one failed to start
+  if (num_started > 0) {
+    request_stop(&server);
+  }
+  stats->seconds = now_seconds() - start;
+
+  for (int i = 0; i < num_started; ++i) {
+    query_worker *w = &server.workers[i];
+    pthread_join(w->thread, NULL);
+
+    stats->packets += w->packets;
+    stats->operations += w->operations;
+    free_worker(w);
+  }
+
+  close(listen_fd);
+  unlink(socket_path);
+
+  if (signal_fd >= 0) {
+    close(signal_fd);
+  }
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+  }
+  if (server.stop_fd >= 0) {
+    close(server.stop_fd);
+  }
+
+  free(server.workers);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  return ready && !atomic_load(&server.failed);
+}
+
+// Utility function to bind a listening socket at socket_path, replacing a
+// socket left there by an earlier server but never any other kind of file
+static bool open_socket(const char *socket_path, int *listen_fd) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  struct stat info;
+
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Error: socket path %s is too long.\n", socket_path);
+    return false;
+  }
+
+  if (lstat(socket_path, &info) == 0) {
+    if (!S_ISSOCK(info.st_mode)) {
+      printf("Error: %s exists and is not a socket.\n", socket_path);
+      return false;
+    }
+    unlink(socket_path);
+  }
+
+  strcpy(address.sun_path, socket_path);
+  *listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (*listen_fd < 0 ||
+      bind(*listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(*listen_fd, LISTEN_BACKLOG) != 0) {
+    printf("Error: could not listen on %s (%s).\n", socket_path,
+           strerror(errno));
+
+    if (*listen_fd >= 0) {
+      close(*listen_fd);
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// Accept every pending connection and hand each to the next worker in turn
+static void accept_connections(query_server *server, int listen_fd,
+                               int *next_worker, long *connections) {
+  int fd;
+
+  while ((fd = accept4(listen_fd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    query_worker *w = &server->workers[*next_worker];
+
+    // Pipe writes of an int are atomic, and the worker reads them whole
+    if (write(w->handoff[1], &fd, sizeof(fd)) != sizeof(fd)) {
+      close(fd);
+      continue;
+    }
+
+    *next_worker = (*next_worker + 1) % server->num_workers;
+    ++*connections;
+  }
+}
+
+// Wake every epoll instance watching the stop eventfd. The write only fails
+// once the counter would pass 2^64 - 2, and each stop adds just one to it
+static void request_stop(query_server *server) {
+  uint64_t one = 1;
+  ssize_t written = write(server->stop_fd, &one, sizeof(one));
+  (void)written;
+}
+
+// Stop every worker after one ran out of memory, so query_serve returns false
+// once they have all closed their connections
+static void fail_server(query_server *server, const char *message) {
+  printf("%s\n", message);
+  atomic_store(&server->failed, true);
+  request_stop(server);
+}
+
+//////////////////////
+// WORKER FUNCTIONS //
+//////////////////////
+
+// Set up a worker's epoll instance, handoff pipe and batch and start its
+// thread. Returns false, with nothing left open, if any of them fails
+static bool start_worker(query_server *server, query_worker *w) {
+  w->server = server;
+  w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  w->handoff[0] = w->handoff[1] = -1;
+  w->batch = (batch_op *)malloc(QUERY_MAX_OPS * sizeof(batch_op));
+  w->batch_slots = (int *)malloc(QUERY_MAX_OPS * sizeof(int));
+
+  if (!w->batch || !w->batch_slots) {
+    printf("Failed to allocate memory for server workers.\n");
+    free_worker(w);
+    return false;
+  }
+
+  if (w->epoll_fd < 0 || pipe2(w->handoff, O_CLOEXEC) != 0) {
+    printf("Error: could not set up the server's event loop.\n");
+    free_worker(w);
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN};
+  event.data.ptr = w->handoff;
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->handoff[0], &event);
+  event.data.ptr = &server->stop_fd;
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, server->stop_fd, &event);
+
+  if (pthread_create(&w->thread, NULL, run_query_worker, w)) {
+    printf("Failed to start server worker thread.\n");
+    free_worker(w);
+    return false;
+  }
+
+  return true;
+}
+
+static void free_worker(query_worker *w) {
+  if (w->epoll_fd >= 0) {
+    close(w->epoll_fd);
+  }
+  if (w->handoff[0] >= 0) {
+    close(w->handoff[0]);
+    close(w->handoff[1]);
+  }
+
+  free(w->batch);
+  free(w->batch_slots);
+}
+
+// Function run by each server worker. Connections are level triggered, so a
+// connection that still has input or output waiting comes back on the next
+// epoll_wait without being tracked here
+static void *run_query_worker(void *arg) {
+  query_worker *w = (query_worker *)arg;
+  bool running = true;
+
+  while (running) {
+    struct epoll_event events[MAX_EVENTS];
+    int num_events = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+
+    for (int i = 0; i < num_events; ++i) {
+      void *source = events[i].data.ptr;
+
+      if (source == &w->server->stop_fd) {
+        running = false;
+      } else if (source == w->handoff) {
+        int fd;
+
+        if (read(w->handoff[0], &fd, sizeof(fd)) == sizeof(fd) &&
+            !adopt_connection(w, fd)) {
+          fail_server(w->server, "Failed to allocate memory for connection.");
+        }
+      } else if (!serve_connection(w, (connection *)source)) {
+        close_connection(w, (connection *)source);
+      }
+    }
+  }
+
+  while (w->num_connections > 0) {
+    close_connection(w, w->connections[w->num_connections - 1]);
+  }
+
+  free(w->connections);
+  return NULL;
+}
+
+// Register a connection handed over by the accepting thread, closing it and
+// returning false if there is no memory to track it
+static bool adopt_connection(query_worker *w, int fd) {
+  connection *c = (connection *)calloc(1, sizeof(connection));
+
+  if (c && w->num_connections == w->connections_capacity) {
+    int capacity = w->connections_capacity ? 2 * w->connections_capacity : 16;
+    connection **grown = (connection **)realloc(
+        w->connections, capacity * sizeof(connection *));
+
+    if (grown) {
+      w->connections = grown;
+      w->connections_capacity = capacity;
+    } else {
+      free(c);
+      c = NULL;
+    }
+  }
+
+  if (!c) {
+    close(fd);
+    return false;
+  }
+
+  c->fd = fd;
+  c->slot = w->num_connections;
+  c->events = EPOLLIN;
+  w->connections[w->num_connections++] = c;
+
+  struct epoll_event event = {.events = c->events};
+  event.data.ptr = c;
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  return true;
+}
+
+// Close a connection, dropping any replies it hadn't taken yet
+static void close_connection(query_worker *w, connection *c) {
+  connection *last = w->connections[--w->num_connections];
+
+  last->slot = c->slot;
+  w->connections[c->slot] = last;
+
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c->input);
+  free(c->output);
+  free(c);
+}
+
+// Read what the client has sent, run every whole packet in it and send as
+// many replies as the socket takes. False once the connection is finished
+static bool serve_connection(query_worker *w, connection *c) {
+  if (!c->rejected && c->output_length - c->output_start < QUERY_OUTPUT_LIMIT &&
+      (!read_input(w, c) || !run_packets(w, c))) {
+    return false;
+  }
+
+  if (!write_output(c)) {
+    return false;
+  }
+
+  // Nothing after a rejected packet can be framed, so close once the error
+  // reply has gone out
+  if (c->rejected && c->output_start == c->output_length) {
+    return false;
+  }
+
+  // A stop is only passed on once its reply has gone out
+  if (c->stop_requested && c->output_start == c->output_length) {
+    request_stop(w->server);
+    c->stop_requested = false;
+  }
+
+  update_events(w, c);
+  return true;
+}
+
+// Read until the socket has nothing more, false if the client has gone or
+// memory ran out
+static bool read_input(query_worker *w, connection *c) {
+  while (true) {
+    if (!reserve(&c->input, &c->input_capacity,
+                 c->input_length + QUERY_READ_BYTES)) {
+      fail_server(w->server,
+                  "Failed to allocate memory for connection buffer.");
+      return false;
+    }
+
+    ssize_t bytes = read(c->fd, c->input + c->input_length, QUERY_READ_BYTES);
+
+    if (bytes > 0) {
+      c->input_length += bytes;
+    } else if (bytes == 0) {
+      return false;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    } else if (errno != EINTR) {
+      return false;
+    }
+
+    // Leave the rest for the next wakeup once a full packet is waiting
+    if (c->input_length >= QUERY_PACKET_BYTES) {
+      return true;
+    }
+  }
+}
+
+// Run every whole packet at the start of the input, keeping any partial one
+// for the next read. A packet claiming more than QUERY_MAX_OPS gets an error
+// reply and ends the input. False if memory ran out for a reply
+static bool run_packets(query_worker *w, connection *c) {
+  size_t position = 0;
+
+  // Drop replies already sent so the output only holds what is waiting
+  if (c->output_start > 0) {
+    memmove(c->output, c->output + c->output_start,
+            c->output_length - c->output_start);
+    c->output_length -= c->output_start;
+    c->output_start = 0;
+  }
+
+  while (c->input_length - position >= QUERY_HEADER_BYTES) {
+    query_header header;
+    memcpy(&header, c->input + position, sizeof(header));
+
+    if (header.num_ops > QUERY_MAX_OPS) {
+      c->input_length = 0;
+      return reject_packet(w, c, header.tag);
+    }
+
+    size_t bytes = QUERY_HEADER_BYTES + (size_t)header.num_ops * QUERY_OP_BYTES;
+
+    if (c->input_length - position < bytes) {
+      break;
+    }
+
+    if (!run_packet(w, c, c->input + position + QUERY_HEADER_BYTES,
+                    header.num_ops, header.tag)) {
+      return false;
+    }
+    position += bytes;
+  }
+
+  memmove(c->input, c->input + position, c->input_length - position);
+  c->input_length -= position;
+
+  return true;
+}
+
+// Run one packet and append its reply to the output. Consecutive finds, adds
+// and deletes are gathered into one batch, and the batch is applied before
+// any other operation so every operation sees the ones before it. False if
+// memory ran out for the reply
+static bool run_packet(query_worker *w, connection *c,
+                       const unsigned char *ops, uint32_t num_ops,
+                       uint32_t tag) {
+  query_header header = {num_ops, tag};
+  size_t bytes = QUERY_HEADER_BYTES + (size_t)num_ops * QUERY_RESULT_BYTES;
+
+  if (!reserve(&c->output, &c->output_capacity, c->output_length + bytes)) {
+    fail_server(w->server, "Failed to allocate memory for connection buffer.");
+    return false;
+  }
+
+  unsigned char *results = c->output + c->output_length + QUERY_HEADER_BYTES;
+  int num_pending = 0;
+
+  memcpy(c->output + c->output_length, &header, sizeof(header));
+  c->output_length += bytes;
+
+  for (uint32_t i = 0; i < num_ops; ++i) {
+    int opcode = ops[i * QUERY_OP_BYTES];
+    value_t value;
+    memcpy(&value, ops + i * QUERY_OP_BYTES + 1, sizeof(value));
+
+    // Values outside the set can't be stored, so answer them here
+    if (opcode <= QUERY_DELETE && (value < w->server->r1 ||
+                                   value > w->server->r2)) {
+      put_result(results, i, opcode == QUERY_ADD ? -1 : 0);
+    } else if (opcode <= QUERY_DELETE) {
+      w->batch[num_pending].type = opcode;
+      w->batch[num_pending].value = value;
+      w->batch_slots[num_pending++] = i;
+    } else {
+      flush_batch(w, results, num_pending);
+      num_pending = 0;
+      put_result(results, i, run_operation(w, c, opcode, value));
+    }
+  }
+
+  flush_batch(w, results, num_pending);
+
+  ++w->packets;
+  w->operations += num_ops;
+  return true;
+}
+
+// Append the error reply for a packet claiming too many operations, a header
+// with QUERY_REJECTED in place of the count and no results
+static bool reject_packet(query_worker *w, connection *c, uint32_t tag) {
+  query_header header = {QUERY_REJECTED, tag};
+
+  if (!reserve(&c->output, &c->output_capacity,
+               c->output_length + QUERY_HEADER_BYTES)) {
+    fail_server(w->server, "Failed to allocate memory for connection buffer.");
+    return false;
+  }
+
+  memcpy(c->output + c->output_length, &header, sizeof(header));
+  c->output_length += QUERY_HEADER_BYTES;
+  c->rejected = true;
+  return true;
+}
+
+// Apply the gathered finds, adds and deletes and put their results in place.
+// A lone operation skips the sort a batch needs
+static void flush_batch(query_worker *w, unsigned char *results,
+                        int num_pending) {
+  if (num_pending == 1) {
+    w->batch[0].result =
+        run_operation(w, NULL, w->batch[0].type, w->batch[0].value);
+  } else if (num_pending > 1) {
+    // Adds that ran out of memory already carry -1 as their reply
+    multiset_apply_batch(w->server->set, w->batch, num_pending);
+  }
+
+  for (int i = 0; i < num_pending; ++i) {
+    put_result(results, w->batch_slots[i], w->batch[i].result);
+  }
+}
+
+static int64_t run_operation(query_worker *w, connection *c, int opcode,
+                             value_t value) {
+  multiset *set = w->server->set;
+
+  switch (opcode) {
+    case QUERY_FIND:
+      return multiset_find(set, value);
+
+    case QUERY_ADD:
+      return multiset_add(set, value);
+
+    case QUERY_DELETE:
+      return multiset_delete(set, value);
+
+    case QUERY_SUCC:
+      return multiset_succ(set, value);
+
+    case QUERY_PRED:
+      return multiset_pred(set, value);
+
+    case QUERY_MIN:
+      return multiset_min(set);
+
+    case QUERY_MAX:
+      return multiset_max(set);
+
+    case QUERY_STOP:
+      c->stop_requested = true;
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+// Send replies until they are all out or the socket is full, false if the
+// client has gone
+static bool write_output(connection *c) {
+  while (c->output_start < c->output_length) {
+    ssize_t bytes = send(c->fd, c->output + c->output_start,
+                         c->output_length - c->output_start, MSG_NOSIGNAL);
+
+    if (bytes > 0) {
+      c->output_start += bytes;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    } else if (errno != EINTR) {
+      return false;
+    }
+  }
+
+  c->output_start = c->output_length = 0;
+  return true;
+}
+
+// Watch for output space while replies are waiting, and stop watching for
+// input while too many are
+static void update_events(query_worker *w, connection *c) {
+  size_t waiting = c->output_length - c->output_start;
+  uint32_t events = (waiting < QUERY_OUTPUT_LIMIT ? EPOLLIN : 0) |
+                    (waiting > 0 ? EPOLLOUT : 0);
+
+  if (events != c->events) {
+    struct epoll_event event = {.events = events};
+    event.data.ptr = c;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+    c->events = events;
+  }
+}
+
+///////////////////////
+// UTILITY FUNCTIONS //
+///////////////////////
+
+// Utility function to grow a buffer to hold at least needed bytes, false
+// leaving it as it was if there is no memory for that
+static bool reserve(unsigned char **buffer, size_t *capacity, size_t needed) {
+  if (needed <= *capacity) {
+    return true;
+  }
+
+  size_t grown = *capacity ? *capacity : QUERY_READ_BYTES;
+
+  while (grown < needed) {
+    grown *= 2;
+  }
+
+  unsigned char *resized = (unsigned char *)realloc(*buffer, grown);
+
+  if (!resized) {
+    return false;
+  }
+
+  *buffer = resized;
+  *capacity = grown;
+  return true;
+}
+
+static void put_result(unsigned char *results, int slot, int64_t result) {
+  memcpy(results + (size_t)slot * QUERY_RESULT_BYTES, &result, sizeof(result));
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
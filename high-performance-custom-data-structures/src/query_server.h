@@ -0,0 +1,63 @@
+// Programming Fundamentals - High Performant Custom Data Structures
+// Designed and developed by Kobi Chambers - Griffith University
+
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "multiset.h"
+
+// Wire format spoken over the server's Unix socket, in host byte order since
+// both ends share a machine. A request packet is a query_header followed by
+// num_ops operations of QUERY_OP_BYTES each: a one byte opcode, then the value
+// as an unaligned int64_t. The reply is a query_header with the same num_ops
+// and tag, followed by one int64_t result per operation, in request order.
+// Clients may send any number of packets before reading replies, which come
+// back in the order sent. A packet claiming more than QUERY_MAX_OPS operations
+// is answered with QUERY_REJECTED as the count, its tag and no results, and
+// the connection is closed since nothing after it can be framed
+#define QUERY_HEADER_BYTES 8
+#define QUERY_OP_BYTES 9
+#define QUERY_RESULT_BYTES 8
+#define QUERY_MAX_OPS 4096
+#define QUERY_REJECTED UINT32_MAX
+
+// Opcodes follow the benchmark's operation order. Finds answer with the
+// count, adds and deletes with 1 if the set changed (-1 for an add outside
+// [r1, r2] or one the server had no memory for), and succ, pred, min and max
+// with the value found or -1. A stop answers 0 and shuts the server down once
+// every reply has been sent
+typedef enum {
+  QUERY_FIND,
+  QUERY_ADD,
+  QUERY_DELETE,
+  QUERY_SUCC,
+  QUERY_PRED,
+  QUERY_MIN,
+  QUERY_MAX,
+  QUERY_STOP
+} query_opcode;
+
+typedef struct {
+  uint32_t num_ops;
+  uint32_t tag;  // Chosen by the client and echoed back with the reply
+} query_header;
+
+// Totals over one run of the server
+typedef struct {
+  long connections;
+  long packets;
+  long operations;
+  double seconds;
+} query_stats;
+
+// Serve set at socket_path with num_workers worker threads until a client
+// sends a stop or the process gets SIGINT or SIGTERM. False if the server
+// couldn't be set up or a worker ran out of memory, after every worker has
+// shut down and closed its connections
+bool query_serve(multiset *set, const char *socket_path, int num_workers,
+                 query_stats *stats);
+
+#endif
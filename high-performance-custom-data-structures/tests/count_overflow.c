@@ -0,0 +1,221 @@
+// Drives a single value's count past INT_MAX in each storage layout and checks
+// every operation still sees the full count, including after a snapshot round
+// trip. Run lists only go as far as INT_MAX before moving to dense counters.
+// Build and run from the project directory with:
+//   gcc -O2 -pthread -Isrc -o count_overflow tests/count_overflow.c
+//       src/multiset.c -lm && ./count_overflow
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "multiset.h"
+
+// Copies of the hot value, just past what an int can count
+#define HOT_COUNT ((long)INT_MAX + 10)
+
+// Pages of ones mapped over and over to make up a source array of HOT_COUNT
+// numbers without holding 8 GB of them
+#define SOURCE_CHUNK_BYTES (64L << 20)
+
+static int failures;
+
+#define CHECK(condition)                                                  \
+  do {                                                                    \
+    if (!(condition)) {                                                   \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      ++failures;                                                         \
+    }                                                                     \
+  } while (0)
+
+////////////////////
+// TEST FUNCTIONS //
+////////////////////
+
+// Fill callback giving HOT_COUNT ones followed by two twos
+static void fill_hot(void *context, int thread, long first, long count,
+                     value_t *values) {
+  (void)context;
+  (void)thread;
+
+  for (long i = 0; i < count; ++i) {
+    values[i] = first + i < HOT_COUNT ? 1 : 2;
+  }
+}
+
+// Utility function to total the counts iterate_range hands over
+static void sum_counts(value_t value, long count, void *context) {
+  (void)value;
+  *(long *)context += count;
+}
+
+// Check the set holds hot copies of 1 and extra copies of 2, then add and
+// delete across the old int limit
+static void check_hot(multiset *set, long hot, long extra) {
+  value_t r1, r2;
+  multiset_bounds(set, &r1, &r2);
+
+  CHECK(multiset_find(set, 1) == hot);
+  CHECK(multiset_find(set, 2) == extra);
+  CHECK(multiset_min(set) == 1);
+  CHECK(multiset_max(set) == (extra ? 2 : 1));
+  CHECK(multiset_count_range(set, r1, r2) == hot + extra);
+  CHECK(multiset_rank(set, 2) == hot);
+  CHECK(multiset_select(set, hot - 1) == 1);
+  CHECK(multiset_select(set, hot) == (extra ? 2 : -1));
+
+  long total = 0;
+  multiset_iterate_range(set, r1, r2, sum_counts, &total);
+  CHECK(total == hot + extra);
+
+  CHECK(multiset_add(set, 1) == 1);
+  CHECK(multiset_find(set, 1) == hot + 1);
+  CHECK(multiset_delete(set, 1) == 1);
+  CHECK(multiset_delete(set, 1) == 1);
+  CHECK(multiset_find(set, 1) == hot - 1);
+  CHECK(multiset_add(set, 1) == 1);
+
+  batch_op ops[2] = {{0, 1, 0}, {0, 2, 0}};
+  multiset_apply_batch(set, ops, 2);
+  CHECK(ops[0].result == hot);
+  CHECK(ops[1].result == extra);
+}
+
+// Check a snapshot of the set keeps the hot count
+static void check_snapshot(multiset *set, long hot, long extra) {
+  char path[] = "/tmp/count_overflow_XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0) {
+    printf("Could not create a snapshot file.\n");
+    ++failures;
+    return;
+  }
+  close(fd);
+
+  size_t bytes;
+  CHECK(multiset_save(set, path, &bytes));
+
+  multiset *restored = multiset_restore(path, 1);
+  CHECK(restored != NULL);
+
+  if (restored) {
+    check_hot(restored, hot, extra);
+    multiset_destroy(restored);
+  }
+
+  unlink(path);
+}
+
+// Map the same chunk of int32_t ones end to end until it covers num numbers,
+// returning NULL if the address space can't be had
+static const int32_t *map_ones(long num, size_t *bytes) {
+  size_t chunk = SOURCE_CHUNK_BYTES;
+  *bytes = (num * sizeof(int32_t) + chunk - 1) / chunk * chunk;
+
+  int fd = memfd_create("count_overflow", 0);
+  if (fd < 0 || ftruncate(fd, chunk) != 0) {
+    return NULL;
+  }
+
+  int32_t *ones = (int32_t *)mmap(NULL, chunk, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+  uint8_t *base = (uint8_t *)mmap(NULL, *bytes, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                  -1, 0);
+
+  if (ones == MAP_FAILED || base == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < chunk / sizeof(int32_t); ++i) {
+    ones[i] = 1;
+  }
+  munmap(ones, chunk);
+
+  for (size_t offset = 0; offset < *bytes; offset += chunk) {
+    if (mmap(base + offset, chunk, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) ==
+        MAP_FAILED) {
+      munmap(base, *bytes);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  close(fd);
+  return (const int32_t *)base;
+}
+
+// Dense counters: the hot bucket lives in the overflow table, loaded through
+// per-thread histograms
+static void test_dense() {
+  multiset *set = multiset_create(1, 2, 1);
+  multiset_source source = {NULL, false, fill_hot, NULL};
+
+  CHECK(multiset_load(set, &source, HOT_COUNT + 2, 2));
+  check_hot(set, HOT_COUNT, 2);
+  check_snapshot(set, HOT_COUNT, 2);
+
+  multiset_destroy(set);
+}
+
+// B+-trees and run lists, bulk loaded from sorted source numbers
+static void test_sparse(const int32_t *ones) {
+  multiset_source source = {ones, false, NULL, NULL};
+  multiset_stats stats;
+
+  multiset *tree = multiset_create(1, 1L << 33, 1);
+  CHECK(multiset_load(tree, &source, HOT_COUNT, 1));
+  multiset_get_stats(tree, &stats);
+  CHECK(stats.mode_counts[TREE_MODE] == 1);
+  check_hot(tree, HOT_COUNT, 0);
+  check_snapshot(tree, HOT_COUNT, 0);
+  multiset_destroy(tree);
+
+  // Shards narrow enough for run lists, with more values than numbers so the
+  // load doesn't count them densely. A list holds at most INT_MAX numbers,
+  // so the next add moves it to dense counters
+  multiset *runs = multiset_create(1, 1L << 32, 1 << 16);
+  CHECK(multiset_load(runs, &source, INT_MAX - 1, 1));
+
+  batch_op add = {1, 1, 0};
+  multiset_apply_batch(runs, &add, 1);
+  multiset_get_stats(runs, &stats);
+  CHECK(stats.mode_counts[RUNS_MODE] == 1 << 16);
+  CHECK(multiset_find(runs, 1) == INT_MAX);
+
+  check_snapshot(runs, INT_MAX, 0);
+  check_hot(runs, INT_MAX, 0);
+  multiset_get_stats(runs, &stats);
+  CHECK(stats.mode_counts[DENSE_MODE] == 1);
+  multiset_destroy(runs);
+}
+
+int main() {
+  test_dense();
+
+  size_t bytes;
+  const int32_t *ones = map_ones(HOT_COUNT, &bytes);
+
+  if (!ones) {
+    printf("Could not map the source numbers.\n");
+    return 1;
+  }
+
+  test_sparse(ones);
+  munmap((void *)ones, bytes);
+
+  if (failures) {
+    printf("count_overflow: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("count_overflow: all checks passed\n");
+  return 0;
+}
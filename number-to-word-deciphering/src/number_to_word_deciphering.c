@@ -4,6 +4,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,15 +13,40 @@
 #define MAX_WORD_LEN 50
 #define NUM_CAPITALS 26
 #define NUM_DIGITS 10
+#define END_OF_WORD_BIT (1u << NUM_CAPITALS)
 
 #define CHAR_TO_DIGIT(c) ((int)(c - '0'))
 #define CHAR_TO_ALPHA_INDEX(c) ((int)(c - 'A'))
 
-typedef struct trie_node {
-  struct trie_node *children[NUM_CAPITALS];
+// Dictionary words are inserted into nodes held in one growable arena and
+// addressed by index. The root is node 0, so a child index of 0 means none
+typedef struct {
+  uint32_t children[NUM_CAPITALS];
   bool is_end;
 } trie_node;
 
+typedef struct {
+  trie_node *nodes;
+  int count;
+  int capacity;
+} trie_arena;
+
+// Once read, the trie is flattened in breadth-first order into 8 byte nodes,
+// so the top levels every search walks share a few cache lines. Bit i of a
+// node's mask is set when it has a child for letter i, and END_OF_WORD_BIT
+// when a word ends there. Its children are stored together in letter order
+// from first_child, so the child for letter i is found by counting the bits
+// below i
+typedef struct {
+  uint32_t mask;
+  uint32_t first_child;
+} flat_node;
+
+typedef struct {
+  flat_node *nodes;
+  int count;
+} flat_trie;
+
 typedef struct {
   int number;
   int counts[NUM_DIGITS];
@@ -33,7 +59,8 @@ typedef struct {
 } word_number_array;
 
 // Define global variables
-trie_node *root;
+trie_arena arena;
+flat_trie trie;
 word_number_array number_array;
 
 char assignments[NUM_DIGITS];
@@ -49,9 +76,11 @@ void process_arguments(int argc, char *argv[]);
 void execute();
 void assign_letters(char *number, int index);
 
-trie_node *create_node(void);
-void trie_insert(trie_node *root, const char *key);
-bool trie_search(trie_node *root, const char *key, bool full_word);
+void init_trie_arena(int initial_capacity);
+uint32_t create_node(void);
+void trie_insert(const char *key);
+void flatten_trie();
+bool trie_search(const flat_trie *t, const char *key, bool full_word);
 
 void init_word_number_array(int initial_capacity);
 void insert_word_number_array(int number);
@@ -60,8 +89,9 @@ void read_words(const char *dict_filename);
 
 int compare_word_numbers(const void *a, const void *b);
 unsigned long long calculate_permutations();
+int count_bits(uint32_t bits);
 
-void free_trie(trie_node *node);
+void free_trie();
 void free_word_number_array();
 void clean_up();
 
@@ -176,7 +206,7 @@ void assign_letters(char *number, int index) {
 
     word[index] = '\0';
 
-    if (trie_search(root, word, true)) {
+    if (trie_search(&trie, word, true)) {
       num_solutions++;
     }
 
@@ -192,7 +222,7 @@ void assign_letters(char *number, int index) {
   }
   partial_word[index] = '\0';
 
-  if (index > 1 && !trie_search(root, partial_word, false)) {
+  if (index > 1 && !trie_search(&trie, partial_word, false)) {
     return;
   }
 
@@ -218,50 +248,109 @@ void assign_letters(char *number, int index) {
 // STRUCT FUNCTIONS //
 //////////////////////
 
-trie_node *create_node(void) {
-  trie_node *ptr_node = (trie_node *)malloc(sizeof(trie_node));
-  ptr_node->is_end = false;
+void init_trie_arena(int initial_capacity) {
+  arena.capacity = initial_capacity;
+  arena.count = 0;
+  arena.nodes = (trie_node *)malloc(initial_capacity * sizeof(trie_node));
 
-  for (int i = 0; i < NUM_CAPITALS; i++) {
-    ptr_node->children[i] = NULL;
+  if (!arena.nodes) {
+    perror("Error during trie initialization");
+    exit(1);
+  }
+}
+
+// Nodes are indexed rather than pointed to, so they can move when the arena
+// grows
+uint32_t create_node(void) {
+  if (arena.count == arena.capacity) {
+    arena.capacity *= 2;
+    arena.nodes =
+        (trie_node *)realloc(arena.nodes, arena.capacity * sizeof(trie_node));
+
+    if (!arena.nodes) {
+      perror("Error while resizing trie");
+      exit(1);
+    }
   }
 
-  return ptr_node;
+  memset(&arena.nodes[arena.count], 0, sizeof(trie_node));
+
+  return arena.count++;
 }
 
-void trie_insert(trie_node *root, const char *key) {
-  trie_node *ptr_crawl = root;
+void trie_insert(const char *key) {
+  uint32_t crawl = 0;
   int length = strlen(key);
 
   for (int level = 0; level < length; level++) {
     int index = CHAR_TO_ALPHA_INDEX(key[level]);
 
-    if (!ptr_crawl->children[index]) {
-      ptr_crawl->children[index] = create_node();
+    if (!arena.nodes[crawl].children[index]) {
+      uint32_t child = create_node();
+      arena.nodes[crawl].children[index] = child;
     }
 
-    ptr_crawl = ptr_crawl->children[index];
+    crawl = arena.nodes[crawl].children[index];
   }
 
-  ptr_crawl->is_end = true;
+  arena.nodes[crawl].is_end = true;
 }
 
-bool trie_search(trie_node *root, const char *key, bool full_word) {
-  trie_node *ptr_crawl = root;
+// Function to copy the arena into trie in breadth-first order, then free it.
+// The order array doubles as the queue: each node's children are appended as
+// it is reached, which places siblings next to each other
+void flatten_trie() {
+  uint32_t *order = (uint32_t *)malloc(arena.count * sizeof(uint32_t));
+  trie.nodes = (flat_node *)malloc(arena.count * sizeof(flat_node));
+
+  if (!order || !trie.nodes) {
+    perror("Error while flattening trie");
+    exit(1);
+  }
+
+  int tail = 0;
+  order[tail++] = 0;
+
+  for (int head = 0; head < tail; head++) {
+    trie_node *node = &arena.nodes[order[head]];
+    flat_node *flat = &trie.nodes[head];
+
+    flat->mask = node->is_end ? END_OF_WORD_BIT : 0;
+    flat->first_child = tail;
+
+    for (int i = 0; i < NUM_CAPITALS; i++) {
+      if (node->children[i]) {
+        flat->mask |= 1u << i;
+        order[tail++] = node->children[i];
+      }
+    }
+  }
+
+  trie.count = tail;
+
+  free(order);
+  free(arena.nodes);
+  arena.nodes = NULL;
+}
+
+bool trie_search(const flat_trie *t, const char *key, bool full_word) {
+  const flat_node *crawl = &t->nodes[0];
   int length = strlen(key);
 
   for (int level = 0; level < length; level++) {
-    int index = CHAR_TO_ALPHA_INDEX(key[level]);
-    if (!ptr_crawl->children[index]) {
+    uint32_t bit = 1u << CHAR_TO_ALPHA_INDEX(key[level]);
+
+    if (!(crawl->mask & bit)) {
       return false;
     }
 
-    ptr_crawl = ptr_crawl->children[index];
+    crawl = &t->nodes[crawl->first_child +
+                      count_bits(crawl->mask & (bit - 1))];
     dict_lookups++;
   }
 
   if (full_word) {
-    return (ptr_crawl != NULL && ptr_crawl->is_end);
+    return crawl->mask & END_OF_WORD_BIT;
   }
 
   return true;
@@ -319,7 +408,8 @@ void read_words(const char *dict_filename) {
   }
 
   char word[MAX_WORD_LEN];
-  root = create_node();
+  init_trie_arena(1024);
+  create_node();
 
   while (fscanf(dictionary, "%45s", word) != EOF) {
     if (strlen(word) <= MAX_WORD_LEN) {
@@ -327,11 +417,12 @@ void read_words(const char *dict_filename) {
         word[i] = toupper(word[i]);
       }
 
-      trie_insert(root, word);
+      trie_insert(word);
     }
   }
 
   fclose(dictionary);
+  flatten_trie();
 }
 
 int compare_word_numbers(const void *a, const void *b) {
@@ -366,21 +457,25 @@ unsigned long long calculate_permutations() {
   return result;
 }
 
-void free_trie(trie_node *node) {
-  if (node == NULL) {
-    return;
-  }
+// Counts set bits with shifts and masks, since the compiler's builtin is a
+// library call unless built for a CPU with a popcount instruction
+int count_bits(uint32_t bits) {
+  bits = bits - ((bits >> 1) & 0x55555555);
+  bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+  bits = (bits + (bits >> 4)) & 0x0F0F0F0F;
 
-  for (int i = 0; i < NUM_CAPITALS; i++) {
-    free_trie(node->children[i]);
-  }
+  return (bits * 0x01010101) >> 24;
+}
 
-  free(node);
+// Both live in single blocks, whatever the number of nodes
+void free_trie() {
+  free(arena.nodes);
+  free(trie.nodes);
 }
 
 void free_word_number_array() { free(number_array.items); }
 
 void clean_up() {
-  free_trie(root);
+  free_trie();
   free_word_number_array();
 }